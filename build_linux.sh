@@ -7,7 +7,7 @@ include_dirs="-I../../include -I../../src"
 lib_dirs="-L../../libs/linux64"
 
 source_files="../../src/main.c"
-lib_files="-lglfw -lm -lGL -lX11"
+lib_files="-lglfw -lm -lGL -lEGL -lX11 -lpthread"
 output_name="simple_rt"
 
 common="$include_dirs $source_files $lib_dirs $lib_files -o $output_name"
@@ -40,7 +40,7 @@ struct Sphere
 {
     vec3 pos;
     float rad;
-    Material mat;
+    uint matId;
 };
 
 // Two triangles facing the same direction.
@@ -54,17 +54,20 @@ struct Quad
     // Texture coords
     vec2 coords[4];
     
-    Material mat;
+    uint matId;
 };
 
-const Quad defaultQuad = Quad(vec3[4](vec3(0.0f), vec3(0.0f), vec3(0.0f), vec3(0.0f)), vec2[4](vec2(0.0f), vec2(0.0f), vec2(0.0f), vec2(0.0f)), defaultMat);
-
 struct Ray
 {
     vec3 ori;
     vec3 dir;
     float minDist;
     float maxDist;
+    
+    // Ray cone: width of the footprint at ori, and the angle it grows with.
+    // Only used to pick the mip level of the textures (see TextureLod)
+    float coneWidth;
+    float coneSpread;
 };
 
 struct RayIntersection
@@ -89,11 +92,17 @@ struct HitInfo
     vec3 pos;
     vec3 normal;
     vec2 texCoords;  // x is u, y is v
+    int sphereIdx;   // -1 if the object is not a sphere
     
     Material mat;
+    
+    // Ray cone at the hit
+    float texFootprint;  // Width in texture coordinates, projected on the surface
+    float coneWidth;
+    float curvature;     // 1/radius for spheres
 };
 
-const HitInfo defaultHitInfo = HitInfo(false, vec3(0.0f), vec3(0.0f), vec2(0.0f), defaultMat);
+const HitInfo defaultHitInfo = HitInfo(false, vec3(0.0f), vec3(0.0f), vec2(0.0f), -1, defaultMat, 0.0f, 0.0f, 0.0f);
 
 vec2 Sphere2CubeUV(vec3 origin, float radius, vec3 point)
 {
@@ -305,9 +314,9 @@ vec3 RandomInHemisphere(vec3 normal)
     return dir * sign(dot(normal, dir));
 }
 
-vec3 CosineWeightedRandomDirection(vec3 normal) {
-    float r1 = RandomFloat();
-    float r2 = RandomFloat();
+vec3 CosineWeightedRandomDirection(vec3 normal, vec2 rnd) {
+    float r1 = rnd.x;
+    float r2 = rnd.y;
     
     // Spherical coordinates
     float theta = acos(sqrt(1.0f - r1));
@@ -325,290 +334,582 @@ vec3 CosineWeightedRandomDirection(vec3 normal) {
     return normalize(x * u + y * v + z * w);
 }
 
+/////////////////////////////////////////
+// Low discrepancy sampler
+
+// Every random decision of a path reads a fixed dimension of an Owen scrambled
+// Sobol sequence, indexed by the pixel's sample count. Pixels share the sequence
+// and are decorrelated by a blue noise rotation, so the error is spread as blue
+// noise on screen. See "Practical Hash-based Owen Scrambling" (Burley 2020).
+// The PCG sampler is the previous behavior, every call is a new PCG number.
+#define Sampler_Sobol 0
+#define Sampler_Pcg   1
+
+// Dimensions of a path. Each bounce has its own block; decisions which
+// don't have a dimension (e.g. internal bounces) fall back to PCG
+#define Dim_PixelJitter 0u  // 2D
+#define Dim_Aperture    2u  // 2D
+#define Dim_FirstBounce 4u
+#define DimsPerBounce   12u
+
+// Within a bounce. 2D dimensions never straddle a group of 4
+// dimensions, which share a scrambled index and are stratified together
+#define BounceDim_Alpha       0u
+#define BounceDim_Lobe        1u
+#define BounceDim_Direction   2u  // 2D
+#define BounceDim_LightSelect 4u
+#define BounceDim_Light       5u  // 2D
+#define BounceDim_Roulette    7u
+#define BounceDim_Env         8u  // 2D
+#define BounceDim_Alpha2      10u
+
+uniform int samplerType;
+uniform sampler2D blueNoise;
+
+uint sampleIndex = 0u;  // Index of the current path in the pixel's sequence
+uint bounceDim = 0u;    // First dimension of the current bounce
+ivec2 pixelCoords;      // Pixel of the current path
+
+// Direction numbers of the first 4 Sobol dimensions (Joe and Kuo)
+const uint sobolDirections[128] = uint[](
+    0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+    0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+    0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+    0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+    0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+    0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+    0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+    0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+    0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+    0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+    0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+    0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+    0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+    0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+    0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+    0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+);
+
+uint HashUInt(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Random permutation of the bits of x where each bit only depends on the lower
+// ones, which after reversing the bits is an Owen scramble (Laine and Karras 2011)
+uint NestedUniformScramble(uint x, uint seed)
+{
+    x = bitfieldReverse(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return bitfieldReverse(x);
+}
+
+uint Sobol(uint index, uint dim)
+{
+    uint res = 0u;
+    for(uint bit = 0u; index != 0u; index >>= 1, ++bit)
+    {
+        if((index & 1u) != 0u)
+            res ^= sobolDirections[dim * 32u + bit];
+    }
+    
+    return res;
+}
+
+float SobolOwen(uint index, uint dim)
+{
+    const uint seed = 0x5e1f3c7bu;
+    uint group = HashUInt(seed ^ (dim / 4u));
+    
+    // Only the low 16 bits of the index are shuffled, which is enough for the
+    // sample counts we reach and keeps the Sobol loop short
+    index = (index & 0xffff0000u) | (NestedUniformScramble(index, group) & 0xffffu);
+    uint res = NestedUniformScramble(Sobol(index, dim % 4u), HashUInt(group ^ dim));
+    return float(res >> 8) / 16777216.0f;
+}
+
+// Per pixel rotation, read at a different offset for every dimension (R2 sequence)
+float BlueNoiseShift(uint dim)
+{
+    const int size = 64;
+    ivec2 offset = ivec2(fract(vec2(0.7548776662f, 0.5698402910f) * float(dim)) * float(size));
+    ivec2 coords = (pixelCoords + offset) & (size - 1);
+    return texelFetch(blueNoise, coords, 0).x;
+}
+
+float Sample1D(uint dim)
+{
+    if(samplerType == Sampler_Pcg)
+        return RandomFloat();
+    
+    float res = SobolOwen(sampleIndex, dim) + BlueNoiseShift(dim);
+    return res >= 1.0f ? res - 1.0f : res;
+}
+
+vec2 Sample2D(uint dim)
+{
+    float x = Sample1D(dim);
+    float y = Sample1D(dim + 1u);
+    return vec2(x, y);
+}
+
+// Dimension of the current bounce
+float SampleBounce1D(uint offset) { return Sample1D(bounceDim + offset); }
+vec2  SampleBounce2D(uint offset) { return Sample2D(bounceDim + offset); }
+
 ////////////////////////////////////////
 // Config
 
 // Rendering
-const uint iterations = 30;
-const uint numBounces = 5;
+uniform uint minBounces;  // Russian roulette starts after this many bounces
+uniform uint maxBounces;  // Hard cap on the path length
 const float fov = 90.0f * DEG2RAD;
 const float focalLength = 5.0f;
 const float apertureRadius = 0.001f;
 
-// Materials
-//                                   type           emission                   color                   roughness  textures
-
-const Material emissive   = Material(MatType_Matte, vec3(10.0f, 7.0f, 6.0f),   vec3(1.0f, 1.0f, 1.0f), 1.0f,      0, 0, 0);
-const Material strongEmis = Material(MatType_Matte, vec3(90.0f, 70.0f, 60.0f), vec3(1.0f, 1.0f, 1.0f), 1.0f,      0, 0, 0);
-const Material red        = Material(MatType_Matte, vec3(0.0f),                vec3(1.0f, 0.0f, 0.0f), 1.0f,      0, 0, 0);
-const Material green      = Material(MatType_Matte, vec3(0.0f),                vec3(0.0f, 1.0f, 0.0f), 1.0f,      0, 0, 0);
-const Material blue       = Material(MatType_Matte, vec3(0.0f),                vec3(0.2f, 0.2f, 0.7f), 1.0f,      0, 1, 2);
-const Material white      = Material(MatType_Matte, vec3(0.0f),                vec3(1.0f, 1.0f, 1.0f), 1.0f,      0, 0, 0);
-const Material grey       = Material(MatType_Matte, vec3(0.0f),                vec3(0.6f, 0.6f, 0.6f), 1.0f,      0, 0, 0);
-const Material reflective = Material(MatType_Reflective, vec3(0.0f),           vec3(0.5f, 0.5f, 0.5f), 0.0f,      0, 0, 0);
-const Material gReflective = Material(MatType_Reflective, vec3(0.0f),          vec3(0.0f, 0.5f, 0.0f), 0.1f,      0, 0, 0);
-const Material rReflective = Material(MatType_Reflective, vec3(0.0f),          vec3(0.5f, 0.0f, 0.0f), 0.2f,      0, 0, 0);
-const Material bReflective = Material(MatType_Reflective, vec3(0.0f),          vec3(0.0f, 0.0f, 0.5f), 0.3f,      0, 0, 0);
-const Material rReflective2 = Material(MatType_Reflective, vec3(0.0f),         vec3(0.5f, 0.0f, 0.0f), 0.4f,      0, 0, 0);
-const Material gReflective2 = Material(MatType_Reflective, vec3(0.0f),         vec3(0.0f, 0.5f, 0.0f), 0.5f,      0, 0, 0);
-const Material wood       = Material(MatType_Reflective, vec3(0.0f),           vec3(1.0f, 1.0f, 1.0f), 1.0f,      0, 1, 2);
-const Material glass      = Material(MatType_Transparent, vec3(0.0f),          vec3(0.5f, 0.0f, 0.0f), 0.0f,      0, 0, 0);
-const Material greenGlass = Material(MatType_Transparent, vec3(0.0f),          vec3(0.0f, 0.5f, 0.0f), 0.0f,      0, 0, 0);
-const Material glossy     = Material(MatType_Glossy, vec3(0.0f),               vec3(0.6f, 0.0f, 0.0f), 0.0f,      0, 0, 0);
-const Material checkerBoard = Material(MatType_Matte, vec3(0.0f),              vec3(1.0f),             0.0f,      0, 3, 0);
-const Material leather    = Material(MatType_Reflective, vec3(0.0f),           vec3(1.0f, 1.0f, 1.0f), 1.0f,      0, 4, 5);
-const Material metal      = Material(MatType_Reflective, vec3(0.0f),           vec3(1.0f, 1.0f, 1.0f), 1.0f,      0, 6, 7);
-
-// Textures (texture arrays are supported in opengl 4.0)
+// Textures (texture arrays are supported in opengl 4.0).
+// Only the images used by the current scene are resident, so the arrays are indexed
+// through these tables (see MakeSceneResident in main.c)
 uniform sampler2DArray envMaps;
 uniform sampler2DArray textures;
+uniform int envMapLayer;  // Layer of envMap in envMaps and envCdfs
+uniform int textureLayers[8];  // Indexed by texture id, one per entry of textures[] in main.c
+
+// Texture LODs come from ray cones instead of screen space derivatives, which mean
+// nothing after the first bounce. Rough surfaces widen the cone by this angle (scaled
+// by the roughness), so that diffuse bounces read coarse levels: the texture detail
+// they blur away would only have shown up as noise
+const float roughConeSpread = 0.05f;
+uniform bool useRayCones;
+uniform bool octahedralEnvMaps;  // Otherwise equirectangular
+
+// Mip level for a footprint of the given width in texture coordinates
+float TextureLod(float footprint, float size)
+{
+    return useRayCones ? max(log2(footprint * size), 0.0f) : 0.0f;
+}
 
-vec3 SampleEnvMap(vec2 coords, uint texId)
+vec3 SampleEnvMap(vec2 coords, uint layer, float footprint)
 {
-    return texture(envMaps, vec3(coords, float(texId))).xyz;
+    float lod = TextureLod(footprint, float(textureSize(envMaps, 0).x));
+    return textureLod(envMaps, vec3(coords, float(layer)), lod).xyz;
 }
 
-vec4 SampleTexture(vec2 coords, uint texId)
+vec4 SampleTexture(vec2 coords, uint texId, float footprint)
 {
     // Avoiding a texture fetch might be faster
     if(texId == 0) return vec4(1.0f);
     
-    return texture(textures, vec3(coords, float(texId)));
-}
-
-// Scenes
-
-uint scene1_envMap = 2;
-
-// Change these values to modify the scenes
-Sphere scene1_spheres[] = Sphere[]
-//      Origin                      Radius   Material
-(Sphere(vec3(-1.2f, 0.0f,    0.5f), 0.5f,    wood),
- Sphere(vec3(0.0f,  0.0f,    0.5f), 0.5f,    leather),
- Sphere(vec3(1.2f,  0.0f,    0.5f), 0.5f,    metal)
- );
-
-Quad scene1_quads[] = Quad[]
-// vertex positions,
-// texture coordinates,
-// material
-(Quad(vec3[4](vec3(-10.0f, -0.5f, -10.0f), vec3(-10.0f, -0.5f, 10.0f), vec3(10.0f, -0.5f, -10.0f), vec3(10.0f, -0.5f, 10.0f)),
-      vec2[4](vec2(0.0f, 0.0f), vec2(0.0f, 5.0f), vec2(5.0f, 0.0f), vec2(5.0f, 5.0f)),
-      wood)
- );
-
-uint scene2_envMap = 4;
-
-// Change these values to modify the scenes
-Sphere scene2_spheres[] = Sphere[]
-//      Origin                      Radius   Material
-(Sphere(vec3(-1.2f, 0.0f,    0.5f), 0.5f,    emissive),
- Sphere(vec3(-1.0f, 4.0f,    1.5f), 0.5f,    strongEmis),
- Sphere(vec3(1.0f,  4.0f,    1.5f), 0.5f,    strongEmis),
- Sphere(vec3(1.0f,  4.0f,    -1.5f), 0.5f,   strongEmis),
- Sphere(vec3(-1.0f, 4.0f,    -1.5f), 0.5f,   strongEmis),
- Sphere(vec3(0.0f,  0.0f,    0.5f), 0.5f,    reflective),
- Sphere(vec3(1.2f,  0.0f,    0.5f), 0.5f,    glass)
- );
-
-Quad scene2_quads[] = Quad[]
-// vertex positions,
-// texture coordinates,
-// material
-(Quad(vec3[4](vec3(-10.0f, -0.5f, -10.0f), vec3(-10.0f, -0.5f, 10.0f), vec3(10.0f, -0.5f, -10.0f), vec3(10.0f, -0.5f, 10.0f)),
-      vec2[4](vec2(0.0f, 0.0f), vec2(0.0f, 5.0f), vec2(5.0f, 0.0f), vec2(5.0f, 5.0f)),
-      wood)
- );
-
-uint scene3_envMap = 3;
-
-// Change these values to modify the scenes
-Sphere scene3_spheres[] = Sphere[]
-//      Origin                      Radius   Material
-(Sphere(vec3(-1.2f, 0.0f,    0.5f), 0.5f,    glass),
- Sphere(vec3(0.0f,  0.0f,    0.5f), 0.5f,    greenGlass),
- Sphere(vec3(1.2f,  0.0f,    0.5f), 0.5f,    glossy),
- Sphere(vec3(1.2f,  0.0f,    -1.0f), 0.5f,   checkerBoard),
- Sphere(vec3(-1.0f, 4.0f,    1.5f), 0.5f,    strongEmis),
- Sphere(vec3(1.0f,  4.0f,    1.5f), 0.5f,    strongEmis),
- Sphere(vec3(1.0f,  4.0f,    -1.5f), 0.5f,   strongEmis),
- Sphere(vec3(-1.0f, 4.0f,    -1.5f), 0.5f,   strongEmis)
- );
-
-Quad scene3_quads[] = Quad[]
-// vertex positions,
-// texture coordinates,
-// material
-(Quad(vec3[4](vec3(-10.0f, -0.5f, -10.0f), vec3(-10.0f, -0.5f, 10.0f), vec3(10.0f, -0.5f, -10.0f), vec3(10.0f, -0.5f, 10.0f)),
-      vec2[4](vec2(0.0f, 0.0f), vec2(0.0f, 5.0f), vec2(5.0f, 0.0f), vec2(5.0f, 5.0f)),
-      wood)
- );
-
-uint scene4_envMap = 0;
-
-// Change these values to modify the scenes
-Sphere scene4_spheres[] = Sphere[]
-//      Origin                      Radius   Material
-(Sphere(vec3(-1.2f, 0.0f,    0.5f), 0.5f,    reflective),
- Sphere(vec3(0.0f,  0.0f,    0.5f), 0.5f,    gReflective),
- Sphere(vec3(1.2f,  0.0f,    0.5f), 0.5f,    rReflective),
- Sphere(vec3(-1.2f, 0.0f,    -1.0f), 0.5f,    bReflective),
- Sphere(vec3(0.0f,  0.0f,    -1.0f), 0.5f,    rReflective2),
- Sphere(vec3(1.2f,  0.0f,    -1.0f), 0.5f,    gReflective2)
- );
-
-Quad scene4_quads[] = Quad[]
-// vertex positions,
-// texture coordinates,
-// material
-(Quad(vec3[4](vec3(-10.0f, -0.5f, -10.0f), vec3(-10.0f, -0.5f, 10.0f), vec3(10.0f, -0.5f, -10.0f), vec3(10.0f, -0.5f, 10.0f)),
-      vec2[4](vec2(0.0f, 0.0f), vec2(0.0f, 5.0f), vec2(5.0f, 0.0f), vec2(5.0f, 5.0f)),
-      wood)
- );
+    float lod = TextureLod(footprint, float(textureSize(textures, 0).x));
+    return textureLod(textures, vec3(coords, float(textureLayers[texId])), lod);
+}
+
+// Equirectangular maps cover 2 pi radians horizontally. In octahedral ones, the
+// center and the middle of an edge are a quarter turn apart, so they cover about pi
+float EnvMapFootprint(float coneSpread)
+{
+    return octahedralEnvMaps ? coneSpread / PI : coneSpread / (2.0f * PI);
+}
+
+// Called when a bounce changes the direction of the ray
+void SpreadRayCone(inout Ray ray, HitInfo hit, float roughness)
+{
+    ray.coneSpread += 2.0f * hit.curvature * ray.coneWidth + roughness * roughConeSpread;
+}
+
+// Scene data, uploaded by main.c as texture buffers.
+// See SphereTexels, QuadTexels and MaterialTexels in scene.c for the layout
+uniform samplerBuffer sceneSpheres;
+uniform samplerBuffer sceneQuads;
+uniform samplerBuffer sceneMaterials;
+uniform int numSpheres;
+uniform int numQuads;
+
+// Scene variants (see GetSceneVariant in main.c) define SCENE_VARIANT and get the
+// environment and the material types used by the scene as constants, so everything
+// else folds away at compile time. The generic program reads them from uniforms.
+#ifdef SCENE_VARIANT
+const int envMap = SCENE_ENV_MAP;
+#else
+uniform int envMap;  // Negative if the scene has no environment
+#define SCENE_HAS_MATTE       1
+#define SCENE_HAS_REFLECTIVE  1
+#define SCENE_HAS_GLOSSY      1
+#define SCENE_HAS_TRANSPARENT 1
+#define SCENE_HAS_LIGHTS      1
+#endif
+
+// Bounding volume hierarchy over the scene, see bvh.c for the node layout
+#define BVH_STACK_SIZE 32
+#define PRIM_REF_QUAD_BIT 0x80000000u
+uniform samplerBuffer bvhNodes;
+uniform usamplerBuffer bvhPrims;
+uniform bool useBvh;  // Otherwise loop over every object (for benchmarking)
+
+// Emissive spheres, sampled explicitly by the diffuse models (next event estimation)
+uniform usamplerBuffer sceneLights;
+uniform int numLights;
+uniform bool useNee;
+
+// Importance sampling tables of the environment maps, see BuildEnvMapCdf in image.c
+uniform sampler2DArray envCdfs;
+uniform bool useEnvSampling;
+
+bool SphereLightSamplingEnabled() { return SCENE_HAS_LIGHTS != 0 && useNee && numLights > 0; }
+bool EnvSamplingEnabled()         { return useEnvSampling && envMap >= 0; }
+
+Sphere GetSphere(int idx)
+{
+    vec4 posRad = texelFetch(sceneSpheres, idx * 2);
+    vec4 extra  = texelFetch(sceneSpheres, idx * 2 + 1);
+    return Sphere(posRad.xyz, posRad.w, uint(extra.x));
+}
+
+Quad GetQuad(int idx)
+{
+    int base = idx * 6;
+    vec4 p0 = texelFetch(sceneQuads, base);
+    vec4 p1 = texelFetch(sceneQuads, base + 1);
+    vec4 p2 = texelFetch(sceneQuads, base + 2);
+    vec4 p3 = texelFetch(sceneQuads, base + 3);
+    vec4 c01 = texelFetch(sceneQuads, base + 4);
+    vec4 c23 = texelFetch(sceneQuads, base + 5);
+    return Quad(vec3[4](p0.xyz, p1.xyz, p2.xyz, p3.xyz),
+                vec2[4](c01.xy, c01.zw, c23.xy, c23.zw),
+                uint(p0.w));
+}
+
+Material GetMaterial(uint id)
+{
+    int base = int(id) * 3;
+    vec4 ids = texelFetch(sceneMaterials, base);
+    vec4 emissionRoughness = texelFetch(sceneMaterials, base + 1);
+    vec4 color = texelFetch(sceneMaterials, base + 2);
+    return Material(uint(ids.x), emissionRoughness.xyz, color.xyz, emissionRoughness.w,
+                    uint(ids.y), uint(ids.z), uint(ids.w));
+}
 
 /////////////////////////////////////////
 // Main
 
-in vec2 texCoords;
-out vec4 fragColor;
-
 uniform vec2 resolution;
 uniform uint frameId;
-uniform uint frameAccum;
+uniform uint numSamples;    // Paths per pixel in this frame
+uniform uint accumSamples;  // Paths per pixel already accumulated
 uniform vec3 cameraPos;
 uniform vec2 cameraAngle;
 uniform float exposure;
 
+#ifdef IMAGE_ACCUMULATION
+// Updated in place: the sum of the pixel's samples, with their count in alpha.
+// Each pixel is only read and written by its own invocation
+layout(rgba32f) uniform image2D accumImage;
+layout(rgba32f) uniform image2D accumMoments;
+#else
 uniform sampler2D previousFrame;
+uniform sampler2D previousMoments;
+#endif
 
-uniform uint scene;
+// Adaptive sampling
+uniform bool adaptiveSampling;
+uniform float convergenceThreshold;  // Standard error at which a pixel stops being sampled
+uniform uint minAdaptiveSamples;     // Pixels are never considered converged before this
 
+vec3 SampleLightsDiffuse(vec3 pos, vec3 normal, vec3 albedo, Ray bounce);
+vec3 SampleLightsMicrofacet(vec3 pos, vec3 normal, vec3 outDir, vec3 color, float exponent, Ray bounce);
+float MicrofacetReflectionPdf(float exponent, vec3 normal, vec3 outDir, vec3 inDir);
 void MatteModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, inout vec3 rayColor);
 void ReflectiveModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, inout vec3 rayColor, inout int iter);
 void TransparentModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, inout vec3 rayColor);
 void GlossyModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, inout vec3 rayColor);
 
 vec3 CameraFrame2World(vec3 v, float yaw, float pitch);
-vec3 SampleEnvMap(vec3 dir, uint mapId);
-vec3 SampleSceneEnvMap(vec3 dir, uint scene);
+vec3 SampleEnvMap(vec3 dir, uint layer, float footprint);
+vec3 SampleSceneEnvMap(vec3 dir, float footprint);
 vec3 FresnelSchlick(vec3 color, vec3 normal, vec3 outDir);
 float FresnelSchlick(float value, vec3 normal, vec3 outDir);
 vec3 SampleMicrofacetNormal(float exponent, vec3 normal, vec2 rnd);
 
 HitInfo RaySceneIntersection(Ray ray);
+bool RaySceneOcclusion(Ray ray);
+float LightPdf(vec3 pos, Sphere light);
+float EnvPdf(vec3 dir);
+float PowerHeuristic(float pdfA, float pdfB);
+float ConvergenceRatio(vec4 moments);
+float DisplayLuminance(vec3 color);
+vec4 PreviousMoments();
+bool PixelConverged(vec4 prevMoments);
+Ray GenerateCameraRay(vec2 fragCoord);
+void AccumulateSamples(vec3 finalColor, vec4 prevMoments, out vec4 color, out vec4 moments);
+
+// Next event estimation state of the current path. If the last bounce sampled
+// the lights, hitting one of them is weighted against the light sample with MIS
+bool neeBounce = false;
+vec3 neePos;
+float neeBsdfPdf;
+
+// The fragment shader traces all paths of a pixel in one invocation.
+// With WAVEFRONT_KERNEL the same code is used by the kernels in wavefront.glsl,
+// and with REPROJECTION_PASS by reproject.glsl
+#if !defined(WAVEFRONT_KERNEL) && !defined(REPROJECTION_PASS)
+#ifndef IMAGE_ACCUMULATION
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec4 fragMoments;  // See ConvergenceRatio
+#endif
 
 void main()
 {
+    pixelCoords = ivec2(gl_FragCoord.xy);
+    
+    // Converged pixels keep their value and don't trace anything
+    vec4 prevMoments = PreviousMoments();
+    if(PixelConverged(prevMoments))
+    {
+#ifndef IMAGE_ACCUMULATION
+        fragColor = texelFetch(previousFrame, pixelCoords, 0);
+        fragMoments = prevMoments;
+#endif
+        return;
+    }
+    
     // Make sure we don't reuse pixelIds from one frame to the next
     uint pixelId = uint(gl_FragCoord.y * resolution.x + gl_FragCoord.x);
     uint lastId  = uint(resolution.y * resolution.x + resolution.x);
     // Initialize rngState (our seed)
     rngState = pixelId + (lastId + 1u) * uint(frameId);
     
-    // Randomly nudge the coordinate to achieve antialiasing
-    vec2 nudgedUv = gl_FragCoord.xy + (RandomFloat() - 0.5f);  // Move 0.5 to the left and right
-    nudgedUv = clamp(nudgedUv, vec2(0.0f), resolution.xy);
-    nudgedUv /= resolution.xy;
-    
-    vec2 coord = 2.0f * nudgedUv - 1.0f;
-    coord *= tan(fov / 2.0f);
-    coord.y *= resolution.y / resolution.x;
-    
-    vec3 cameraLookat = normalize(vec3(coord, 1.0f));
-    // Rotate to lookAt vector according to camera rotation
-    vec3 worldCameraLookat = normalize(CameraFrame2World(cameraLookat, cameraAngle.x, cameraAngle.y));
-    
-    // Depth of field effect
-    vec3 focalPoint = cameraPos + worldCameraLookat * focalLength;
-    float radius = sqrt(RandomFloat());
-    float angle  = RandomFloat() * 2 * PI;
-    vec2 apertureOffset = apertureRadius * vec2(cos(angle)*radius, sin(angle)*radius);
-    vec3 apertureSample = cameraPos + CameraFrame2World(vec3(apertureOffset, 0.0f), cameraAngle.x, cameraAngle.y);
-    
-    vec3 rayDirection = normalize(focalPoint - apertureSample);
-    Ray cameraRay = Ray(apertureSample, rayDirection, 0.0001f, 10000.0f);
-    
     vec3 finalColor = vec3(0.0f);
-    for(int j = 0; j < iterations; ++j)
+    for(int j = 0; j < numSamples; ++j)
     {
-        Ray currentRay = cameraRay;
+        sampleIndex = uint(prevMoments.z) + uint(j);
+        Ray currentRay = GenerateCameraRay(gl_FragCoord.xy);
         
         // Product of all object colors/multiplicative terms that the ray has hit up to now
         vec3 rayColor = vec3(1.0f);
         vec3 luminance = vec3(0.0f);
-        for(int i = 0; i < numBounces; ++i)
+        neeBounce = false;
+        for(int i = 0; i < maxBounces; ++i)
         {
+            bounceDim = Dim_FirstBounce + uint(i) * DimsPerBounce;
             vec3 outDir = -currentRay.dir;
             HitInfo hit = RaySceneIntersection(currentRay);
             
             if(!hit.hit)
             {
-                luminance += SampleSceneEnvMap(currentRay.dir, scene) * rayColor;
+                // The environment might have been sampled already
+                vec3 envLight = SampleSceneEnvMap(currentRay.dir, EnvMapFootprint(currentRay.coneSpread));
+                if(neeBounce && EnvSamplingEnabled())
+                    envLight *= PowerHeuristic(neeBsdfPdf, EnvPdf(currentRay.dir));
+                
+                luminance += envLight * rayColor;
                 break;
             }
             
+            // Emissive spheres are lights, which might have been sampled already
+            if(neeBounce && SphereLightSamplingEnabled() && hit.sphereIdx != -1)
+            {
+                float lightPdf = LightPdf(neePos, GetSphere(hit.sphereIdx));
+                hit.mat.emissionScale *= PowerHeuristic(neeBsdfPdf, lightPdf);
+            }
+            
+            neeBounce = false;
+            currentRay.coneWidth = hit.coneWidth;
+            
             // Ray hit something
             Material mat = hit.mat;
             
             // Choose new ray position and direction
             switch(mat.matType)
             {
+#if SCENE_HAS_MATTE
                 case MatType_Matte:
                 {
                     MatteModel(hit, currentRay, luminance, rayColor);
                     break;
                 }
+#endif
+#if SCENE_HAS_REFLECTIVE
                 case MatType_Reflective:
                 {
                     ReflectiveModel(hit, currentRay, luminance, rayColor, i);
                     break;
                 }
+#endif
+#if SCENE_HAS_TRANSPARENT
                 case MatType_Transparent:
                 {
                     TransparentModel(hit, currentRay, luminance, rayColor);
                     break;
                 }
+#endif
+#if SCENE_HAS_GLOSSY
                 case MatType_Glossy:
                 {
                     GlossyModel(hit, currentRay, luminance, rayColor);
                     break;
                 }
+#endif
+                default: break;
+            }
+            
+            // Russian roulette: paths that carry little energy are likely to be terminated,
+            // the survivors are boosted to compensate
+            if(i + 1 >= minBounces)
+            {
+                float survival = min(max(rayColor.r, max(rayColor.g, rayColor.b)), 1.0f);
+                if(SampleBounce1D(BounceDim_Roulette) >= survival)
+                    break;
+                
+                rayColor /= survival;
             }
         }
         
         finalColor += luminance;
     }
     
-    finalColor /= float(iterations);
+    finalColor /= float(numSamples);
+#ifdef IMAGE_ACCUMULATION
+    vec4 color, moments;
+    AccumulateSamples(finalColor, prevMoments, color, moments);
+    imageStore(accumImage, pixelCoords, color);
+    imageStore(accumMoments, pixelCoords, moments);
+#else
+    AccumulateSamples(finalColor, prevMoments, fragColor, fragMoments);
+#endif
+}
+#endif
+
+vec4 PreviousMoments()
+{
+    if(accumSamples == 0) return vec4(0.0f);
+#ifdef IMAGE_ACCUMULATION
+    return imageLoad(accumMoments, pixelCoords);
+#else
+    return texelFetch(previousMoments, pixelCoords, 0);
+#endif
+}
+
+bool PixelConverged(vec4 prevMoments)
+{
+    return adaptiveSampling && prevMoments.z >= float(minAdaptiveSamples) && ConvergenceRatio(prevMoments) <= 1.0f;
+}
+
+// Camera ray through a random point of the pixel, with depth of field
+Ray GenerateCameraRay(vec2 fragCoord)
+{
+    // Randomly nudge the coordinate to achieve antialiasing
+    vec2 nudgedUv = fragCoord + (Sample2D(Dim_PixelJitter) - 0.5f);  // Move 0.5 in each direction
+    nudgedUv = clamp(nudgedUv, vec2(0.0f), resolution.xy);
+    nudgedUv /= resolution.xy;
+    
+    vec2 coord = 2.0f * nudgedUv - 1.0f;
+    coord *= tan(fov / 2.0f);
+    coord.y *= resolution.y / resolution.x;
     
-    // Progressive rendering
+    vec3 cameraLookat = normalize(vec3(coord, 1.0f));
+    // Rotate to lookAt vector according to camera rotation
+    vec3 worldCameraLookat = normalize(CameraFrame2World(cameraLookat, cameraAngle.x, cameraAngle.y));
+    
+    // Depth of field effect
+    vec3 focalPoint = cameraPos + worldCameraLookat * focalLength;
+    vec2 apertureRnd = Sample2D(Dim_Aperture);
+    float radius = sqrt(apertureRnd.x);
+    float angle  = apertureRnd.y * 2 * PI;
+    vec2 apertureOffset = apertureRadius * vec2(cos(angle)*radius, sin(angle)*radius);
+    vec3 apertureSample = cameraPos + CameraFrame2World(vec3(apertureOffset, 0.0f), cameraAngle.x, cameraAngle.y);
+    
+    vec3 rayDirection = normalize(focalPoint - apertureSample);
+    float pixelSpread = 2.0f * tan(fov / 2.0f) / resolution.x;
+    return Ray(apertureSample, rayDirection, 0.0001f, 10000.0f, 0.0f, pixelSpread);
+}
+
+// Progressive rendering, weighted by the number of samples. Pixels
+// can skip frames, so each one keeps its own sample count
+void AccumulateSamples(vec3 finalColor, vec4 prevMoments, out vec4 color, out vec4 moments)
+{
+    float pixelSamples = prevMoments.z;
+    float weight = float(numSamples) / (pixelSamples + float(numSamples));
+#ifdef IMAGE_ACCUMULATION
+    // Only summed, the present pass divides by the count in alpha
+    color = vec4(finalColor, 1.0f) * float(numSamples);
+    if(pixelSamples != 0.0f)
+        color += imageLoad(accumImage, pixelCoords);
+#else
     vec4 curColor = vec4(finalColor, 1.0f);
-    if(frameAccum != 0)
+    if(pixelSamples != 0.0f)
     {
-        float weight = 1.0f / float(frameAccum);
-        vec4 prevColor = texture(previousFrame, texCoords);
-        fragColor = prevColor * (1.0f - weight) + curColor * weight;
+        vec4 prevColor = texelFetch(previousFrame, pixelCoords, 0);
+        color = prevColor * (1.0f - weight) + curColor * weight;
     }
     else
-        fragColor = curColor;
+        color = curColor;
+#endif
+    
+    float lum = DisplayLuminance(finalColor);
+    vec2 lumMoments = mix(prevMoments.xy, vec2(lum, lum * lum), weight);
+    moments = vec4(lumMoments, pixelSamples + float(numSamples), prevMoments.w + 1.0f);
+}
+
+// Luminance after the same tonemapping as the present pass (at exposure 0),
+// so that convergence is measured on what ends up on screen
+float DisplayLuminance(vec3 color)
+{
+    float lum = max(dot(color, vec3(0.2126f, 0.7152f, 0.0722f)), 0.0f);
+    lum = (0.9f*lum*lum + 0.02f*lum) / (0.87f*lum*lum + 0.35f*lum + 0.14f);
+    return pow(lum, 1.0f / 2.2f);
+}
+
+// Moments are (mean display luminance, mean squared display luminance, samples, frames)
+// where the means are over the per-frame estimates, weighted by their samples. Frames
+// can have any number of samples: the weighted variance of k frame estimates is
+// (k - 1) times the squared standard error of their mean. Returns the standard error
+// of the pixel over the threshold, so the pixel is converged if it's <= 1.
+// Same as in cpu_pathtracer.c and the present pass
+float ConvergenceRatio(vec4 moments)
+{
+    if(moments.w < 2.0f) return 1e6f;  // No estimate of the variance yet
+    
+    float mean = moments.x;
+    float frameVariance = max(moments.y - mean * mean, 0.0f);
+    float error = sqrt(frameVariance / (moments.w - 1.0f));
+    return error / convergenceThreshold;
 }
 
 void MatteModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, inout vec3 rayColor)
 {
     Material mat = hit.mat;
     
-    vec4 matColor = SampleTexture(hit.texCoords, mat.color) * vec4(mat.colorScale, 1.0f);
+    vec4 matColor = SampleTexture(hit.texCoords, mat.color, hit.texFootprint) * vec4(mat.colorScale, 1.0f);
     
     currentRay.ori = hit.pos;
     
-    if(RandomFloat() > matColor.a)
+    if(SampleBounce1D(BounceDim_Alpha) > matColor.a)
         return;
     
     //currentRay.dir = normalize(hit.normal + RandomDirection());
-    currentRay.dir = CosineWeightedRandomDirection(hit.normal);
+    currentRay.dir = CosineWeightedRandomDirection(hit.normal, SampleBounce2D(BounceDim_Direction));
+    SpreadRayCone(currentRay, hit, 1.0f);
     
-    vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission).xyz * mat.emissionScale;
+    vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission, hit.texFootprint).xyz * mat.emissionScale;
     luminance += emittedLight * rayColor;
+    
+    if(SphereLightSamplingEnabled() || EnvSamplingEnabled())
+    {
+        luminance += SampleLightsDiffuse(hit.pos, hit.normal, matColor.xyz, currentRay) * rayColor;
+        neeBounce  = true;
+        neePos     = hit.pos;
+        neeBsdfPdf = max(dot(hit.normal, currentRay.dir), 0.0f) / PI;
+    }
+    
     rayColor *= matColor.xyz;
 }
 
@@ -616,31 +917,43 @@ void ReflectiveModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, in
 {
     Material mat = hit.mat;
     
-    vec4 matColor = SampleTexture(hit.texCoords, mat.color) * vec4(mat.colorScale, 1.0f);
-    if(RandomFloat() > matColor.a)
+    vec4 matColor = SampleTexture(hit.texCoords, mat.color, hit.texFootprint) * vec4(mat.colorScale, 1.0f);
+    if(SampleBounce1D(BounceDim_Alpha) > matColor.a)
     {
         currentRay.ori = hit.pos;
         return;
     }
     
-    float matRoughness = SampleTexture(hit.texCoords, mat.roughness).x * mat.roughnessScale;
+    float matRoughness = SampleTexture(hit.texCoords, mat.roughness, hit.texFootprint).x * mat.roughnessScale;
     matRoughness = clamp(matRoughness, 0.0f, 1.0f);
+    float exponent = 2.0f / (matRoughness * matRoughness);
+    
+    // Lights are only sampled for the first scattering event,
+    // paths which reach them after internal bounces are not MIS weighted
+    vec3 outDir = -currentRay.dir;
+    bool sampleLights = (SphereLightSamplingEnabled() || EnvSamplingEnabled()) && matRoughness > 0.0001f;
+    if(sampleLights)
+    {
+        Ray bounce = currentRay;
+        SpreadRayCone(bounce, hit, matRoughness);
+        luminance += SampleLightsMicrofacet(hit.pos, hit.normal, outDir, matColor.rgb, exponent, bounce) * rayColor;
+    }
     
     vec3 direction = currentRay.dir;  // Current direction caused by internal bounce
+    bool firstEvent = true;
     // Simulate internal bounces and count them as normal bounces, because they're quite expensive
-    while(iter < numBounces)
+    while(iter < maxBounces)
     {
         vec3 normal = hit.normal;
         if(matRoughness > 0.0001f)
         {
-            vec2 rnd = vec2(RandomFloat(), RandomFloat());
-            float exponent = 2.0f / (matRoughness * matRoughness);
+            vec2 rnd = firstEvent ? SampleBounce2D(BounceDim_Direction) : vec2(RandomFloat(), RandomFloat());
             normal = SampleMicrofacetNormal(exponent, hit.normal, rnd);
         }
         
         vec3 reflection = reflect(direction, normal);
         vec3 fresnel = FresnelSchlick(matColor.rgb, normal, -direction);
-        vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission).xyz * mat.emissionScale;
+        vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission, hit.texFootprint).xyz * mat.emissionScale;
         luminance += emittedLight * rayColor;
         rayColor *= fresnel;
         
@@ -653,9 +966,18 @@ void ReflectiveModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, in
         {
             currentRay.ori = hit.pos;
             currentRay.dir = reflection;
+            SpreadRayCone(currentRay, hit, matRoughness);
+            
+            if(sampleLights && firstEvent)
+            {
+                neeBounce  = true;
+                neePos     = hit.pos;
+                neeBsdfPdf = MicrofacetReflectionPdf(exponent, hit.normal, outDir, reflection);
+            }
             break;
         }
         
+        firstEvent = false;
         ++iter;
     }
 }
@@ -664,19 +986,22 @@ void TransparentModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, i
 {
     Material mat  = hit.mat;
     vec3 outDir   = -currentRay.dir;
-    vec4 matColor = SampleTexture(hit.texCoords, mat.color) * vec4(mat.colorScale, 1.0f);
+    vec4 matColor = SampleTexture(hit.texCoords, mat.color, hit.texFootprint) * vec4(mat.colorScale, 1.0f);
     
     currentRay.ori = hit.pos;
     
-    if(RandomFloat() > matColor.a)
+    if(SampleBounce1D(BounceDim_Alpha) > matColor.a)
         return;
     
-    vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission).xyz * mat.emissionScale;
+    vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission, hit.texFootprint).xyz * mat.emissionScale;
     luminance += emittedLight * rayColor;
     
     float fresnel = FresnelSchlick(0.04f, hit.normal, outDir);
-    if(RandomFloat() < fresnel)
+    if(SampleBounce1D(BounceDim_Lobe) < fresnel)
+    {
         currentRay.dir = reflect(currentRay.dir, hit.normal);
+        SpreadRayCone(currentRay, hit, 0.0f);
+    }
     else
         rayColor *= matColor.xyz;  // Go through the object
 }
@@ -686,20 +1011,238 @@ void GlossyModel(HitInfo hit, inout Ray currentRay, inout vec3 luminance, inout
     Material mat = hit.mat;
     vec3 outDir = -currentRay.dir;
     float fresnel = FresnelSchlick(0.04f, hit.normal, outDir);
-    if(RandomFloat() < fresnel)
+    if(SampleBounce1D(BounceDim_Lobe) < fresnel)
     {
-        vec4 matColor = SampleTexture(hit.texCoords, mat.color) * vec4(mat.colorScale, 1.0f);
-        if(RandomFloat() <= matColor.a)
+        vec4 matColor = SampleTexture(hit.texCoords, mat.color, hit.texFootprint) * vec4(mat.colorScale, 1.0f);
+        if(SampleBounce1D(BounceDim_Alpha2) <= matColor.a)
         {
-            vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission).xyz * mat.emissionScale;
+            vec3 emittedLight = SampleTexture(hit.texCoords, mat.emission, hit.texFootprint).xyz * mat.emissionScale;
             luminance += emittedLight * rayColor;
             currentRay.dir = reflect(currentRay.dir, hit.normal);
+            SpreadRayCone(currentRay, hit, 0.0f);
         }
     }
     else
         MatteModel(hit, currentRay, luminance, rayColor);
 }
 
+float PowerHeuristic(float pdfA, float pdfB)
+{
+    float a2 = pdfA * pdfA;
+    return a2 / (a2 + pdfB * pdfB);
+}
+
+// Returns 1 - cos of the half angle of the cone that contains the sphere,
+// as seen from pos. 0 if pos is inside the sphere.
+float SphereConeSize(vec3 pos, Sphere sphere)
+{
+    vec3 toCenter = sphere.pos - pos;
+    float dist2 = dot(toCenter, toCenter);
+    float rad2 = sphere.rad * sphere.rad;
+    if(dist2 <= rad2) return 0.0f;
+    
+    float sinMax2 = rad2 / dist2;
+    float cosMax = sqrt(1.0f - sinMax2);
+    return sinMax2 / (1.0f + cosMax);  // Same as 1 - cosMax, without the cancellation
+}
+
+// Solid angle pdf of sampling a direction towards the light from pos
+float LightPdf(vec3 pos, Sphere light)
+{
+    float cone = SphereConeSize(pos, light);
+    if(cone <= 0.0f) return 0.0f;
+    return 1.0f / (float(numLights) * 2.0f * PI * cone);
+}
+
+// Picks one of the lights and samples a direction in its cone. Returns false if
+// the light is occluded or not visible from pos, otherwise its emission along dir
+bool SampleSphereLight(vec3 pos, vec3 normal, Ray bounce, out vec3 dir, out vec3 emission, out float lightPdf)
+{
+    int lightIdx = min(int(SampleBounce1D(BounceDim_LightSelect) * float(numLights)), numLights - 1);
+    vec2 rnd = SampleBounce2D(BounceDim_Light);
+    float r1 = rnd.x;
+    float r2 = rnd.y;
+    
+    Sphere light = GetSphere(int(texelFetch(sceneLights, lightIdx).x));
+    float cone = SphereConeSize(pos, light);
+    if(cone <= 0.0f) return false;
+    
+    // Uniformly sample the cone
+    float cosTheta = 1.0f - r1 * cone;
+    float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * PI * r2;
+    vec3 w = normalize(light.pos - pos);
+    vec3 u = normalize(cross((abs(w.x) > 0.1f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f)), w));
+    vec3 v = cross(w, u);
+    dir = normalize(sinTheta * cos(phi) * u + sinTheta * sin(phi) * v + cosTheta * w);
+    if(dot(normal, dir) <= 0.0f) return false;
+    
+    Ray shadowRay = Ray(pos, dir, 0.0001f, 10000.0f, 0.0f, 0.0f);
+    RayIntersection lightHit = RaySphereIntersection(shadowRay, light);
+    if(!lightHit.hit) return false;
+    
+    shadowRay.maxDist = lightHit.dist * 0.999f;
+    if(RaySceneOcclusion(shadowRay)) return false;
+    
+    Material mat = GetMaterial(light.matId);
+    vec2 lightCoords = Sphere2CubeUV(light.pos, light.rad, pos + dir * lightHit.dist);
+    // Same footprint as a bounce that hits the light, see RaySceneIntersection
+    vec3 lightNormal = normalize(pos + dir * lightHit.dist - light.pos);
+    float coneWidth = bounce.coneWidth + bounce.coneSpread * lightHit.dist;
+    float footprint = coneWidth * 0.5f / light.rad / max(abs(dot(lightNormal, dir)), 0.01f);
+    emission = SampleTexture(lightCoords, mat.emission, footprint).xyz * mat.emissionScale;
+    lightPdf = 1.0f / (float(numLights) * 2.0f * PI * cone);
+    return true;
+}
+
+// Reads one value of the CDF tables, 0 before the start
+float EnvCdf(int idx, int row)
+{
+    if(idx < 0) return 0.0f;
+    return texelFetch(envCdfs, ivec3(idx, row, envMapLayer), 0).x;
+}
+
+// Returns the first index in [0, count) with a CDF value greater than u
+int SampleEnvCdf(int row, int count, float u)
+{
+    int lo = 0;
+    int hi = count - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(EnvCdf(mid, row) > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    
+    return lo;
+}
+
+// Samples a direction proportionally to the scene's environment map luminance
+vec3 SampleEnvDirection(out float pdf)
+{
+    ivec2 size = textureSize(envCdfs, 0).xy;
+    int width  = size.x;
+    int height = size.y - 1;  // The last row holds the marginal CDF
+    vec2 rnd = SampleBounce2D(BounceDim_Env);
+    float u1 = rnd.x;
+    float u2 = rnd.y;
+    
+    int y = SampleEnvCdf(height, height, u1);
+    float y0 = EnvCdf(y - 1, height);
+    float y1 = EnvCdf(y, height);
+    int x = SampleEnvCdf(y, width, u2);
+    float x0 = EnvCdf(x - 1, y);
+    float x1 = EnvCdf(x, y);
+    
+    // Reuse the random numbers for the position inside of the texel
+    float fx = clamp((u2 - x0) / max(x1 - x0, 1e-12f), 0.0f, 0.9999f);
+    float fy = clamp((u1 - y0) / max(y1 - y0, 1e-12f), 0.0f, 0.9999f);
+    float u = (float(x) + fx) / float(width);
+    float v = (float(y) + fy) / float(height);
+    
+    // Inverse of the mapping in SampleEnvMap
+    float theta = v * PI;
+    float phi = u * 2.0f * PI - PI;
+    float sinTheta = sin(theta);
+    
+    pdf = 0.0f;
+    if(sinTheta > 0.0f)
+        pdf = (x1 - x0) * (y1 - y0) * float(width * height) / (2.0f * PI * PI * sinTheta);
+    
+    return vec3(sinTheta * cos(phi), cos(theta), sinTheta * sin(phi));
+}
+
+// Solid angle pdf of SampleEnvDirection
+float EnvPdf(vec3 dir)
+{
+    ivec2 size = textureSize(envCdfs, 0).xy;
+    int width  = size.x;
+    int height = size.y - 1;
+    
+    float u = (atan(dir.z, dir.x) + PI) / (2*PI);
+    float theta = acos(clamp(dir.y, -1.0f, 1.0f));
+    float sinTheta = sin(theta);
+    if(sinTheta <= 0.0f) return 0.0f;
+    
+    int x = clamp(int(u * float(width)), 0, width - 1);
+    int y = clamp(int(theta / PI * float(height)), 0, height - 1);
+    float pdfX = EnvCdf(x, y) - EnvCdf(x - 1, y);
+    float pdfY = EnvCdf(y, height) - EnvCdf(y - 1, height);
+    return pdfX * pdfY * float(width * height) / (2.0f * PI * PI * sinTheta);
+}
+
+// Samples a direction towards the environment. Returns false if it's occluded
+bool SampleEnvLight(vec3 pos, vec3 normal, Ray bounce, out vec3 dir, out vec3 emission, out float lightPdf)
+{
+    dir = SampleEnvDirection(lightPdf);
+    if(lightPdf <= 0.0f || dot(normal, dir) <= 0.0f) return false;
+    
+    Ray shadowRay = Ray(pos, dir, 0.0001f, 10000.0f, 0.0f, 0.0f);
+    if(RaySceneOcclusion(shadowRay)) return false;
+    
+    emission = SampleSceneEnvMap(dir, EnvMapFootprint(bounce.coneSpread));
+    return true;
+}
+
+float DiffuseLightWeight(vec3 normal, vec3 dir, float lightPdf)
+{
+    float cosine = dot(normal, dir);
+    float bsdfPdf = cosine / PI;
+    return (cosine / PI) / lightPdf * PowerHeuristic(lightPdf, bsdfPdf);
+}
+
+// MIS weighted contribution of the lights reflected by a lambertian surface
+vec3 SampleLightsDiffuse(vec3 pos, vec3 normal, vec3 albedo, Ray bounce)
+{
+    vec3 res = vec3(0.0f);
+    vec3 dir, emission;
+    float lightPdf;
+    if(SphereLightSamplingEnabled() && SampleSphereLight(pos, normal, bounce, dir, emission, lightPdf))
+        res += emission * albedo * DiffuseLightWeight(normal, dir, lightPdf);
+    if(EnvSamplingEnabled() && SampleEnvLight(pos, normal, bounce, dir, emission, lightPdf))
+        res += emission * albedo * DiffuseLightWeight(normal, dir, lightPdf);
+    
+    return res;
+}
+
+// Solid angle pdf of the reflected directions obtained with SampleMicrofacetNormal
+// (only the first scattering event, without the internal bounces)
+float MicrofacetReflectionPdf(float exponent, vec3 normal, vec3 outDir, vec3 inDir)
+{
+    vec3 h = normalize(outDir + inDir);
+    float cosH = dot(normal, h);
+    if(cosH <= 0.0f) return 0.0f;
+    
+    float pdfH = (exponent + 1.0f) / (2.0f * PI) * pow(cosH, exponent);
+    return pdfH / (4.0f * abs(dot(outDir, h)));
+}
+
+vec3 MicrofacetLightContribution(vec3 normal, vec3 outDir, vec3 color, float exponent, vec3 dir, vec3 emission, float lightPdf)
+{
+    float bsdfPdf = MicrofacetReflectionPdf(exponent, normal, outDir, dir);
+    if(bsdfPdf <= 0.0f) return vec3(0.0f);
+    
+    vec3 fresnel = FresnelSchlick(color, normalize(outDir + dir), outDir);
+    return emission * fresnel * bsdfPdf / lightPdf * PowerHeuristic(lightPdf, bsdfPdf);
+}
+
+// MIS weighted contribution of the lights reflected by the ReflectiveModel. Its
+// estimator weights sampled directions by the fresnel term, so f * cos = fresnel * pdf
+vec3 SampleLightsMicrofacet(vec3 pos, vec3 normal, vec3 outDir, vec3 color, float exponent, Ray bounce)
+{
+    vec3 res = vec3(0.0f);
+    vec3 dir, emission;
+    float lightPdf;
+    if(SphereLightSamplingEnabled() && SampleSphereLight(pos, normal, bounce, dir, emission, lightPdf))
+        res += MicrofacetLightContribution(normal, outDir, color, exponent, dir, emission, lightPdf);
+    if(EnvSamplingEnabled() && SampleEnvLight(pos, normal, bounce, dir, emission, lightPdf))
+        res += MicrofacetLightContribution(normal, outDir, color, exponent, dir, emission, lightPdf);
+    
+    return res;
+}
+
 vec3 CameraFrame2World(vec3 v, float yaw, float pitch)
 {
     float cosYaw = cos(yaw);
@@ -721,25 +1264,36 @@ vec3 CameraFrame2World(vec3 v, float yaw, float pitch)
     return yawPitchRotated;
 }
 
-vec3 SampleEnvMap(vec3 dir, uint mapId)
+// Inverse of OctahedralDir in image.c. The upper hemisphere is the diamond in
+// the middle, the lower one is folded over the corners
+vec2 OctahedralCoords(vec3 dir)
+{
+    vec2 p = dir.xz / (abs(dir.x) + abs(dir.y) + abs(dir.z));
+    if(dir.y < 0.0f)
+    {
+        vec2 signs = vec2(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+        p = (1.0f - abs(p.yx)) * signs;
+    }
+    
+    return p * 0.5f + 0.5f;
+}
+
+vec3 SampleEnvMap(vec3 dir, uint layer, float footprint)
 {
+    // No trigonometry, and neighboring directions are close in memory
+    if(octahedralEnvMaps)
+        return SampleEnvMap(OctahedralCoords(dir), layer, footprint);
+    
     vec2 coords;
     coords.x = (atan(dir.z, dir.x) + PI) / (2*PI);
     coords.y = acos(dir.y) / PI;
-    return SampleEnvMap(coords, mapId).xyz;
+    return SampleEnvMap(coords, layer, footprint).xyz;
 }
 
-vec3 SampleSceneEnvMap(vec3 dir, uint scene)
+vec3 SampleSceneEnvMap(vec3 dir, float footprint)
 {
-    switch(scene)
-    {
-        case 1: return SampleEnvMap(dir, scene1_envMap);
-        case 2: return SampleEnvMap(dir, scene2_envMap);
-        case 3: return SampleEnvMap(dir, scene3_envMap);
-        case 4: return SampleEnvMap(dir, scene4_envMap);
-    }
-    
-    return vec3(0.0f);
+    if(envMap < 0) return vec3(0.0f);
+    return SampleEnvMap(dir, uint(envMapLayer), footprint);
 }
 
 // From the LittleCG library
@@ -776,70 +1330,128 @@ vec3 SampleMicrofacetNormal(float exponent, vec3 normal, vec2 rnd)
     return normalize(local2World * local);
 }
 
-HitInfo RaySceneIntersection(Ray ray)
+// Tests a single scene primitive (see PrimRefQuadBit in scene.c) and updates the closest hit
+void RayPrimitiveIntersection(Ray ray, uint primRef, inout float dist, inout int idx, inout int objKind, inout uint triId)
 {
-    int objKind = -1;
-    int idx     = -1;
-    float dist  = FLT_MAX;
-    uint triId  = 0; // Can be 0 or 1; only used for quads
-    
-    // It seems we can't dynamically pick a static array (using generic code) so this will have to do
-#define CheckSpheres(sphereArray)                                            \
-for(int i = 0; i < sphereArray.length(); ++i)                            \
-{                                                                        \
-RayIntersection inters = RaySphereIntersection(ray, sphereArray[i]); \
-if(inters.hit && inters.dist < dist)                                 \
-{                                                                    \
-dist = inters.dist;                                              \
-idx = i;                                                         \
-objKind = ObjKind_Sphere;                                        \
-}                                                                    \
-}
-    //
-    
-#define CheckQuads(quadArray)                                                \
-for(int i = 0; i < quadArray.length(); ++i)                              \
-{                                                                        \
-RayQuadResult inters = RayQuadIntersection(ray, quadArray[i]);       \
-if(inters.triId > -1 && inters.dist < dist)                          \
-{                                                                    \
-triId = inters.triId;                                            \
-dist = inters.dist;                                              \
-idx = i;                                                         \
-objKind = ObjKind_Quad;                                          \
-}                                                                    \
-}
-    //
-    
-    switch(scene)
+    if((primRef & PRIM_REF_QUAD_BIT) == 0u)
     {
-        case 1:
+        int i = int(primRef);
+        RayIntersection inters = RaySphereIntersection(ray, GetSphere(i));
+        if(inters.hit && inters.dist < dist)
         {
-            CheckSpheres(scene1_spheres);
-            CheckQuads(scene1_quads);
-            break;
+            dist = inters.dist;
+            idx = i;
+            objKind = ObjKind_Sphere;
         }
-        case 2:
+    }
+    else
+    {
+        int i = int(primRef & ~PRIM_REF_QUAD_BIT);
+        RayQuadResult inters = RayQuadIntersection(ray, GetQuad(i));
+        if(inters.triId > -1 && inters.dist < dist)
         {
-            CheckSpheres(scene2_spheres);
-            CheckQuads(scene2_quads);
-            break;
+            triId = inters.triId;
+            dist = inters.dist;
+            idx = i;
+            objKind = ObjKind_Quad;
+        }
+    }
+}
+
+// Returns the distance at which the ray enters the box, FLT_MAX if it misses it
+float RayAabbDist(vec3 ori, vec3 invDir, int node, float maxDist)
+{
+    vec3 boxMin = texelFetch(bvhNodes, node * 2).xyz;
+    vec3 boxMax = texelFetch(bvhNodes, node * 2 + 1).xyz;
+    vec3 t0 = (boxMin - ori) * invDir;
+    vec3 t1 = (boxMax - ori) * invDir;
+    vec3 tMin = min(t0, t1);
+    vec3 tMax = max(t0, t1);
+    float tNear = max(max(tMin.x, tMin.y), max(tMin.z, 0.0f));
+    float tFar  = min(min(tMax.x, tMax.y), min(tMax.z, maxDist));
+    return tNear <= tFar ? tNear : FLT_MAX;
+}
+
+// Stack based traversal, visiting the closest child first.
+// With anyHit it stops at the first intersection found (for shadow rays)
+void RayBvhIntersection(Ray ray, bool anyHit, inout float dist, inout int idx, inout int objKind, inout uint triId)
+{
+    vec3 invDir = 1.0f / ray.dir;
+    int stack[BVH_STACK_SIZE];
+    float stackDist[BVH_STACK_SIZE];
+    int stackSize = 0;
+    
+    int node = 0;
+    if(RayAabbDist(ray.ori, invDir, node, min(dist, ray.maxDist)) == FLT_MAX) return;
+    
+    while(true)
+    {
+        vec4 nodeMin = texelFetch(bvhNodes, node * 2);
+        vec4 nodeMax = texelFetch(bvhNodes, node * 2 + 1);
+        int offset = int(nodeMin.w);
+        int count  = int(nodeMax.w);
+        
+        int next = -1;
+        if(count > 0)  // Leaf
+        {
+            for(int i = offset; i < offset + count; ++i)
+                RayPrimitiveIntersection(ray, texelFetch(bvhPrims, i).x, dist, idx, objKind, triId);
+            
+            if(anyHit && idx != -1) return;
         }
-        case 3:
+        else
         {
-            CheckSpheres(scene3_spheres);
-            CheckQuads(scene3_quads);
-            break;
+            int near = node + 1;
+            int far  = offset;
+            float maxDist = min(dist, ray.maxDist);
+            float nearDist = RayAabbDist(ray.ori, invDir, near, maxDist);
+            float farDist  = RayAabbDist(ray.ori, invDir, far, maxDist);
+            if(farDist < nearDist)
+            {
+                int tmp = near; near = far; far = tmp;
+                float tmpDist = nearDist; nearDist = farDist; farDist = tmpDist;
+            }
+            
+            if(nearDist != FLT_MAX) next = near;
+            if(farDist != FLT_MAX)
+            {
+                stack[stackSize] = far;
+                stackDist[stackSize] = farDist;
+                ++stackSize;
+            }
         }
-        case 4:
+        
+        // Pop nodes until one that could still contain a closer hit
+        while(next == -1 && stackSize > 0)
         {
-            CheckSpheres(scene4_spheres);
-            CheckQuads(scene4_quads);
-            break;
+            --stackSize;
+            if(stackDist[stackSize] < dist) next = stack[stackSize];
         }
+        
+        if(next == -1) break;
+        node = next;
+    }
+}
+
+HitInfo RaySceneIntersection(Ray ray)
+{
+    int objKind = -1;
+    int idx     = -1;
+    float dist  = FLT_MAX;
+    uint triId  = 0; // Can be 0 or 1; only used for quads
+    
+    if(useBvh)
+    {
+        if(numSpheres + numQuads > 0)
+            RayBvhIntersection(ray, false, dist, idx, objKind, triId);
+    }
+    else
+    {
+        for(int i = 0; i < numSpheres; ++i)
+            RayPrimitiveIntersection(ray, uint(i), dist, idx, objKind, triId);
+        for(int i = 0; i < numQuads; ++i)
+            RayPrimitiveIntersection(ray, uint(i) | PRIM_REF_QUAD_BIT, dist, idx, objKind, triId);
     }
-#undef CheckSpheres
-#undef CheckQuads
     
     if(idx == -1) return defaultHitInfo;
     
@@ -847,34 +1459,24 @@ objKind = ObjKind_Quad;                                          \
     
     HitInfo res = defaultHitInfo;
     res.hit = true;
+    float texScale = 0.0f;  // Texture coordinates per world unit
     
     if(objKind == ObjKind_Sphere)
     {
-        Sphere hitSphere = Sphere(vec3(0.0f), 0.0f, defaultMat);
-        switch(scene)
-        {
-            case 1: hitSphere = scene1_spheres[idx]; break;
-            case 2: hitSphere = scene2_spheres[idx]; break;
-            case 3: hitSphere = scene3_spheres[idx]; break;
-            case 4: hitSphere = scene4_spheres[idx]; break;
-        }
+        Sphere hitSphere = GetSphere(idx);
+        res.sphereIdx = idx;
         
         vec3 pos = hitSphere.pos;
         res.pos = ray.ori + ray.dir * dist;
         res.normal = normalize(res.pos - pos);
         res.texCoords = Sphere2CubeUV(hitSphere.pos, hitSphere.rad, res.pos);
-        res.mat = hitSphere.mat;
+        res.mat = GetMaterial(hitSphere.matId);
+        res.curvature = 1.0f / hitSphere.rad;
+        texScale = 0.5f / hitSphere.rad;
     }
     else if(objKind == ObjKind_Quad)
     {
-        Quad hitQuad = defaultQuad;
-        switch(scene)
-        {
-            case 1: hitQuad = scene1_quads[idx]; break;
-            case 2: hitQuad = scene2_quads[idx]; break;
-            case 3: hitQuad = scene3_quads[idx]; break;
-            case 4: hitQuad = scene4_quads[idx]; break;
-        }
+        Quad hitQuad = GetQuad(idx);
         
         // Get hit triangle
         vec3 tri[3];
@@ -894,8 +1496,39 @@ objKind = ObjKind_Quad;                                          \
         res.normal = normalize(cross(tri[1] - tri[0], tri[2] - tri[0]));
         vec3 uvw = BarycentricCoords(tri[0], tri[1], tri[2], res.pos);
         res.texCoords = uvw.x * coords[0] + uvw.y * coords[1] + uvw.z * coords[2];
-        res.mat = hitQuad.mat;
+        res.mat = GetMaterial(hitQuad.matId);
+        
+        vec2 uv1 = coords[1] - coords[0];
+        vec2 uv2 = coords[2] - coords[0];
+        float worldArea = length(cross(tri[1] - tri[0], tri[2] - tri[0]));
+        float uvArea = abs(uv1.x * uv2.y - uv2.x * uv1.y);
+        texScale = worldArea > 0.0f ? sqrt(uvArea / worldArea) : 0.0f;
     }
     
+    res.coneWidth = ray.coneWidth + ray.coneSpread * dist;
+    res.texFootprint = res.coneWidth * texScale / max(abs(dot(res.normal, ray.dir)), 0.01f);
     return res;
 }
+
+bool RaySceneOcclusion(Ray ray)
+{
+    int objKind = -1;
+    int idx     = -1;
+    float dist  = FLT_MAX;
+    uint triId  = 0;
+    
+    if(useBvh)
+    {
+        if(numSpheres + numQuads > 0)
+            RayBvhIntersection(ray, true, dist, idx, objKind, triId);
+    }
+    else
+    {
+        for(int i = 0; i < numSpheres && idx == -1; ++i)
+            RayPrimitiveIntersection(ray, uint(i), dist, idx, objKind, triId);
+        for(int i = 0; i < numQuads && idx == -1; ++i)
+            RayPrimitiveIntersection(ray, uint(i) | PRIM_REF_QUAD_BIT, dist, idx, objKind, triId);
+    }
+    
+    return idx != -1;
+}
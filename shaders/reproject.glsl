@@ -0,0 +1,176 @@
+
+/////////////////////////////////////////
+// Reprojection of the accumulation
+
+// Compiled after pathtracer.glsl (with REPROJECTION_PASS defined), so that it
+// finds the primary hits with the same camera and intersection code.
+// When the camera moves, the accumulation of the previous view is warped into the
+// new one instead of being thrown away: every pixel traces a ray through its center,
+// projects the hit into the previous camera, and takes the bilinear taps of the
+// previous accumulation there that saw the same surface (according to the primary
+// hits stored for the previous view). The sample count that's carried over is scaled
+// by the weight of the accepted taps, so pixels that were partially occluded count
+// for less, and the ones that weren't visible at all start over. So do the env map and
+// emitters seen directly, which a single frame resolves without the blur of resampling.
+// The pass also stores the primary hits of the new view, for the next move.
+// The previous view can have a different resolution (see the dynamic resolution in main.c).
+
+uniform sampler2D previousPrimaryHits;
+uniform vec3 previousCameraPos;
+uniform vec2 previousCameraAngle;
+uniform vec2 previousResolution;
+uniform bool reprojectHistory;      // Otherwise only the primary hits are stored, and the accumulation restarts
+uniform float maxHistorySamples;    // Carried over samples are capped, so that new ones outweigh the blur of the resampling
+uniform bool accumulateSums;        // Image accumulation stores sums, the ping pong buffers averages
+
+layout(location = 0) out vec4 outColor;
+layout(location = 1) out vec4 outMoments;     // See ConvergenceRatio in pathtracer.glsl
+layout(location = 2) out vec4 outPrimaryHit;  // World space normal and view depth, 0 depth if the ray escaped
+
+// Tolerances of the surface test, the distance from the tangent plane is relative to the depth
+const float ReprojectPlaneTolerance  = 0.01f;
+const float ReprojectNormalTolerance = 0.9f;
+const float ReprojectMinLobeWidth    = 0.001f;  // Radians, for mirrors and refractions
+const float ReprojectLobeFraction    = 0.25f;   // Of the lobe width the view can turn by before all history is dropped
+
+// Direction through a point of the image plane, in the camera frame and with unit depth
+vec3 PixelDirection(vec2 fragCoord, vec2 res)
+{
+    vec2 coord = 2.0f * fragCoord / res - 1.0f;
+    coord *= tan(fov / 2.0f);
+    coord.y *= res.y / res.x;
+    return vec3(coord, 1.0f);
+}
+
+// Inverse of CameraFrame2World
+vec3 World2CameraFrame(vec3 v, float yaw, float pitch)
+{
+    float cosYaw = cos(yaw);
+    float sinYaw = sin(yaw);
+    float cosPitch = cos(pitch);
+    float sinPitch = sin(pitch);
+    
+    vec3 yawRotated;
+    yawRotated.x = v.x * cosYaw - v.z * sinYaw;
+    yawRotated.y = v.y;
+    yawRotated.z = v.x * sinYaw + v.z * cosYaw;
+    
+    vec3 res;
+    res.x = yawRotated.x;
+    res.y = yawRotated.y * cosPitch + yawRotated.z * sinPitch;
+    res.z = -yawRotated.y * sinPitch + yawRotated.z * cosPitch;
+    return res;
+}
+
+// Where the previous camera saw a point, in pixels. Returns false if it was behind the camera
+bool PreviousPixel(vec3 p, out vec2 pixel)
+{
+    vec3 local = World2CameraFrame(p - previousCameraPos, previousCameraAngle.x, previousCameraAngle.y);
+    if(local.z <= 0.0f) return false;
+    
+    vec2 coord = local.xy / local.z / tan(fov / 2.0f);
+    coord.y *= previousResolution.x / previousResolution.y;
+    pixel = (coord * 0.5f + 0.5f) * previousResolution;
+    return true;
+}
+
+// Whether a pixel of the previous view saw the same surface as the current primary hit,
+// i.e. its hit is close to the tangent plane and has a similar normal
+bool SameSurface(HitInfo hit, ivec2 tap, vec4 tapHit)
+{
+    if(tapHit.w <= 0.0f) return false;
+    
+    vec3 tapDir = CameraFrame2World(PixelDirection(vec2(tap) + 0.5f, previousResolution), previousCameraAngle.x, previousCameraAngle.y);
+    vec3 tapPos = previousCameraPos + tapDir * tapHit.w;
+    float planeDist = abs(dot(tapPos - hit.pos, hit.normal));
+    return planeDist <= ReprojectPlaneTolerance * tapHit.w && dot(tapHit.xyz, hit.normal) >= ReprojectNormalTolerance;
+}
+
+// How much of the history of a surface is still valid after the direction it's seen
+// from turned by viewAngle. Matte surfaces look the same from every direction, while
+// reflections move with it, the more the sharper they are. The lobe of the reflective
+// model is about as wide as its roughness; the coat of the glossy model is a mirror.
+// Even a small shift of a converged reflection shows against the new samples, hence
+// the history is dropped well before the view turned by a whole lobe width
+float ViewDependentWeight(HitInfo hit, float viewAngle)
+{
+    if(hit.mat.matType == MatType_Matte) return 1.0f;
+    
+    float lobeWidth = 0.0f;
+    if(hit.mat.matType == MatType_Reflective)
+        lobeWidth = clamp(SampleTexture(hit.texCoords, hit.mat.roughness, hit.texFootprint).x * hit.mat.roughnessScale, 0.0f, 1.0f);
+    return clamp(1.0f - viewAngle / (ReprojectLobeFraction * max(lobeWidth, ReprojectMinLobeWidth)), 0.0f, 1.0f);
+}
+
+void main()
+{
+    pixelCoords = ivec2(gl_FragCoord.xy);
+    
+    vec3 dir = normalize(CameraFrame2World(normalize(PixelDirection(gl_FragCoord.xy, resolution)), cameraAngle.x, cameraAngle.y));
+    float pixelSpread = 2.0f * tan(fov / 2.0f) / resolution.x;
+    HitInfo hit = RaySceneIntersection(Ray(cameraPos, dir, 0.0001f, 10000.0f, 0.0f, pixelSpread));
+    vec3 forward = CameraFrame2World(vec3(0.0f, 0.0f, 1.0f), cameraAngle.x, cameraAngle.y);
+    float depth = hit.hit ? dot(hit.pos - cameraPos, forward) : 0.0f;
+    outPrimaryHit = vec4(hit.hit ? hit.normal : vec3(0.0f), depth);
+    
+    // Nothing carried over, the path tracer ignores the color if the count is 0
+    outColor = vec4(0.0f);
+    outMoments = vec4(0.0f);
+    
+    if(!reprojectHistory) return;
+    
+    // The path tracer resolves the env map and emitters seen directly within a frame,
+    // while resampling their history would only blur their edges
+    if(!hit.hit) return;
+    vec3 emittedLight = SampleTexture(hit.texCoords, hit.mat.emission, hit.texFootprint).xyz * hit.mat.emissionScale;
+    if(dot(emittedLight, vec3(1.0f)) > 0.0f) return;
+    
+    // Only rotating the camera doesn't change any view direction
+    float cosViewAngle = dot(normalize(hit.pos - cameraPos), normalize(hit.pos - previousCameraPos));
+    float viewWeight = ViewDependentWeight(hit, acos(clamp(cosViewAngle, -1.0f, 1.0f)));
+    
+    vec2 pixel;
+    if(!PreviousPixel(hit.pos, pixel)) return;
+    
+    vec2 base = pixel - 0.5f;
+    ivec2 firstTap = ivec2(floor(base));
+    vec2 frac = base - vec2(firstTap);
+    
+    vec3 color = vec3(0.0f);
+    vec2 lumMoments = vec2(0.0f);
+    float samples = 0.0f;
+    float frames = 0.0f;
+    float weightSum = 0.0f;
+    for(int i = 0; i < 4; ++i)
+    {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 tap = firstTap + offset;
+        if(any(lessThan(tap, ivec2(0))) || any(greaterThanEqual(tap, ivec2(previousResolution)))) continue;
+        
+        vec2 bilinear = mix(1.0f - frac, frac, vec2(offset));
+        float weight = bilinear.x * bilinear.y;
+        if(weight <= 0.0f || !SameSurface(hit, tap, texelFetch(previousPrimaryHits, tap, 0))) continue;
+        
+        vec4 tapColor = texelFetch(previousFrame, tap, 0);
+        vec4 tapMoments = texelFetch(previousMoments, tap, 0);
+        color += weight * tapColor.rgb / max(tapColor.a, 1.0f);
+        lumMoments += weight * tapMoments.xy;
+        samples += weight * tapMoments.z;
+        frames += weight * tapMoments.w;
+        weightSum += weight;
+    }
+    
+    // The count isn't normalized by the accepted weight, which is what makes it disocclusion aware.
+    // A previous view at lower resolution spreads its samples over more pixels
+    float pixelRatio = min(previousResolution.x * previousResolution.y / (resolution.x * resolution.y), 1.0f);
+    float carried = floor(min(samples * viewWeight * pixelRatio, maxHistorySamples));
+    if(carried < 1.0f) return;
+    
+    // The frames are cut down with the samples, so that the estimate of
+    // the standard error stays the one of the carried samples
+    color /= weightSum;
+    lumMoments /= weightSum;
+    frames *= carried / samples;
+    outColor = accumulateSums ? vec4(color * carried, carried) : vec4(color, 1.0f);
+    outMoments = vec4(lumMoments, carried, frames);
+}
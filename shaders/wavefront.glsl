@@ -0,0 +1,333 @@
+/////////////////////////////////////////
+// Wavefront path tracing kernels (GL 4.3 compute)
+
+// Compiled after pathtracer.glsl (with WAVEFRONT_KERNEL defined), once per
+// kernel with one of the KERNEL_* defines. Instead of tracing all bounces of a
+// path in one invocation, the path state lives in buffers and every bounce is
+// split into an extend kernel (intersection) and one shading kernel per material
+// type, each running only over the paths queued for it. Every pixel has one path
+// in flight, a frame is traced in numSamples waves.
+
+#define WorkgroupSize 64
+
+#define Queue_Extend0     0  // Two extend queues, read and written on alternate bounces
+#define Queue_Extend1     1
+#define Queue_FirstShade  2  // One per material type, Queue_FirstShade + matType
+#define Queue_Count       6
+
+#define Prepare_Reset  0  // Empties every queue, before generating a wave
+#define Prepare_Extend 1  // Dispatch size of the current extend queue
+#define Prepare_Shade  2  // Dispatch sizes of the shading queues
+
+struct PathState
+{
+    vec4 ori;         // w: 1 if the last bounce sampled the lights (neeBounce)
+    vec4 dir;         // w: ray cone width
+    vec4 rayColor;    // w: ray cone spread
+    vec4 luminance;
+    vec4 nee;         // neePos, neeBsdfPdf
+    uvec4 state;      // Pixel index, bounce, rngState, sampleIndex
+};
+
+// HitInfo of the last extend, with the material already MIS weighted
+struct HitRecord
+{
+    vec4 posU;
+    vec4 normalV;
+    vec4 emissionRoughness;
+    vec4 colorSphere;  // colorScale, sphereIdx
+    uvec4 ids;         // matType, emission, color, roughness textures
+    vec4 cone;         // texFootprint, coneWidth, curvature
+};
+
+struct DispatchArgs
+{
+    uint x, y, z;
+};
+
+layout(std430, binding = 0) buffer Paths { PathState paths[]; };
+layout(std430, binding = 1) buffer Hits { HitRecord hits[]; };
+layout(std430, binding = 2) buffer Queues { uint queues[]; };  // Queue_Count * numPixels
+layout(std430, binding = 3) buffer QueueCounts
+{
+    uint queueCounts[8];
+    DispatchArgs dispatchArgs[Queue_Count];  // Read by glDispatchComputeIndirect
+};
+layout(std430, binding = 4) buffer PixelRadiance { vec4 pixelRadiance[]; };  // Sum over the frame's waves
+
+#ifndef IMAGE_ACCUMULATION  // Otherwise updated in place, see AccumulateSamples
+layout(rgba16f, binding = 0) uniform writeonly image2D outColor;
+layout(rgba32f, binding = 1) uniform writeonly image2D outMoments;
+#endif
+
+uniform uint waveIndex;     // Sample of the current wave, from 0 to numSamples-1
+uniform uint extendQueue;   // Queue_Extend0 or Queue_Extend1, read by the current bounce
+uniform int prepareStage;
+
+layout(local_size_x = WorkgroupSize) in;
+
+uint NumPixels()
+{
+    return uint(resolution.x) * uint(resolution.y);
+}
+
+void PushPath(uint queue, uint pathIdx)
+{
+    uint slot = atomicAdd(queueCounts[queue], 1u);
+    queues[queue * NumPixels() + slot] = pathIdx;
+}
+
+// Restores the globals used by the material models
+void LoadPathGlobals(PathState path)
+{
+    uint pixel = path.state.x;
+    pixelCoords = ivec2(int(pixel % uint(resolution.x)), int(pixel / uint(resolution.x)));
+    rngState    = path.state.z;
+    sampleIndex = path.state.w;
+    bounceDim   = Dim_FirstBounce + path.state.y * DimsPerBounce;
+    neeBounce   = path.ori.w != 0.0f;
+    neePos      = path.nee.xyz;
+    neeBsdfPdf  = path.nee.w;
+}
+
+void StorePathGlobals(inout PathState path)
+{
+    path.state.z = rngState;
+    path.ori.w   = neeBounce ? 1.0f : 0.0f;
+    path.nee     = vec4(neePos, neeBsdfPdf);
+}
+
+// The path is done, its contribution goes to its pixel. Pixels have
+// at most one path in flight, so this doesn't need atomics. The pixel's
+// next path continues from its random state (paths are indexed by pixel)
+void FinishPath(PathState path)
+{
+    pixelRadiance[path.state.x] += vec4(path.luminance.xyz, 0.0f);
+    paths[path.state.x].state.z = path.state.z;
+}
+
+#if defined(KERNEL_PREPARE)
+
+DispatchArgs QueueDispatch(uint queue)
+{
+    return DispatchArgs((queueCounts[queue] + WorkgroupSize - 1) / WorkgroupSize, 1u, 1u);
+}
+
+void main()
+{
+    if(gl_GlobalInvocationID.x != 0u) return;
+    
+    if(prepareStage == Prepare_Reset)
+    {
+        for(int i = 0; i < Queue_Count; ++i)
+            queueCounts[i] = 0u;
+    }
+    else if(prepareStage == Prepare_Extend)
+    {
+        dispatchArgs[extendQueue] = QueueDispatch(extendQueue);
+        for(uint i = Queue_FirstShade; i < Queue_Count; ++i)
+            queueCounts[i] = 0u;
+    }
+    else if(prepareStage == Prepare_Shade)
+    {
+        for(uint i = Queue_FirstShade; i < Queue_Count; ++i)
+            dispatchArgs[i] = QueueDispatch(i);
+        
+        // Shading pushes the surviving paths to the other extend queue
+        queueCounts[1u - extendQueue] = 0u;
+    }
+}
+
+#elif defined(KERNEL_GENERATE)
+
+// One thread per pixel, starts the path of the current wave
+void main()
+{
+    uint pixel = gl_GlobalInvocationID.x;
+    if(pixel >= NumPixels()) return;
+    
+    if(waveIndex == 0u)
+        pixelRadiance[pixel] = vec4(0.0f);
+    
+    pixelCoords = ivec2(int(pixel % uint(resolution.x)), int(pixel / uint(resolution.x)));
+    vec4 prevMoments = PreviousMoments();
+    if(PixelConverged(prevMoments)) return;
+    
+    // Same seed as the fragment shader, which keeps one stream for all paths of the pixel
+    vec2 fragCoord = vec2(pixelCoords) + 0.5f;
+    if(waveIndex == 0u)
+    {
+        uint pixelId = uint(fragCoord.y * resolution.x + fragCoord.x);
+        uint lastId  = uint(resolution.y * resolution.x + resolution.x);
+        rngState = pixelId + (lastId + 1u) * uint(frameId);
+    }
+    else
+        rngState = paths[pixel].state.z;
+    sampleIndex = uint(prevMoments.z) + waveIndex;
+    
+    Ray ray = GenerateCameraRay(fragCoord);
+    
+    PathState path;
+    path.ori       = vec4(ray.ori, 0.0f);
+    path.dir       = vec4(ray.dir, ray.coneWidth);
+    path.rayColor  = vec4(vec3(1.0f), ray.coneSpread);
+    path.luminance = vec4(0.0f);
+    path.nee       = vec4(0.0f);
+    path.state     = uvec4(pixel, 0u, rngState, sampleIndex);
+    paths[pixel] = path;
+    
+    PushPath(extendQueue, pixel);
+}
+
+#elif defined(KERNEL_EXTEND)
+
+// Finds the next hit of every queued path and sorts them by material
+void main()
+{
+    uint idx = gl_GlobalInvocationID.x;
+    if(idx >= queueCounts[extendQueue]) return;
+    
+    uint pathIdx = queues[extendQueue * NumPixels() + idx];
+    PathState path = paths[pathIdx];
+    LoadPathGlobals(path);
+    
+    Ray ray = Ray(path.ori.xyz, path.dir.xyz, 0.0001f, 10000.0f, path.dir.w, path.rayColor.w);
+    HitInfo hit = RaySceneIntersection(ray);
+    if(!hit.hit)
+    {
+        // The environment might have been sampled already
+        vec3 envLight = SampleSceneEnvMap(ray.dir, EnvMapFootprint(ray.coneSpread));
+        if(neeBounce && EnvSamplingEnabled())
+            envLight *= PowerHeuristic(neeBsdfPdf, EnvPdf(ray.dir));
+        
+        path.luminance.xyz += envLight * path.rayColor.xyz;
+        FinishPath(path);
+        return;
+    }
+    
+    // Emissive spheres are lights, which might have been sampled already
+    if(neeBounce && SphereLightSamplingEnabled() && hit.sphereIdx != -1)
+    {
+        float lightPdf = LightPdf(neePos, GetSphere(hit.sphereIdx));
+        hit.mat.emissionScale *= PowerHeuristic(neeBsdfPdf, lightPdf);
+    }
+    
+    HitRecord record;
+    record.posU              = vec4(hit.pos, hit.texCoords.x);
+    record.normalV           = vec4(hit.normal, hit.texCoords.y);
+    record.emissionRoughness = vec4(hit.mat.emissionScale, hit.mat.roughnessScale);
+    record.colorSphere       = vec4(hit.mat.colorScale, float(hit.sphereIdx));
+    record.ids               = uvec4(hit.mat.matType, hit.mat.emission, hit.mat.color, hit.mat.roughness);
+    record.cone              = vec4(hit.texFootprint, hit.coneWidth, hit.curvature, 0.0f);
+    hits[pathIdx] = record;
+    
+    PushPath(Queue_FirstShade + hit.mat.matType, pathIdx);
+}
+
+#elif defined(KERNEL_SHADE)
+
+// Runs one material model (SHADE_MAT_TYPE) over its queue, then russian roulette
+void main()
+{
+    uint queue = Queue_FirstShade + SHADE_MAT_TYPE;
+    uint idx = gl_GlobalInvocationID.x;
+    if(idx >= queueCounts[queue]) return;
+    
+    uint pathIdx = queues[queue * NumPixels() + idx];
+    PathState path = paths[pathIdx];
+    LoadPathGlobals(path);
+    
+    HitRecord record = hits[pathIdx];
+    HitInfo hit;
+    hit.hit       = true;
+    hit.pos       = record.posU.xyz;
+    hit.normal    = record.normalV.xyz;
+    hit.texCoords = vec2(record.posU.w, record.normalV.w);
+    hit.sphereIdx = int(record.colorSphere.w);
+    hit.mat       = Material(record.ids.x, record.emissionRoughness.xyz, record.colorSphere.xyz,
+                             record.emissionRoughness.w, record.ids.y, record.ids.z, record.ids.w);
+    hit.texFootprint = record.cone.x;
+    hit.coneWidth    = record.cone.y;
+    hit.curvature    = record.cone.z;
+    
+    // The cone continues from the hit
+    Ray currentRay = Ray(path.ori.xyz, path.dir.xyz, 0.0001f, 10000.0f, hit.coneWidth, path.rayColor.w);
+    vec3 luminance = path.luminance.xyz;
+    vec3 rayColor  = path.rayColor.xyz;
+    int bounce     = int(path.state.y);
+    neeBounce = false;
+
+#if SHADE_MAT_TYPE == MatType_Matte
+    MatteModel(hit, currentRay, luminance, rayColor);
+#elif SHADE_MAT_TYPE == MatType_Reflective
+    ReflectiveModel(hit, currentRay, luminance, rayColor, bounce);
+#elif SHADE_MAT_TYPE == MatType_Transparent
+    TransparentModel(hit, currentRay, luminance, rayColor);
+#elif SHADE_MAT_TYPE == MatType_Glossy
+    GlossyModel(hit, currentRay, luminance, rayColor);
+#endif
+
+    path.ori.xyz       = currentRay.ori;
+    path.dir           = vec4(currentRay.dir, currentRay.coneWidth);
+    path.rayColor.w    = currentRay.coneSpread;
+    path.luminance.xyz = luminance;
+    
+    // Russian roulette, same as the fragment shader
+    bool alive = true;
+    if(bounce + 1 >= minBounces)
+    {
+        float survival = min(max(rayColor.r, max(rayColor.g, rayColor.b)), 1.0f);
+        if(SampleBounce1D(BounceDim_Roulette) >= survival)
+            alive = false;
+        else
+            rayColor /= survival;
+    }
+    
+    path.rayColor.xyz = rayColor;
+    path.state.y = uint(bounce + 1);
+    StorePathGlobals(path);
+    
+    if(alive && bounce + 1 < maxBounces)
+    {
+        paths[pathIdx] = path;
+        PushPath(1u - extendQueue, pathIdx);
+    }
+    else
+        FinishPath(path);
+}
+
+#elif defined(KERNEL_ACCUMULATE)
+
+// One thread per pixel, blends the frame's samples into the accumulation
+// buffers exactly like the end of the fragment shader
+void main()
+{
+    uint pixel = gl_GlobalInvocationID.x;
+    if(pixel >= NumPixels()) return;
+    
+    pixelCoords = ivec2(int(pixel % uint(resolution.x)), int(pixel / uint(resolution.x)));
+    vec4 prevMoments = PreviousMoments();
+    
+#ifdef IMAGE_ACCUMULATION
+    if(PixelConverged(prevMoments)) return;
+    
+    vec4 color, moments;
+    AccumulateSamples(pixelRadiance[pixel].xyz / float(numSamples), prevMoments, color, moments);
+    imageStore(accumImage, pixelCoords, color);
+    imageStore(accumMoments, pixelCoords, moments);
+#else
+    vec4 color, moments;
+    if(PixelConverged(prevMoments))
+    {
+        color = texelFetch(previousFrame, pixelCoords, 0);
+        moments = prevMoments;
+    }
+    else
+        AccumulateSamples(pixelRadiance[pixel].xyz / float(numSamples), prevMoments, color, moments);
+    
+    imageStore(outColor, pixelCoords, color);
+    imageStore(outMoments, pixelCoords, moments);
+#endif
+}
+
+#endif
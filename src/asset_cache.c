@@ -0,0 +1,114 @@
+// On-disk cache of decoded images, so that HDR and PNG files don't have to be
+// decoded on every launch. Entries are keyed by a hash of the source path, its
+// modification time and size, and the stored format; each entry is a small header
+// followed by pixels that can be passed directly to glTexSubImage3D, and optionally
+// by derived data (the importance sampling CDF of env maps). Entries are mapped
+// into memory rather than read, so a cache hit costs no copies.
+
+#define AssetCacheMagic   0x43415253  // "SRAC"
+#define AssetCacheVersion 2  // 2: images have mip chains
+
+// The size is a multiple of 16, so that the pixels stay aligned in the mapping
+struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint64_t pixelsSize;
+    uint64_t extraSize;
+} typedef AssetCacheHeader;
+
+struct
+{
+    bool enabled;
+    const char* path;
+} typedef AssetCache;
+
+static AssetCache assetCache = {0};
+
+struct
+{
+    MappedFile file;
+    int width, height;
+    void* pixels;
+    void* extra;  // NULL if the entry has no extra data
+} typedef CachedAsset;
+
+void InitAssetCache(const char* path, bool enabled)
+{
+    assetCache.path = path;
+    assetCache.enabled = enabled && MakeDirectory(path);
+}
+
+// 'format' identifies the layout of the stored data, e.g. "rgb32f+cdf".
+// Returns false if the source file doesn't exist
+bool AssetCacheFilePath(char* buf, size_t bufSize, const char* srcPath, const char* format)
+{
+    int64_t mtime, size;
+    if(!GetFileInfo(srcPath, &mtime, &size)) return false;
+    
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = HashString(hash, srcPath);
+    hash = HashBytes(hash, &mtime, sizeof(mtime));
+    hash = HashBytes(hash, &size, sizeof(size));
+    hash = HashString(hash, format);
+    snprintf(buf, bufSize, "%s%016llx.img", assetCache.path, (unsigned long long)hash);
+    return true;
+}
+
+// Returns false if the image isn't in the cache. On success, the data stays valid
+// until UnmapFile(&res->file)
+bool LoadCachedAsset(const char* srcPath, const char* format, CachedAsset* res)
+{
+    memset(res, 0, sizeof(CachedAsset));
+    if(!assetCache.enabled) return false;
+    
+    char path[512];
+    if(!AssetCacheFilePath(path, sizeof(path), srcPath, format)) return false;
+    if(!MapFile(path, &res->file)) return false;
+    
+    AssetCacheHeader* header = (AssetCacheHeader*)res->file.data;
+    bool valid = res->file.size >= sizeof(AssetCacheHeader) &&
+                 header->magic == AssetCacheMagic &&
+                 header->version == AssetCacheVersion &&
+                 res->file.size == sizeof(AssetCacheHeader) + header->pixelsSize + header->extraSize;
+    if(!valid)
+    {
+        UnmapFile(&res->file);
+        return false;
+    }
+    
+    res->width = (int)header->width;
+    res->height = (int)header->height;
+    res->pixels = (uint8_t*)res->file.data + sizeof(AssetCacheHeader);
+    res->extra = header->extraSize > 0 ? (uint8_t*)res->pixels + header->pixelsSize : NULL;
+    return true;
+}
+
+// Safe to call from multiple threads for different images. The entry is written
+// under a temporary name and then renamed, so that a concurrent launch never maps
+// a partially written file
+bool StoreCachedAsset(const char* srcPath, const char* format, int width, int height,
+                      const void* pixels, size_t pixelsSize, const void* extra, size_t extraSize)
+{
+    if(!assetCache.enabled) return false;
+    
+    char path[512];
+    if(!AssetCacheFilePath(path, sizeof(path), srcPath, format)) return false;
+    char tmpPath[520];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    
+    FILE* f = fopen(tmpPath, "wb");
+    if(!f) return false;
+    
+    AssetCacheHeader header = {AssetCacheMagic, AssetCacheVersion, (uint32_t)width, (uint32_t)height, pixelsSize, extraSize};
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(pixels, pixelsSize, 1, f) == 1;
+    if(extraSize > 0) ok = ok && fwrite(extra, extraSize, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    
+    if(ok) ok = RenameFile(tmpPath, path);
+    if(!ok) remove(tmpPath);
+    return ok;
+}
@@ -0,0 +1,271 @@
+// Bounding volume hierarchy, used for the spheres and quads of a scene.
+// Built on the host with binned SAH, then flattened in depth-first order
+// (the left child of a node always follows it) and uploaded to the GPU.
+
+#define BvhNumBins      16
+#define BvhMaxLeafPrims 4
+#define BvhMaxDepth     30  // The shader's traversal stack is 32 entries deep
+
+struct
+{
+    Vec3 min, max;
+} typedef Aabb;
+
+// Same layout as the two RGBA32F texels per node used by the shader:
+// (min, offset), (max, count). Leaves have count > 0 and offset is their
+// first primitive, interior nodes have count = 0 and offset is their right child.
+struct
+{
+    Aabb bounds;
+    uint32_t offset;
+    uint32_t count;
+} typedef BvhNode;
+
+struct
+{
+    BvhNode* nodes;
+    int numNodes;
+    uint32_t* prims;  // Primitive references, in leaf order
+    int numPrims;
+} typedef Bvh;
+
+struct
+{
+    Aabb bounds;
+    Vec3 centroid;
+    uint32_t ref;
+} typedef BvhPrimInfo;
+
+struct
+{
+    BvhPrimInfo* prims;
+    BvhNode* nodes;
+    int numNodes;
+    int capacity;
+} typedef BvhBuilder;
+
+Aabb EmptyAabb()
+{
+    Aabb res = {{FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+    return res;
+}
+
+Aabb AabbUnion(Aabb a, Aabb b)
+{
+    Aabb res;
+    res.min.x = Min(a.min.x, b.min.x); res.min.y = Min(a.min.y, b.min.y); res.min.z = Min(a.min.z, b.min.z);
+    res.max.x = Max(a.max.x, b.max.x); res.max.y = Max(a.max.y, b.max.y); res.max.z = Max(a.max.z, b.max.z);
+    return res;
+}
+
+Aabb AabbGrow(Aabb a, Vec3 p)
+{
+    Aabb b = {p, p};
+    return AabbUnion(a, b);
+}
+
+float AabbArea(Aabb a)
+{
+    Vec3 d = Sub(a.max, a.min);
+    if(d.x < 0.0f || d.y < 0.0f || d.z < 0.0f) return 0.0f;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+int AddBvhNode(BvhBuilder* b)
+{
+    if(b->numNodes >= b->capacity)
+    {
+        b->capacity = b->capacity == 0 ? 64 : b->capacity * 2;
+        b->nodes = realloc(b->nodes, b->capacity * sizeof(BvhNode));
+    }
+    
+    return b->numNodes++;
+}
+
+void MakeBvhLeaf(BvhBuilder* b, int nodeIdx, int start, int count)
+{
+    b->nodes[nodeIdx].offset = start;
+    b->nodes[nodeIdx].count  = count;
+}
+
+// Builds the subtree for prims [start, start+count), returns the node index
+int BuildBvhRecursive(BvhBuilder* b, int start, int count, int depth)
+{
+    int nodeIdx = AddBvhNode(b);
+    
+    Aabb bounds = EmptyAabb();
+    Aabb centroidBounds = EmptyAabb();
+    for(int i = start; i < start + count; ++i)
+    {
+        bounds = AabbUnion(bounds, b->prims[i].bounds);
+        centroidBounds = AabbGrow(centroidBounds, b->prims[i].centroid);
+    }
+    
+    b->nodes[nodeIdx].bounds = bounds;
+    
+    if(count <= 1 || depth >= BvhMaxDepth)
+    {
+        MakeBvhLeaf(b, nodeIdx, start, count);
+        return nodeIdx;
+    }
+    
+    // Split along the axis with the largest centroid extent
+    Vec3 extent = Sub(centroidBounds.max, centroidBounds.min);
+    int axis = 0;
+    if(extent.y > extent.x) axis = 1;
+    if(extent.z > (&extent.x)[axis]) axis = 2;
+    
+    float axisMin = (&centroidBounds.min.x)[axis];
+    float axisExtent = (&extent.x)[axis];
+    
+    int mid;
+    if(axisExtent <= 0.0f)
+    {
+        // All centroids are in the same spot, SAH can't separate them
+        if(count <= BvhMaxLeafPrims)
+        {
+            MakeBvhLeaf(b, nodeIdx, start, count);
+            return nodeIdx;
+        }
+        
+        mid = start + count / 2;
+    }
+    else
+    {
+        // Bin the primitives
+        int binCounts[BvhNumBins] = {0};
+        Aabb binBounds[BvhNumBins];
+        for(int i = 0; i < BvhNumBins; ++i) binBounds[i] = EmptyAabb();
+        
+        float scale = BvhNumBins / axisExtent;
+        for(int i = start; i < start + count; ++i)
+        {
+            int bin = (int)(((&b->prims[i].centroid.x)[axis] - axisMin) * scale);
+            if(bin >= BvhNumBins) bin = BvhNumBins - 1;
+            ++binCounts[bin];
+            binBounds[bin] = AabbUnion(binBounds[bin], b->prims[i].bounds);
+        }
+        
+        // Sweep from the right to get the cost of every right side
+        float rightAreas[BvhNumBins];
+        int rightCounts[BvhNumBins];
+        Aabb acc = EmptyAabb();
+        int accCount = 0;
+        for(int i = BvhNumBins - 1; i > 0; --i)
+        {
+            acc = AabbUnion(acc, binBounds[i]);
+            accCount += binCounts[i];
+            rightAreas[i] = AabbArea(acc);
+            rightCounts[i] = accCount;
+        }
+        
+        // Sweep from the left and find the split with the lowest cost
+        // (traversal cost is assumed to be the same as an intersection)
+        float bestCost = FLT_MAX;
+        int bestSplit = -1;
+        acc = EmptyAabb();
+        accCount = 0;
+        for(int i = 0; i < BvhNumBins - 1; ++i)
+        {
+            acc = AabbUnion(acc, binBounds[i]);
+            accCount += binCounts[i];
+            if(accCount == 0 || rightCounts[i + 1] == 0) continue;
+            
+            float cost = AabbArea(acc) * accCount + rightAreas[i + 1] * rightCounts[i + 1];
+            if(cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = i;
+            }
+        }
+        
+        float leafCost = AabbArea(bounds) * count;
+        float splitCost = AabbArea(bounds) + bestCost;
+        if(bestSplit == -1 || (splitCost >= leafCost && count <= BvhMaxLeafPrims))
+        {
+            MakeBvhLeaf(b, nodeIdx, start, count);
+            return nodeIdx;
+        }
+        
+        // Partition the primitives in place
+        int i = start;
+        int j = start + count - 1;
+        while(i <= j)
+        {
+            int bin = (int)(((&b->prims[i].centroid.x)[axis] - axisMin) * scale);
+            if(bin >= BvhNumBins) bin = BvhNumBins - 1;
+            
+            if(bin <= bestSplit)
+                ++i;
+            else
+            {
+                BvhPrimInfo tmp = b->prims[i];
+                b->prims[i] = b->prims[j];
+                b->prims[j] = tmp;
+                --j;
+            }
+        }
+        
+        mid = i;
+    }
+    
+    // The left child always directly follows its parent
+    BuildBvhRecursive(b, start, mid - start, depth + 1);
+    int right = BuildBvhRecursive(b, mid, start + count - mid, depth + 1);
+    
+    b->nodes[nodeIdx].offset = right;
+    b->nodes[nodeIdx].count  = 0;
+    return nodeIdx;
+}
+
+// Builds the hierarchy over the given primitive bounds. The leaves store
+// primRefs, which are opaque to the builder.
+Bvh BuildBvh(Aabb* primBounds, uint32_t* primRefs, int numPrims)
+{
+    Bvh res = {0};
+    if(numPrims == 0) return res;
+    
+    BvhBuilder builder = {0};
+    builder.prims = malloc(numPrims * sizeof(BvhPrimInfo));
+    for(int i = 0; i < numPrims; ++i)
+    {
+        BvhPrimInfo* info = &builder.prims[i];
+        info->bounds = primBounds[i];
+        info->centroid = Mul(Sum(primBounds[i].min, primBounds[i].max), 0.5f);
+        info->ref = primRefs[i];
+    }
+    
+    BuildBvhRecursive(&builder, 0, numPrims, 0);
+    
+    res.nodes = builder.nodes;
+    res.numNodes = builder.numNodes;
+    res.prims = malloc(numPrims * sizeof(uint32_t));
+    res.numPrims = numPrims;
+    for(int i = 0; i < numPrims; ++i)
+        res.prims[i] = builder.prims[i].ref;
+    
+    free(builder.prims);
+    return res;
+}
+
+void FreeBvh(Bvh* bvh)
+{
+    free(bvh->nodes);
+    free(bvh->prims);
+    memset(bvh, 0, sizeof(Bvh));
+}
+
+// Two RGBA32F texels per node, see BvhNode
+float* PackBvhNodes(Bvh* bvh)
+{
+    float* res = calloc((size_t)bvh->numNodes * 8, sizeof(float));
+    for(int i = 0; i < bvh->numNodes; ++i)
+    {
+        BvhNode* n = &bvh->nodes[i];
+        float* t = res + (size_t)i * 8;
+        t[0] = n->bounds.min.x; t[1] = n->bounds.min.y; t[2] = n->bounds.min.z; t[3] = (float)n->offset;
+        t[4] = n->bounds.max.x; t[5] = n->bounds.max.y; t[6] = n->bounds.max.z; t[7] = (float)n->count;
+    }
+    
+    return res;
+}
@@ -0,0 +1,1442 @@
+// CPU path tracing backend, for machines without a usable GPU.
+// This is a straight port of shaders/pathtracer.glsl: function names
+// and the order in which random numbers are consumed are kept the same,
+// so that both backends converge to the same image.
+// The frame is split into tiles which are distributed over a thread pool.
+
+#define FltMax 3.402823466e+38f
+
+#define CpuTileSize 16
+
+// Rendering config (same values as the shader)
+const float cpuFov = 90.0f * Pi / 180.0f;
+const float cpuFocalLength = 5.0f;
+const float cpuApertureRadius = 0.001f;
+#define RoughConeSpread 0.05f  // Same as roughConeSpread in the shader
+
+// Images with their mip chains, see BuildMipChain
+struct
+{
+    int width, height;
+    int numLevels;
+    float* levels[MaxMipLevels];  // RGB
+} typedef HdrImage;
+
+struct
+{
+    int width, height;
+    int numLevels;
+    uint8_t* levels[MaxMipLevels];  // RGBA
+} typedef LdrImage;
+
+struct
+{
+    ThreadPool pool;
+    
+    // Accumulation buffer, same layout as pingPongTex:
+    // RGB floats, rows go from bottom to top.
+    int width, height;
+    float* accum;
+    float* moments;  // RGBA, same as the shader's fragMoments
+    
+    HdrImage envMaps[ArrayCount(envMaps)];
+    bool octahedralEnvMaps;  // See EquirectToOctahedral
+    float* envCdfs[ArrayCount(envMaps)];  // See BuildEnvMapCdf
+    int envCdfWidth, envCdfHeight;  // Of the equirectangular source images
+    LdrImage textures[ArrayCount(textures)];
+    float* blueNoise;  // BlueNoiseSize^2 values, see GenerateBlueNoise
+    
+    // Current frame
+    FrameParams params;
+    Scene* scene;
+    
+    volatile int64_t numRays;  // Scene rays traced since the last reset, for benchmarks
+} typedef CpuRenderer;
+
+// Per worker, summed into CpuRenderer.numRays after every tile
+static ThreadLocal int64_t cpuRayCount = 0;
+
+struct
+{
+    Vec3 ori;
+    Vec3 dir;
+    float minDist;
+    float maxDist;
+    
+    // Ray cone, same as the shader
+    float coneWidth;
+    float coneSpread;
+} typedef Ray;
+
+struct
+{
+    bool hit;
+    float dist;
+} typedef RayIntersection;
+
+struct
+{
+    int triId;  // -1 if no hit
+    float dist;
+} typedef RayQuadResult;
+
+struct
+{
+    bool hit;
+    Vec3 pos;
+    Vec3 normal;
+    Vec2 texCoords;
+    Sphere* sphere;  // NULL if the object is not a sphere
+    
+    Material mat;
+    
+    // Ray cone at the hit, same as the shader
+    float texFootprint;
+    float coneWidth;
+    float curvature;
+} typedef HitInfo;
+
+// Next event estimation state of the current path. If the last bounce sampled
+// the lights, hitting one of them is weighted against the light sample with MIS
+struct
+{
+    bool bounce;
+    Vec3 pos;
+    float bsdfPdf;
+} typedef NeeState;
+
+struct
+{
+    float x, y, z, w;
+} typedef Vec4;
+
+// GLSL-like helpers
+static inline Vec3 V3(float x, float y, float z) { Vec3 res = {x, y, z}; return res; }
+static inline Vec3 MulV3(Vec3 a, Vec3 b) { return V3(a.x*b.x, a.y*b.y, a.z*b.z); }
+static inline Vec3 Reflect(Vec3 i, Vec3 n) { return Sub(i, Mul(n, 2.0f * Dot(n, i))); }
+static inline float Sign(float f) { return f > 0.0f ? 1.0f : (f < 0.0f ? -1.0f : 0.0f); }
+static inline float Fract(float f) { return f - floorf(f); }
+
+/////////////////////////////////
+// Initialization
+
+void InitCpuRenderer(CpuRenderer* renderer)
+{
+    InitThreadPool(&renderer->pool, 0);
+}
+
+void ResizeCpuAccumulation(CpuRenderer* renderer, int width, int height)
+{
+    free(renderer->accum);
+    free(renderer->moments);
+    renderer->width  = width;
+    renderer->height = height;
+    renderer->accum  = calloc((size_t)width * height * 3, sizeof(float));
+    renderer->moments = calloc((size_t)width * height * 4, sizeof(float));
+}
+
+/////////////////////////////////
+// Textures
+
+HdrImage MakeHdrImage(int width, int height, float* mips)
+{
+    HdrImage res = {width, height, ImageMipLevels(width, height)};
+    for(int i = 0; i < res.numLevels; ++i)
+        res.levels[i] = (float*)((uint8_t*)mips + ImageLevelOffset(ImageFormat_Rgb32f, width, height, i));
+    return res;
+}
+
+LdrImage MakeLdrImage(int width, int height, uint8_t* mips)
+{
+    LdrImage res = {width, height, ImageMipLevels(width, height)};
+    for(int i = 0; i < res.numLevels; ++i)
+        res.levels[i] = mips + ImageLevelOffset(ImageFormat_Rgba8, width, height, i);
+    return res;
+}
+
+// Same as the shader's TextureLod
+static inline float TextureLod(CpuRenderer* r, float footprint, int size)
+{
+    return r->params.useRayCones ? Max(log2f(footprint * (float)size), 0.0f) : 0.0f;
+}
+
+// The two levels to blend, matching GL_LINEAR_MIPMAP_LINEAR
+static void MipCoords(float lod, int numLevels, int* l0, int* l1, float* t)
+{
+    lod = Clamp(lod, 0.0f, (float)(numLevels - 1));
+    *l0 = (int)lod;
+    *l1 = *l0 + 1 < numLevels ? *l0 + 1 : *l0;
+    *t = lod - (float)*l0;
+}
+
+// Bilinear filtering, matching GL_LINEAR
+static void BilinearCoords(float coord, int size, bool repeat, int* i0, int* i1, float* t)
+{
+    float x = coord * size - 0.5f;
+    float fl = floorf(x);
+    *t = x - fl;
+    int a = (int)fl;
+    int b = a + 1;
+    if(repeat)
+    {
+        a %= size; if(a < 0) a += size;
+        b %= size; if(b < 0) b += size;
+    }
+    else
+    {
+        a = a < 0 ? 0 : (a >= size ? size - 1 : a);
+        b = b < 0 ? 0 : (b >= size ? size - 1 : b);
+    }
+    *i0 = a;
+    *i1 = b;
+}
+
+static Vec3 BilinearHdr(HdrImage* img, int level, Vec2 coords)
+{
+    int width  = img->width  >> level > 0 ? img->width  >> level : 1;
+    int height = img->height >> level > 0 ? img->height >> level : 1;
+    int x0, x1, y0, y1;
+    float tx, ty;
+    BilinearCoords(coords.x, width, false, &x0, &x1, &tx);
+    BilinearCoords(coords.y, height, false, &y0, &y1, &ty);
+    
+    float* pixels = img->levels[level];
+    float* p00 = pixels + ((size_t)y0 * width + x0) * 3;
+    float* p10 = pixels + ((size_t)y0 * width + x1) * 3;
+    float* p01 = pixels + ((size_t)y1 * width + x0) * 3;
+    float* p11 = pixels + ((size_t)y1 * width + x1) * 3;
+    
+    float res[3];
+    for(int c = 0; c < 3; ++c)
+    {
+        float top    = p00[c] + (p10[c] - p00[c]) * tx;
+        float bottom = p01[c] + (p11[c] - p01[c]) * tx;
+        res[c] = top + (bottom - top) * ty;
+    }
+    
+    return V3(res[0], res[1], res[2]);
+}
+
+static Vec4 BilinearLdr(LdrImage* img, int level, Vec2 coords)
+{
+    int width  = img->width  >> level > 0 ? img->width  >> level : 1;
+    int height = img->height >> level > 0 ? img->height >> level : 1;
+    int x0, x1, y0, y1;
+    float tx, ty;
+    BilinearCoords(coords.x, width, true, &x0, &x1, &tx);
+    BilinearCoords(coords.y, height, true, &y0, &y1, &ty);
+    
+    uint8_t* pixels = img->levels[level];
+    uint8_t* p00 = pixels + ((size_t)y0 * width + x0) * 4;
+    uint8_t* p10 = pixels + ((size_t)y0 * width + x1) * 4;
+    uint8_t* p01 = pixels + ((size_t)y1 * width + x0) * 4;
+    uint8_t* p11 = pixels + ((size_t)y1 * width + x1) * 4;
+    
+    float channels[4];
+    for(int c = 0; c < 4; ++c)
+    {
+        float top    = p00[c] + (p10[c] - p00[c]) * tx;
+        float bottom = p01[c] + (p11[c] - p01[c]) * tx;
+        channels[c] = (top + (bottom - top) * ty) / 255.0f;
+    }
+    
+    Vec4 res = {channels[0], channels[1], channels[2], channels[3]};
+    return res;
+}
+
+Vec3 CpuSampleEnvMapUV(CpuRenderer* r, Vec2 coords, uint32_t texId, float footprint)
+{
+    HdrImage* img = &r->envMaps[texId];
+    int l0, l1;
+    float t;
+    MipCoords(TextureLod(r, footprint, img->width), img->numLevels, &l0, &l1, &t);
+    
+    Vec3 res = BilinearHdr(img, l0, coords);
+    if(t > 0.0f)
+        res = Sum(Mul(res, 1.0f - t), Mul(BilinearHdr(img, l1, coords), t));
+    return res;
+}
+
+Vec4 CpuSampleTexture(CpuRenderer* r, Vec2 coords, uint32_t texId, float footprint)
+{
+    Vec4 res = {1.0f, 1.0f, 1.0f, 1.0f};
+    
+    // Avoiding a texture fetch might be faster
+    if(texId == 0) return res;
+    
+    LdrImage* img = &r->textures[texId];
+    int l0, l1;
+    float t;
+    MipCoords(TextureLod(r, footprint, img->width), img->numLevels, &l0, &l1, &t);
+    
+    res = BilinearLdr(img, l0, coords);
+    if(t > 0.0f)
+    {
+        Vec4 next = BilinearLdr(img, l1, coords);
+        res.x += (next.x - res.x) * t;
+        res.y += (next.y - res.y) * t;
+        res.z += (next.z - res.z) * t;
+        res.w += (next.w - res.w) * t;
+    }
+    
+    return res;
+}
+
+// Same as the shader's OctahedralCoords, the inverse of OctahedralDir
+static inline Vec2 OctahedralCoords(Vec3 dir)
+{
+    float sum = fabsf(dir.x) + fabsf(dir.y) + fabsf(dir.z);
+    float x = dir.x / sum;
+    float z = dir.z / sum;
+    if(dir.y < 0.0f)
+    {
+        float fx = (1.0f - fabsf(z)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float fz = (1.0f - fabsf(x)) * (z >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        z = fz;
+    }
+    
+    Vec2 res = {x * 0.5f + 0.5f, z * 0.5f + 0.5f};
+    return res;
+}
+
+// The footprint is the width of the lookup in texture coordinates, see EnvMapFootprint
+Vec3 CpuSampleEnvMap(CpuRenderer* r, Vec3 dir, uint32_t mapId, float footprint)
+{
+    if(r->octahedralEnvMaps)
+        return CpuSampleEnvMapUV(r, OctahedralCoords(dir), mapId, footprint);
+    
+    Vec2 coords;
+    coords.x = (atan2f(dir.z, dir.x) + Pi) / (2*Pi);
+    coords.y = acosf(Clamp(dir.y, -1.0f, 1.0f)) / Pi;
+    return CpuSampleEnvMapUV(r, coords, mapId, footprint);
+}
+
+// Same as the shader's EnvMapFootprint
+static inline float EnvMapFootprint(CpuRenderer* r, float coneSpread)
+{
+    return r->octahedralEnvMaps ? coneSpread / Pi : coneSpread / (2.0f * Pi);
+}
+
+Vec3 CpuSampleSceneEnvMap(CpuRenderer* r, Vec3 dir, float footprint)
+{
+    if(!r->scene->loaded) return V3(0.0f, 0.0f, 0.0f);
+    return CpuSampleEnvMap(r, dir, r->scene->envMap, footprint);
+}
+
+/////////////////////////////////
+// Random numbers
+
+// PCG Random number generator, same as the shader
+static inline float RandomFloat(uint32_t* rngState)
+{
+    *rngState = *rngState * 747796405u + 2891336453u;
+    uint32_t result = ((*rngState >> ((*rngState >> 28) + 4u)) ^ *rngState) * 277803737u;
+    result = (result >> 22) ^ result;
+    return (float)result / 4294967295.0f;
+}
+
+// Low discrepancy sampler, same as the shader (see its comments)
+#define Dim_PixelJitter 0u
+#define Dim_Aperture    2u
+#define Dim_FirstBounce 4u
+#define DimsPerBounce   12u
+
+#define BounceDim_Alpha       0u
+#define BounceDim_Lobe        1u
+#define BounceDim_Direction   2u
+#define BounceDim_LightSelect 4u
+#define BounceDim_Light       5u
+#define BounceDim_Roulette    7u
+#define BounceDim_Env         8u
+#define BounceDim_Alpha2      10u
+
+// State of the current path
+struct
+{
+    SamplerType type;
+    uint32_t rng;        // PCG state, also used for the decisions without a dimension
+    uint32_t index;      // Index of the path in the pixel's sequence
+    uint32_t bounceDim;  // First dimension of the current bounce
+    int x, y;            // Pixel, for the blue noise rotation
+    const float* blueNoise;
+} typedef Sampler;
+
+// Direction numbers of the first 4 Sobol dimensions (Joe and Kuo)
+static const uint32_t sobolDirections[4][32] =
+{
+    {
+        0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+        0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+        0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+        0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+    },
+    {
+        0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+        0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+        0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+        0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+    },
+    {
+        0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+        0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+        0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+        0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+    },
+    {
+        0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+        0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+        0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+        0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u,
+    },
+};
+
+static inline uint32_t HashUInt(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline uint32_t ReverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+static inline uint32_t NestedUniformScramble(uint32_t x, uint32_t seed)
+{
+    x = ReverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return ReverseBits(x);
+}
+
+static inline uint32_t Sobol(uint32_t index, uint32_t dim)
+{
+    uint32_t res = 0;
+    for(uint32_t bit = 0; index != 0; index >>= 1, ++bit)
+    {
+        if(index & 1)
+            res ^= sobolDirections[dim][bit];
+    }
+    
+    return res;
+}
+
+static inline float SobolOwen(uint32_t index, uint32_t dim)
+{
+    const uint32_t seed = 0x5e1f3c7bu;
+    uint32_t group = HashUInt(seed ^ (dim / 4));
+    index = (index & 0xffff0000u) | (NestedUniformScramble(index, group) & 0xffffu);
+    uint32_t res = NestedUniformScramble(Sobol(index, dim % 4), HashUInt(group ^ dim));
+    return (float)(res >> 8) / 16777216.0f;
+}
+
+static inline float BlueNoiseShift(Sampler* smp, uint32_t dim)
+{
+    int offsetX = (int)(Fract(0.7548776662f * (float)dim) * (float)BlueNoiseSize);
+    int offsetY = (int)(Fract(0.5698402910f * (float)dim) * (float)BlueNoiseSize);
+    int x = (smp->x + offsetX) & (BlueNoiseSize - 1);
+    int y = (smp->y + offsetY) & (BlueNoiseSize - 1);
+    return smp->blueNoise[y * BlueNoiseSize + x];
+}
+
+static inline float Sample1D(Sampler* smp, uint32_t dim)
+{
+    if(smp->type == Sampler_Pcg)
+        return RandomFloat(&smp->rng);
+    
+    float res = SobolOwen(smp->index, dim) + BlueNoiseShift(smp, dim);
+    return res >= 1.0f ? res - 1.0f : res;
+}
+
+static inline Vec2 Sample2D(Sampler* smp, uint32_t dim)
+{
+    Vec2 res;
+    res.x = Sample1D(smp, dim);
+    res.y = Sample1D(smp, dim + 1);
+    return res;
+}
+
+static inline float SampleBounce1D(Sampler* smp, uint32_t offset) { return Sample1D(smp, smp->bounceDim + offset); }
+static inline Vec2  SampleBounce2D(Sampler* smp, uint32_t offset) { return Sample2D(smp, smp->bounceDim + offset); }
+
+Vec3 CosineWeightedRandomDirection(Vec3 normal, Vec2 rnd)
+{
+    float r1 = rnd.x;
+    float r2 = rnd.y;
+    
+    // Spherical coordinates
+    float theta = acosf(sqrtf(1.0f - r1));
+    float phi = 2.0f * Pi * r2;
+    
+    // Convert to Cartesian coordinates
+    float x = sinf(theta) * cosf(phi);
+    float y = sinf(theta) * sinf(phi);
+    float z = cosf(theta);
+    
+    // Transform to world space
+    Vec3 w = normal;
+    Vec3 u = Normalize(CrossProduct(fabsf(w.x) > 0.1f ? V3(0.0f, 1.0f, 0.0f) : V3(1.0f, 0.0f, 0.0f), w));
+    Vec3 v = CrossProduct(w, u);
+    return Normalize(Sum(Sum(Mul(u, x), Mul(v, y)), Mul(w, z)));
+}
+
+/////////////////////////////////
+// Intersection
+
+Vec2 Sphere2CubeUV(Vec3 origin, float radius, Vec3 point)
+{
+    Vec3 p = Normalize(Sub(point, origin));
+    Vec2 uv = {0};
+    
+    Vec3 absP = V3(fabsf(p.x), fabsf(p.y), fabsf(p.z));
+    float maxAxis = Max(Max(absP.x, absP.y), absP.z);
+    if(absP.x >= absP.y && absP.x >= absP.z)  // X faces
+    {
+        uv.x = p.z * Sign(p.x);
+        uv.y = p.y;
+    }
+    else if(absP.y >= absP.x && absP.y >= absP.z)  // Y faces
+    {
+        uv.x = p.x;
+        uv.y = p.z * Sign(p.y);
+    }
+    else // Z faces
+    {
+        uv.x = -p.x * Sign(p.z);
+        uv.y = p.y;
+    }
+    
+    uv.x = 0.5f * (uv.x / maxAxis + 1.0f);
+    uv.y = 0.5f * (uv.y / maxAxis + 1.0f);
+    return uv;
+}
+
+Vec3 BarycentricCoords(Vec3 v0, Vec3 v1, Vec3 v2, Vec3 p)
+{
+    Vec3 v0v1 = Sub(v1, v0);
+    Vec3 v0v2 = Sub(v2, v0);
+    Vec3 v0p  = Sub(p, v0);
+    float d00 = Dot(v0v1, v0v1);
+    float d01 = Dot(v0v1, v0v2);
+    float d11 = Dot(v0v2, v0v2);
+    float d20 = Dot(v0p, v0v1);
+    float d21 = Dot(v0p, v0v2);
+    float denom = d00 * d11 - d01 * d01;
+    float v = (d11 * d20 - d01 * d21) / denom;
+    float w = (d00 * d21 - d01 * d20) / denom;
+    float u = 1.0f - v - w;
+    return V3(u, v, w);
+}
+
+RayIntersection RaySphereIntersection(Ray ray, Sphere* sphere)
+{
+    RayIntersection res = {0};
+    
+    Vec3 oc = Sub(ray.ori, sphere->pos);
+    float a = Dot(ray.dir, ray.dir);
+    float b = 2.0f * Dot(oc, ray.dir);
+    float c = Dot(oc, oc) - sphere->rad * sphere->rad;
+    float discriminant = b * b - 4.0f * a * c;
+    
+    if(discriminant < 0.0f) return res;
+    
+    // Sphere intersections
+    float t0 = (-b + sqrtf(discriminant)) / (2.0f * a);
+    float t1 = (-b - sqrtf(discriminant)) / (2.0f * a);
+    res.dist = Min(t0, t1);
+    
+    // If this intersection is not within the allowed range, then
+    // mark it as not intersected
+    res.hit = res.dist >= ray.minDist && res.dist <= ray.maxDist;
+    return res;
+}
+
+RayIntersection RayTriIntersection(Ray ray, Vec3 v0, Vec3 v1, Vec3 v2)
+{
+    RayIntersection res = {0};
+    
+    Vec3 normal = CrossProduct(Sub(v1, v0), Sub(v2, v0));
+    
+    // Ray and tri are facing the same way, thus don't show anything
+    float nDotRayDir = Dot(normal, ray.dir);
+    if(nDotRayDir >= 0.0f) return res;
+    
+    const float epsilon = 0.0001f;
+    if(fabsf(nDotRayDir) < epsilon)  // Parallel
+        return res;
+    
+    float d = -Dot(normal, v0);
+    float t = -(Dot(normal, ray.ori) + d) / nDotRayDir;
+    if(t < 0) return res;  // The triangle is behind
+    
+    Vec3 p = Sum(ray.ori, Mul(ray.dir, t));
+    
+    // Inside-outside test
+    if(Dot(normal, CrossProduct(Sub(v1, v0), Sub(p, v0))) < 0) return res;
+    if(Dot(normal, CrossProduct(Sub(v2, v1), Sub(p, v1))) < 0) return res;
+    if(Dot(normal, CrossProduct(Sub(v0, v2), Sub(p, v2))) < 0) return res;
+    
+    res.dist = t;
+    res.hit  = t >= ray.minDist && t <= ray.maxDist;
+    return res;
+}
+
+RayQuadResult RayQuadIntersection(Ray ray, Quad* quad)
+{
+    RayQuadResult res = {-1, FltMax};
+    
+    RayIntersection i1 = RayTriIntersection(ray, quad->p[0], quad->p[1], quad->p[2]);
+    RayIntersection i2 = RayTriIntersection(ray, quad->p[1], quad->p[3], quad->p[2]);
+    
+    if(i1.hit && i1.dist < res.dist)
+    {
+        res.dist  = i1.dist;
+        res.triId = 0;
+    }
+    if(i2.hit && i2.dist < res.dist)
+    {
+        res.dist  = i2.dist;
+        res.triId = 1;
+    }
+    
+    return res;
+}
+
+// Same as the shader's version, see bvh.c for the node layout
+float RayAabbDist(Vec3 ori, Vec3 invDir, Aabb* box, float maxDist)
+{
+    float tNear = 0.0f;
+    float tFar = maxDist;
+    float* boxMin = &box->min.x;
+    float* boxMax = &box->max.x;
+    float* o = &ori.x;
+    float* inv = &invDir.x;
+    for(int i = 0; i < 3; ++i)
+    {
+        float t0 = (boxMin[i] - o[i]) * inv[i];
+        float t1 = (boxMax[i] - o[i]) * inv[i];
+        tNear = Max(tNear, Min(t0, t1));
+        tFar  = Min(tFar, Max(t0, t1));
+    }
+    
+    return tNear <= tFar ? tNear : FltMax;
+}
+
+// Stack based traversal, visiting the closest child first.
+// With anyHit it stops at the first intersection found (for shadow rays)
+void RayBvhIntersection(Scene* scene, Ray ray, bool anyHit, float* outDist, Sphere** outSphere, Quad** outQuad, int* outTriId)
+{
+    Sphere* hitSphere = NULL;
+    Quad* hitQuad = NULL;
+    float dist = FltMax;
+    int triId = 0;
+    
+    Bvh* bvh = &scene->bvh;
+    Vec3 invDir = V3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    int stack[BvhMaxDepth + 2];
+    float stackDist[BvhMaxDepth + 2];
+    int stackSize = 0;
+    
+    int node = 0;
+    if(bvh->numNodes == 0 || RayAabbDist(ray.ori, invDir, &bvh->nodes[0].bounds, ray.maxDist) == FltMax)
+        node = -1;
+    
+    while(node != -1)
+    {
+        BvhNode* n = &bvh->nodes[node];
+        
+        int next = -1;
+        if(n->count > 0)  // Leaf
+        {
+            for(uint32_t i = n->offset; i < n->offset + n->count; ++i)
+            {
+                uint32_t primRef = bvh->prims[i];
+                if((primRef & PrimRefQuadBit) == 0)
+                {
+                    Sphere* sphere = &scene->spheres[primRef];
+                    RayIntersection inters = RaySphereIntersection(ray, sphere);
+                    if(inters.hit && inters.dist < dist)
+                    {
+                        dist = inters.dist;
+                        hitSphere = sphere;
+                        hitQuad = NULL;
+                    }
+                }
+                else
+                {
+                    Quad* quad = &scene->quads[primRef & ~PrimRefQuadBit];
+                    RayQuadResult inters = RayQuadIntersection(ray, quad);
+                    if(inters.triId > -1 && inters.dist < dist)
+                    {
+                        triId = inters.triId;
+                        dist = inters.dist;
+                        hitQuad = quad;
+                        hitSphere = NULL;
+                    }
+                }
+            }
+            
+            if(anyHit && (hitSphere || hitQuad)) break;
+        }
+        else
+        {
+            int near = node + 1;
+            int far  = n->offset;
+            float maxDist = Min(dist, ray.maxDist);
+            float nearDist = RayAabbDist(ray.ori, invDir, &bvh->nodes[near].bounds, maxDist);
+            float farDist  = RayAabbDist(ray.ori, invDir, &bvh->nodes[far].bounds, maxDist);
+            if(farDist < nearDist)
+            {
+                int tmp = near; near = far; far = tmp;
+                float tmpDist = nearDist; nearDist = farDist; farDist = tmpDist;
+            }
+            
+            if(nearDist != FltMax) next = near;
+            if(farDist != FltMax)
+            {
+                stack[stackSize] = far;
+                stackDist[stackSize] = farDist;
+                ++stackSize;
+            }
+        }
+        
+        // Pop nodes until one that could still contain a closer hit
+        while(next == -1 && stackSize > 0)
+        {
+            --stackSize;
+            if(stackDist[stackSize] < dist) next = stack[stackSize];
+        }
+        
+        node = next;
+    }
+    
+    *outDist = dist;
+    *outSphere = hitSphere;
+    *outQuad = hitQuad;
+    *outTriId = triId;
+}
+
+HitInfo RaySceneIntersection(Scene* scene, Ray ray)
+{
+    HitInfo res = {0};
+    
+    Sphere* hitSphere;
+    Quad* hitQuad;
+    float dist;
+    int triId;
+    RayBvhIntersection(scene, ray, false, &dist, &hitSphere, &hitQuad, &triId);
+    ++cpuRayCount;
+    if(!hitSphere && !hitQuad) return res;
+    
+    res.hit = true;
+    res.pos = Sum(ray.ori, Mul(ray.dir, dist));
+    
+    float texScale;  // Texture coordinates per world unit
+    if(hitSphere)
+    {
+        res.normal = Normalize(Sub(res.pos, hitSphere->pos));
+        res.texCoords = Sphere2CubeUV(hitSphere->pos, hitSphere->rad, res.pos);
+        res.mat = scene->materials[hitSphere->matId];
+        res.sphere = hitSphere;
+        res.curvature = 1.0f / hitSphere->rad;
+        texScale = 0.5f / hitSphere->rad;
+    }
+    else
+    {
+        // Get hit triangle
+        int idx[3] = {0, 1, 2};
+        if(triId == 1)
+        {
+            idx[0] = 1;
+            idx[1] = 3;
+            idx[2] = 2;
+        }
+        
+        Vec3 t0 = hitQuad->p[idx[0]];
+        Vec3 t1 = hitQuad->p[idx[1]];
+        Vec3 t2 = hitQuad->p[idx[2]];
+        res.normal = Normalize(CrossProduct(Sub(t1, t0), Sub(t2, t0)));
+        Vec3 uvw = BarycentricCoords(t0, t1, t2, res.pos);
+        Vec2 c0 = hitQuad->coords[idx[0]];
+        Vec2 c1 = hitQuad->coords[idx[1]];
+        Vec2 c2 = hitQuad->coords[idx[2]];
+        res.texCoords.x = uvw.x * c0.x + uvw.y * c1.x + uvw.z * c2.x;
+        res.texCoords.y = uvw.x * c0.y + uvw.y * c1.y + uvw.z * c2.y;
+        res.mat = scene->materials[hitQuad->matId];
+        
+        Vec3 cross = CrossProduct(Sub(t1, t0), Sub(t2, t0));
+        float worldArea = sqrtf(Dot(cross, cross));
+        float uvArea = fabsf((c1.x - c0.x) * (c2.y - c0.y) - (c2.x - c0.x) * (c1.y - c0.y));
+        res.curvature = 0.0f;
+        texScale = worldArea > 0.0f ? sqrtf(uvArea / worldArea) : 0.0f;
+    }
+    
+    res.coneWidth = ray.coneWidth + ray.coneSpread * dist;
+    res.texFootprint = res.coneWidth * texScale / Max(fabsf(Dot(res.normal, ray.dir)), 0.01f);
+    return res;
+}
+
+bool RaySceneOcclusion(Scene* scene, Ray ray)
+{
+    Sphere* hitSphere;
+    Quad* hitQuad;
+    float dist;
+    int triId;
+    RayBvhIntersection(scene, ray, true, &dist, &hitSphere, &hitQuad, &triId);
+    ++cpuRayCount;
+    return hitSphere || hitQuad;
+}
+
+/////////////////////////////////
+// Materials
+
+Vec3 FresnelSchlickV3(Vec3 color, Vec3 normal, Vec3 outDir)
+{
+    if(color.x == 0.0f && color.y == 0.0f && color.z == 0.0f) return color;
+    
+    float cosine = Dot(normal, outDir);
+    float f = powf(Clamp(1.0f - fabsf(cosine), 0.0f, 1.0f), 5);
+    return V3(color.x + (1.0f - color.x) * f,
+              color.y + (1.0f - color.y) * f,
+              color.z + (1.0f - color.z) * f);
+}
+
+float FresnelSchlick(float value, Vec3 normal, Vec3 outDir)
+{
+    if(value == 0.0f) return 0.0f;
+    
+    float cosine = Dot(normal, outDir);
+    return value + (1.0f - value) * powf(Clamp(1.0f - fabsf(cosine), 0.0f, 1.0f), 5);
+}
+
+Vec3 SampleMicrofacetNormal(float exponent, Vec3 normal, float rndX, float rndY)
+{
+    float z = powf(rndY, 1.0f / (exponent + 1.0f));
+    float r = sqrtf(Max(0.0f, 1.0f - z * z));
+    float phi = 2.0f * Pi * rndX;
+    
+    // Transform the microfacet normal to world space
+    Vec3 n = Normalize(normal);
+    Vec3 up = fabsf(n.z) < 0.999f ? V3(0.0f, 0.0f, 1.0f) : V3(1.0f, 0.0f, 0.0f);
+    Vec3 tangentX = Normalize(CrossProduct(up, n));
+    Vec3 tangentY = CrossProduct(n, tangentX);
+    
+    Vec3 res = Sum(Sum(Mul(tangentX, r * cosf(phi)), Mul(tangentY, r * sinf(phi))), Mul(n, z));
+    return Normalize(res);
+}
+
+/////////////////////////////////
+// Light sampling
+
+float PowerHeuristic(float pdfA, float pdfB)
+{
+    float a2 = pdfA * pdfA;
+    return a2 / (a2 + pdfB * pdfB);
+}
+
+// Returns 1 - cos of the half angle of the cone that contains the sphere,
+// as seen from pos. 0 if pos is inside the sphere.
+float SphereConeSize(Vec3 pos, Sphere* sphere)
+{
+    Vec3 toCenter = Sub(sphere->pos, pos);
+    float dist2 = Dot(toCenter, toCenter);
+    float rad2 = sphere->rad * sphere->rad;
+    if(dist2 <= rad2) return 0.0f;
+    
+    float sinMax2 = rad2 / dist2;
+    float cosMax = sqrtf(1.0f - sinMax2);
+    return sinMax2 / (1.0f + cosMax);  // Same as 1 - cosMax, without the cancellation
+}
+
+// Solid angle pdf of sampling a direction towards the light from pos
+float LightPdf(Scene* scene, Vec3 pos, Sphere* light)
+{
+    float cone = SphereConeSize(pos, light);
+    if(cone <= 0.0f) return 0.0f;
+    return 1.0f / ((float)scene->numLights * 2.0f * Pi * cone);
+}
+
+// Picks one of the lights and samples a direction in its cone. Returns false if
+// the light is occluded or not visible from pos, otherwise its emission along dir
+bool SampleSphereLight(CpuRenderer* r, Vec3 pos, Vec3 normal, Ray* bounce, Vec3* dir, Vec3* emission, float* lightPdf, Sampler* smp)
+{
+    Scene* scene = r->scene;
+    int numLights = scene->numLights;
+    int lightIdx = (int)(SampleBounce1D(smp, BounceDim_LightSelect) * (float)numLights);
+    if(lightIdx > numLights - 1) lightIdx = numLights - 1;
+    Vec2 rnd = SampleBounce2D(smp, BounceDim_Light);
+    float r1 = rnd.x;
+    float r2 = rnd.y;
+    
+    Sphere* light = &scene->spheres[scene->lights[lightIdx]];
+    float cone = SphereConeSize(pos, light);
+    if(cone <= 0.0f) return false;
+    
+    // Uniformly sample the cone
+    float cosTheta = 1.0f - r1 * cone;
+    float sinTheta = sqrtf(Max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * Pi * r2;
+    Vec3 w = Normalize(Sub(light->pos, pos));
+    Vec3 u = Normalize(CrossProduct(fabsf(w.x) > 0.1f ? V3(0.0f, 1.0f, 0.0f) : V3(1.0f, 0.0f, 0.0f), w));
+    Vec3 v = CrossProduct(w, u);
+    *dir = Normalize(Sum(Sum(Mul(u, sinTheta * cosf(phi)), Mul(v, sinTheta * sinf(phi))), Mul(w, cosTheta)));
+    if(Dot(normal, *dir) <= 0.0f) return false;
+    
+    Ray shadowRay = {pos, *dir, 0.0001f, 10000.0f};
+    RayIntersection lightHit = RaySphereIntersection(shadowRay, light);
+    if(!lightHit.hit) return false;
+    
+    shadowRay.maxDist = lightHit.dist * 0.999f;
+    if(RaySceneOcclusion(scene, shadowRay)) return false;
+    
+    Material* mat = &scene->materials[light->matId];
+    Vec2 lightCoords = Sphere2CubeUV(light->pos, light->rad, Sum(pos, Mul(*dir, lightHit.dist)));
+    // Same footprint as a bounce that hits the light, see RaySceneIntersection
+    Vec3 lightNormal = Normalize(Sub(Sum(pos, Mul(*dir, lightHit.dist)), light->pos));
+    float coneWidth = bounce->coneWidth + bounce->coneSpread * lightHit.dist;
+    float footprint = coneWidth * 0.5f / light->rad / Max(fabsf(Dot(lightNormal, *dir)), 0.01f);
+    Vec4 tex = CpuSampleTexture(r, lightCoords, mat->emission, footprint);
+    *emission = MulV3(V3(tex.x, tex.y, tex.z), mat->emissionScale);
+    *lightPdf = 1.0f / ((float)numLights * 2.0f * Pi * cone);
+    return true;
+}
+
+static inline bool SphereLightSamplingEnabled(CpuRenderer* r) { return r->params.useNee && r->scene->numLights > 0; }
+static inline bool EnvSamplingEnabled(CpuRenderer* r) { return r->params.useEnvSampling && r->scene->loaded; }
+
+// Returns the first index in [0, count) with a CDF value greater than u
+int SampleEnvCdf(float* cdf, int count, float u)
+{
+    int lo = 0;
+    int hi = count - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(cdf[mid] > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    
+    return lo;
+}
+
+// Samples a direction proportionally to the scene's environment map luminance
+Vec3 SampleEnvDirection(CpuRenderer* r, float* pdf, Sampler* smp)
+{
+    float* cdfs = r->envCdfs[r->scene->envMap];
+    int width  = r->envCdfWidth;
+    int height = r->envCdfHeight;
+    Vec2 rnd = SampleBounce2D(smp, BounceDim_Env);
+    float u1 = rnd.x;
+    float u2 = rnd.y;
+    
+    float* marginal = cdfs + (size_t)height * width;
+    int y = SampleEnvCdf(marginal, height, u1);
+    float y0 = y > 0 ? marginal[y - 1] : 0.0f;
+    float y1 = marginal[y];
+    float* row = cdfs + (size_t)y * width;
+    int x = SampleEnvCdf(row, width, u2);
+    float x0 = x > 0 ? row[x - 1] : 0.0f;
+    float x1 = row[x];
+    
+    // Reuse the random numbers for the position inside of the texel
+    float fx = Clamp((u2 - x0) / Max(x1 - x0, 1e-12f), 0.0f, 0.9999f);
+    float fy = Clamp((u1 - y0) / Max(y1 - y0, 1e-12f), 0.0f, 0.9999f);
+    float u = ((float)x + fx) / (float)width;
+    float v = ((float)y + fy) / (float)height;
+    
+    // Inverse of the mapping in CpuSampleEnvMap
+    float theta = v * Pi;
+    float phi = u * 2.0f * Pi - Pi;
+    float sinTheta = sinf(theta);
+    
+    *pdf = 0.0f;
+    if(sinTheta > 0.0f)
+        *pdf = (x1 - x0) * (y1 - y0) * (float)(width * height) / (2.0f * Pi * Pi * sinTheta);
+    
+    return V3(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
+}
+
+// Solid angle pdf of SampleEnvDirection
+float EnvPdf(CpuRenderer* r, Vec3 dir)
+{
+    float* cdfs = r->envCdfs[r->scene->envMap];
+    int width  = r->envCdfWidth;
+    int height = r->envCdfHeight;
+    
+    float u = (atan2f(dir.z, dir.x) + Pi) / (2*Pi);
+    float theta = acosf(Clamp(dir.y, -1.0f, 1.0f));
+    float sinTheta = sinf(theta);
+    if(sinTheta <= 0.0f) return 0.0f;
+    
+    int x = (int)(u * (float)width);
+    int y = (int)(theta / Pi * (float)height);
+    x = x < 0 ? 0 : (x >= width ? width - 1 : x);
+    y = y < 0 ? 0 : (y >= height ? height - 1 : y);
+    float* row = cdfs + (size_t)y * width;
+    float* marginal = cdfs + (size_t)height * width;
+    float pdfX = row[x] - (x > 0 ? row[x - 1] : 0.0f);
+    float pdfY = marginal[y] - (y > 0 ? marginal[y - 1] : 0.0f);
+    return pdfX * pdfY * (float)(width * height) / (2.0f * Pi * Pi * sinTheta);
+}
+
+// Samples a direction towards the environment. Returns false if it's occluded
+bool SampleEnvLight(CpuRenderer* r, Vec3 pos, Vec3 normal, Ray* bounce, Vec3* dir, Vec3* emission, float* lightPdf, Sampler* smp)
+{
+    *dir = SampleEnvDirection(r, lightPdf, smp);
+    if(*lightPdf <= 0.0f || Dot(normal, *dir) <= 0.0f) return false;
+    
+    Ray shadowRay = {pos, *dir, 0.0001f, 10000.0f};
+    if(RaySceneOcclusion(r->scene, shadowRay)) return false;
+    
+    *emission = CpuSampleSceneEnvMap(r, *dir, EnvMapFootprint(r, bounce->coneSpread));
+    return true;
+}
+
+float DiffuseLightWeight(Vec3 normal, Vec3 dir, float lightPdf)
+{
+    float cosine = Dot(normal, dir);
+    float bsdfPdf = cosine / Pi;
+    return (cosine / Pi) / lightPdf * PowerHeuristic(lightPdf, bsdfPdf);
+}
+
+// MIS weighted contribution of the lights reflected by a lambertian surface
+Vec3 SampleLightsDiffuse(CpuRenderer* r, Vec3 pos, Vec3 normal, Vec3 albedo, Ray* bounce, Sampler* smp)
+{
+    Vec3 res = {0};
+    Vec3 dir, emission;
+    float lightPdf;
+    if(SphereLightSamplingEnabled(r) && SampleSphereLight(r, pos, normal, bounce, &dir, &emission, &lightPdf, smp))
+        res = Sum(res, Mul(MulV3(emission, albedo), DiffuseLightWeight(normal, dir, lightPdf)));
+    if(EnvSamplingEnabled(r) && SampleEnvLight(r, pos, normal, bounce, &dir, &emission, &lightPdf, smp))
+        res = Sum(res, Mul(MulV3(emission, albedo), DiffuseLightWeight(normal, dir, lightPdf)));
+    
+    return res;
+}
+
+// Solid angle pdf of the reflected directions obtained with SampleMicrofacetNormal
+// (only the first scattering event, without the internal bounces)
+float MicrofacetReflectionPdf(float exponent, Vec3 normal, Vec3 outDir, Vec3 inDir)
+{
+    Vec3 h = Normalize(Sum(outDir, inDir));
+    float cosH = Dot(normal, h);
+    if(cosH <= 0.0f) return 0.0f;
+    
+    float pdfH = (exponent + 1.0f) / (2.0f * Pi) * powf(cosH, exponent);
+    return pdfH / (4.0f * fabsf(Dot(outDir, h)));
+}
+
+Vec3 MicrofacetLightContribution(Vec3 normal, Vec3 outDir, Vec3 color, float exponent, Vec3 dir, Vec3 emission, float lightPdf)
+{
+    float bsdfPdf = MicrofacetReflectionPdf(exponent, normal, outDir, dir);
+    if(bsdfPdf <= 0.0f) return V3(0.0f, 0.0f, 0.0f);
+    
+    Vec3 fresnel = FresnelSchlickV3(color, Normalize(Sum(outDir, dir)), outDir);
+    float weight = bsdfPdf / lightPdf * PowerHeuristic(lightPdf, bsdfPdf);
+    return Mul(MulV3(emission, fresnel), weight);
+}
+
+// MIS weighted contribution of the lights reflected by the ReflectiveModel. Its
+// estimator weights sampled directions by the fresnel term, so f * cos = fresnel * pdf
+Vec3 SampleLightsMicrofacet(CpuRenderer* r, Vec3 pos, Vec3 normal, Vec3 outDir, Vec3 color, float exponent, Ray* bounce, Sampler* smp)
+{
+    Vec3 res = {0};
+    Vec3 dir, emission;
+    float lightPdf;
+    if(SphereLightSamplingEnabled(r) && SampleSphereLight(r, pos, normal, bounce, &dir, &emission, &lightPdf, smp))
+        res = Sum(res, MicrofacetLightContribution(normal, outDir, color, exponent, dir, emission, lightPdf));
+    if(EnvSamplingEnabled(r) && SampleEnvLight(r, pos, normal, bounce, &dir, &emission, &lightPdf, smp))
+        res = Sum(res, MicrofacetLightContribution(normal, outDir, color, exponent, dir, emission, lightPdf));
+    
+    return res;
+}
+
+// Same as the shader
+static inline void SpreadRayCone(Ray* ray, HitInfo* hit, float roughness)
+{
+    ray->coneSpread += 2.0f * hit->curvature * ray->coneWidth + roughness * RoughConeSpread;
+}
+
+static inline Vec3 MatColor(Vec4 texColor, Vec3 colorScale)
+{
+    return V3(texColor.x * colorScale.x, texColor.y * colorScale.y, texColor.z * colorScale.z);
+}
+
+static inline Vec3 EmittedLight(CpuRenderer* r, HitInfo* hit)
+{
+    Vec4 tex = CpuSampleTexture(r, hit->texCoords, hit->mat.emission, hit->texFootprint);
+    return MulV3(V3(tex.x, tex.y, tex.z), hit->mat.emissionScale);
+}
+
+void MatteModel(CpuRenderer* r, HitInfo* hit, Ray* currentRay, Vec3* luminance, Vec3* rayColor, NeeState* nee, Sampler* smp)
+{
+    Material* mat = &hit->mat;
+    
+    Vec4 tex = CpuSampleTexture(r, hit->texCoords, mat->color, hit->texFootprint);
+    
+    currentRay->ori = hit->pos;
+    
+    if(SampleBounce1D(smp, BounceDim_Alpha) > tex.w)
+        return;
+    
+    currentRay->dir = CosineWeightedRandomDirection(hit->normal, SampleBounce2D(smp, BounceDim_Direction));
+    SpreadRayCone(currentRay, hit, 1.0f);
+    
+    *luminance = Sum(*luminance, MulV3(EmittedLight(r, hit), *rayColor));
+    
+    Vec3 matColor = MatColor(tex, mat->colorScale);
+    if(SphereLightSamplingEnabled(r) || EnvSamplingEnabled(r))
+    {
+        Vec3 direct = SampleLightsDiffuse(r, hit->pos, hit->normal, matColor, currentRay, smp);
+        *luminance = Sum(*luminance, MulV3(direct, *rayColor));
+        nee->bounce  = true;
+        nee->pos     = hit->pos;
+        nee->bsdfPdf = Max(Dot(hit->normal, currentRay->dir), 0.0f) / Pi;
+    }
+    
+    *rayColor = MulV3(*rayColor, matColor);
+}
+
+void ReflectiveModel(CpuRenderer* r, HitInfo* hit, Ray* currentRay, Vec3* luminance, Vec3* rayColor, uint32_t* iter, NeeState* nee, Sampler* smp)
+{
+    Material* mat = &hit->mat;
+    
+    Vec4 tex = CpuSampleTexture(r, hit->texCoords, mat->color, hit->texFootprint);
+    if(SampleBounce1D(smp, BounceDim_Alpha) > tex.w)
+    {
+        currentRay->ori = hit->pos;
+        return;
+    }
+    
+    Vec3 matColor = MatColor(tex, mat->colorScale);
+    float matRoughness = CpuSampleTexture(r, hit->texCoords, mat->roughness, hit->texFootprint).x * mat->roughnessScale;
+    matRoughness = Clamp(matRoughness, 0.0f, 1.0f);
+    float exponent = 2.0f / (matRoughness * matRoughness);
+    
+    // Lights are only sampled for the first scattering event,
+    // paths which reach them after internal bounces are not MIS weighted
+    Vec3 outDir = Mul(currentRay->dir, -1.0f);
+    bool sampleLights = (SphereLightSamplingEnabled(r) || EnvSamplingEnabled(r)) && matRoughness > 0.0001f;
+    if(sampleLights)
+    {
+        Ray bounce = *currentRay;
+        SpreadRayCone(&bounce, hit, matRoughness);
+        Vec3 direct = SampleLightsMicrofacet(r, hit->pos, hit->normal, outDir, matColor, exponent, &bounce, smp);
+        *luminance = Sum(*luminance, MulV3(direct, *rayColor));
+    }
+    
+    Vec3 direction = currentRay->dir;  // Current direction caused by internal bounce
+    bool firstEvent = true;
+    // Simulate internal bounces and count them as normal bounces, because they're quite expensive
+    while(*iter < r->params.maxBounces)
+    {
+        Vec3 normal = hit->normal;
+        if(matRoughness > 0.0001f)
+        {
+            Vec2 rnd;
+            if(firstEvent)
+                rnd = SampleBounce2D(smp, BounceDim_Direction);
+            else
+            {
+                rnd.x = RandomFloat(&smp->rng);
+                rnd.y = RandomFloat(&smp->rng);
+            }
+            
+            normal = SampleMicrofacetNormal(exponent, hit->normal, rnd.x, rnd.y);
+        }
+        
+        Vec3 reflection = Reflect(direction, normal);
+        Vec3 fresnel = FresnelSchlickV3(matColor, normal, Mul(direction, -1.0f));
+        *luminance = Sum(*luminance, MulV3(EmittedLight(r, hit), *rayColor));
+        *rayColor = MulV3(*rayColor, fresnel);
+        
+        direction = reflection;
+        
+        // If the reflection ray ends up through the surface
+        // (because the roughness is high and the microfacet
+        // normal is very perturbed) keep following this ray.
+        if(Dot(reflection, hit->normal) > 0.0f)
+        {
+            currentRay->ori = hit->pos;
+            currentRay->dir = reflection;
+            SpreadRayCone(currentRay, hit, matRoughness);
+            
+            if(sampleLights && firstEvent)
+            {
+                nee->bounce  = true;
+                nee->pos     = hit->pos;
+                nee->bsdfPdf = MicrofacetReflectionPdf(exponent, hit->normal, outDir, reflection);
+            }
+            break;
+        }
+        
+        firstEvent = false;
+        ++*iter;
+    }
+}
+
+void TransparentModel(CpuRenderer* r, HitInfo* hit, Ray* currentRay, Vec3* luminance, Vec3* rayColor, Sampler* smp)
+{
+    Material* mat = &hit->mat;
+    Vec3 outDir = Mul(currentRay->dir, -1.0f);
+    Vec4 tex = CpuSampleTexture(r, hit->texCoords, mat->color, hit->texFootprint);
+    
+    currentRay->ori = hit->pos;
+    
+    if(SampleBounce1D(smp, BounceDim_Alpha) > tex.w)
+        return;
+    
+    *luminance = Sum(*luminance, MulV3(EmittedLight(r, hit), *rayColor));
+    
+    float fresnel = FresnelSchlick(0.04f, hit->normal, outDir);
+    if(SampleBounce1D(smp, BounceDim_Lobe) < fresnel)
+    {
+        currentRay->dir = Reflect(currentRay->dir, hit->normal);
+        SpreadRayCone(currentRay, hit, 0.0f);
+    }
+    else
+        *rayColor = MulV3(*rayColor, MatColor(tex, mat->colorScale));  // Go through the object
+}
+
+void GlossyModel(CpuRenderer* r, HitInfo* hit, Ray* currentRay, Vec3* luminance, Vec3* rayColor, NeeState* nee, Sampler* smp)
+{
+    Material* mat = &hit->mat;
+    Vec3 outDir = Mul(currentRay->dir, -1.0f);
+    float fresnel = FresnelSchlick(0.04f, hit->normal, outDir);
+    if(SampleBounce1D(smp, BounceDim_Lobe) < fresnel)
+    {
+        Vec4 tex = CpuSampleTexture(r, hit->texCoords, mat->color, hit->texFootprint);
+        if(SampleBounce1D(smp, BounceDim_Alpha2) <= tex.w)
+        {
+            *luminance = Sum(*luminance, MulV3(EmittedLight(r, hit), *rayColor));
+            currentRay->dir = Reflect(currentRay->dir, hit->normal);
+            SpreadRayCone(currentRay, hit, 0.0f);
+        }
+    }
+    else
+        MatteModel(r, hit, currentRay, luminance, rayColor, nee, smp);
+}
+
+/////////////////////////////////
+// Main
+
+Vec3 CameraFrame2World(Vec3 v, float yaw, float pitch)
+{
+    float cosYaw = cosf(yaw);
+    float sinYaw = sinf(yaw);
+    float cosPitch = cosf(pitch);
+    float sinPitch = sinf(pitch);
+    
+    Vec3 pitchRotated;
+    pitchRotated.x = v.x;
+    pitchRotated.y = v.y * cosPitch - v.z * sinPitch;
+    pitchRotated.z = v.y * sinPitch + v.z * cosPitch;
+    
+    Vec3 yawPitchRotated;
+    yawPitchRotated.x = pitchRotated.x * cosYaw + pitchRotated.z * sinYaw;
+    yawPitchRotated.y = pitchRotated.y;
+    yawPitchRotated.z = -pitchRotated.x * sinYaw + pitchRotated.z * cosYaw;
+    
+    return yawPitchRotated;
+}
+
+// Equivalent of the fragment shader's main(), without the accumulation
+Vec3 CpuTracePixel(CpuRenderer* r, int x, int y, uint32_t firstSample)
+{
+    FrameParams* params = &r->params;
+    float resX = (float)params->width;
+    float resY = (float)params->height;
+    
+    // Same as gl_FragCoord (pixel centers)
+    float fragX = (float)x + 0.5f;
+    float fragY = (float)y + 0.5f;
+    
+    // Make sure we don't reuse pixelIds from one frame to the next
+    uint32_t pixelId = (uint32_t)(fragY * resX + fragX);
+    uint32_t lastId  = (uint32_t)(resY * resX + resX);
+    Sampler smp = {0};
+    smp.type = params->sampler;
+    smp.rng = pixelId + (lastId + 1u) * params->frameId;
+    smp.x = x;
+    smp.y = y;
+    smp.blueNoise = r->blueNoise;
+    
+    float tanHalfFov = tanf(cpuFov / 2.0f);
+    Vec3 finalColor = {0};
+    for(uint32_t j = 0; j < params->numSamples; ++j)
+    {
+        smp.index = firstSample + j;
+        
+        // Randomly nudge the coordinate to achieve antialiasing
+        Vec2 nudge = Sample2D(&smp, Dim_PixelJitter);
+        float u = Clamp(fragX + nudge.x - 0.5f, 0.0f, resX) / resX;
+        float v = Clamp(fragY + nudge.y - 0.5f, 0.0f, resY) / resY;
+        
+        Vec3 coord = V3((2.0f * u - 1.0f) * tanHalfFov, (2.0f * v - 1.0f) * tanHalfFov * (resY / resX), 1.0f);
+        
+        Vec3 cameraLookat = Normalize(coord);
+        Vec3 worldCameraLookat = Normalize(CameraFrame2World(cameraLookat, params->camRot.x, params->camRot.y));
+        
+        // Depth of field effect
+        Vec3 focalPoint = Sum(params->camPos, Mul(worldCameraLookat, cpuFocalLength));
+        Vec2 apertureRnd = Sample2D(&smp, Dim_Aperture);
+        float radius = sqrtf(apertureRnd.x);
+        float angle  = apertureRnd.y * 2 * Pi;
+        Vec3 apertureOffset = V3(cpuApertureRadius * cosf(angle) * radius, cpuApertureRadius * sinf(angle) * radius, 0.0f);
+        Vec3 apertureSample = Sum(params->camPos, CameraFrame2World(apertureOffset, params->camRot.x, params->camRot.y));
+        
+        Ray currentRay = {apertureSample, Normalize(Sub(focalPoint, apertureSample)), 0.0001f, 10000.0f};
+        currentRay.coneSpread = 2.0f * tanHalfFov / resX;  // One pixel
+        
+        // Product of all object colors/multiplicative terms that the ray has hit up to now
+        Vec3 rayColor = V3(1.0f, 1.0f, 1.0f);
+        Vec3 luminance = {0};
+        NeeState nee = {0};
+        for(uint32_t i = 0; i < params->maxBounces; ++i)
+        {
+            smp.bounceDim = Dim_FirstBounce + i * DimsPerBounce;
+            HitInfo hit = RaySceneIntersection(r->scene, currentRay);
+            
+            if(!hit.hit)
+            {
+                // The environment might have been sampled already
+                Vec3 envLight = CpuSampleSceneEnvMap(r, currentRay.dir, EnvMapFootprint(r, currentRay.coneSpread));
+                if(nee.bounce && EnvSamplingEnabled(r))
+                    envLight = Mul(envLight, PowerHeuristic(nee.bsdfPdf, EnvPdf(r, currentRay.dir)));
+                
+                luminance = Sum(luminance, MulV3(envLight, rayColor));
+                break;
+            }
+            
+            // Emissive spheres are lights, which might have been sampled already
+            if(nee.bounce && SphereLightSamplingEnabled(r) && hit.sphere)
+            {
+                float lightPdf = LightPdf(r->scene, nee.pos, hit.sphere);
+                hit.mat.emissionScale = Mul(hit.mat.emissionScale, PowerHeuristic(nee.bsdfPdf, lightPdf));
+            }
+            
+            nee.bounce = false;
+            currentRay.coneWidth = hit.coneWidth;
+            
+            switch(hit.mat.matType)
+            {
+                case MatType_Matte:       MatteModel(r, &hit, &currentRay, &luminance, &rayColor, &nee, &smp); break;
+                case MatType_Reflective:  ReflectiveModel(r, &hit, &currentRay, &luminance, &rayColor, &i, &nee, &smp); break;
+                case MatType_Transparent: TransparentModel(r, &hit, &currentRay, &luminance, &rayColor, &smp); break;
+                case MatType_Glossy:      GlossyModel(r, &hit, &currentRay, &luminance, &rayColor, &nee, &smp); break;
+            }
+            
+            // Russian roulette, same as the shader
+            if(i + 1 >= params->minBounces)
+            {
+                float survival = Min(Max(rayColor.x, Max(rayColor.y, rayColor.z)), 1.0f);
+                if(SampleBounce1D(&smp, BounceDim_Roulette) >= survival)
+                    break;
+                
+                rayColor = Mul(rayColor, 1.0f / survival);
+            }
+        }
+        
+        finalColor = Sum(finalColor, luminance);
+    }
+    
+    return Mul(finalColor, 1.0f / (float)params->numSamples);
+}
+
+// Same as in the shader
+float DisplayLuminance(Vec3 color)
+{
+    float lum = Max(0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z, 0.0f);
+    lum = (0.9f*lum*lum + 0.02f*lum) / (0.87f*lum*lum + 0.35f*lum + 0.14f);
+    return powf(lum, 1.0f / 2.2f);
+}
+
+// Same as in the shader, moments are (mean luminance, mean squared luminance, samples, frames)
+float ConvergenceRatio(float* moments, float threshold)
+{
+    if(moments[3] < 2.0f) return 1e6f;  // No estimate of the variance yet
+    
+    float mean = moments[0];
+    float frameVariance = Max(moments[1] - mean * mean, 0.0f);
+    float error = sqrtf(frameVariance / (moments[3] - 1.0f));
+    return error / threshold;
+}
+
+// Adds the estimate of a frame with numSamples samples, returns its weight.
+// Pixels can skip frames, so each one keeps its own sample count
+float AccumulateMoments(float* moments, float lum, uint32_t numSamples)
+{
+    float pixelSamples = moments[2];
+    float weight = pixelSamples == 0.0f ? 1.0f : (float)numSamples / (pixelSamples + (float)numSamples);
+    moments[0] = moments[0] * (1.0f - weight) + lum * weight;
+    moments[1] = moments[1] * (1.0f - weight) + lum * lum * weight;
+    moments[2] = pixelSamples + (float)numSamples;
+    moments[3] += 1.0f;
+    return weight;
+}
+
+void CpuRenderTile(void* userData, int tileIdx)
+{
+    CpuRenderer* r = (CpuRenderer*)userData;
+    int tilesX = (r->width + CpuTileSize - 1) / CpuTileSize;
+    int startX = (tileIdx % tilesX) * CpuTileSize;
+    int startY = (tileIdx / tilesX) * CpuTileSize;
+    int endX = startX + CpuTileSize < r->width  ? startX + CpuTileSize : r->width;
+    int endY = startY + CpuTileSize < r->height ? startY + CpuTileSize : r->height;
+    
+    FrameParams* params = &r->params;
+    int64_t startRayCount = cpuRayCount;
+    
+    for(int y = startY; y < endY; ++y)
+    {
+        for(int x = startX; x < endX; ++x)
+        {
+            float* accum   = r->accum   + ((size_t)y * r->width + x) * 3;
+            float* moments = r->moments + ((size_t)y * r->width + x) * 4;
+            if(params->accumSamples == 0)
+                memset(moments, 0, 4 * sizeof(float));
+            
+            // Converged pixels keep their value, like in the shader
+            if(params->adaptiveSampling && moments[2] >= (float)AdaptiveMinSamples &&
+               ConvergenceRatio(moments, params->convergenceThreshold) <= 1.0f)
+                continue;
+            
+            Vec3 color = CpuTracePixel(r, x, y, (uint32_t)moments[2]);
+            
+            // Progressive rendering, weighted by the pixel's number of samples
+            float weight = AccumulateMoments(moments, DisplayLuminance(color), params->numSamples);
+            accum[0] = accum[0] * (1.0f - weight) + color.x * weight;
+            accum[1] = accum[1] * (1.0f - weight) + color.y * weight;
+            accum[2] = accum[2] * (1.0f - weight) + color.z * weight;
+        }
+    }
+    
+    AtomicAdd64(&r->numRays, cpuRayCount - startRayCount);
+}
+
+// Renders one frame into the accumulation buffer
+void CpuRenderFrame(CpuRenderer* renderer, FrameParams* params)
+{
+    if(renderer->width != params->width || renderer->height != params->height)
+        ResizeCpuAccumulation(renderer, params->width, params->height);
+    
+    renderer->params = *params;
+    renderer->scene = &scenes[params->scene < MaxScenes ? params->scene : 0];
+    
+    int tilesX = (params->width  + CpuTileSize - 1) / CpuTileSize;
+    int tilesY = (params->height + CpuTileSize - 1) / CpuTileSize;
+    ParallelFor(&renderer->pool, tilesX * tilesY, CpuRenderTile, renderer);
+}
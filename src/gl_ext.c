@@ -0,0 +1,98 @@
+// OpenGL entry points newer than the 4.0 core loader in glad.c.
+// They're loaded at runtime if the context supports them, and
+// are NULL otherwise, so callers have to check GlVersionAtLeast (or the
+// function pointer, for the ones that are also extensions) first.
+
+// GL 4.1 (or ARB_get_program_binary)
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH           0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS      0x87FE
+
+// GL 4.2 (or ARB_shader_image_load_store)
+#define GL_SHADER_IMAGE_ACCESS_BARRIER_BIT 0x00000020
+#define GL_ALL_BARRIER_BITS                0xFFFFFFFF
+
+// GL 4.2 (or ARB_texture_compression_bptc). Only formats, so nothing to load
+#define GL_COMPRESSED_RGBA_BPTC_UNORM          0x8E8C
+#define GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT  0x8E8F
+
+// GL 4.3
+#define GL_COMPUTE_SHADER              0x91B9
+#define GL_SHADER_STORAGE_BUFFER       0x90D2
+#define GL_DISPATCH_INDIRECT_BUFFER    0x90EE
+#define GL_SHADER_STORAGE_BARRIER_BIT  0x00002000
+#define GL_COMMAND_BARRIER_BIT         0x00000040
+
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void* binary, GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+typedef void (APIENTRYP PFNGLMEMORYBARRIERPROC)(GLbitfield barriers);
+typedef void (APIENTRYP PFNGLBINDIMAGETEXTUREPROC)(GLuint unit, GLuint texture, GLint level, GLboolean layered, GLint layer, GLenum access, GLenum format);
+typedef void (APIENTRYP PFNGLDISPATCHCOMPUTEPROC)(GLuint numGroupsX, GLuint numGroupsY, GLuint numGroupsZ);
+typedef void (APIENTRYP PFNGLDISPATCHCOMPUTEINDIRECTPROC)(GLintptr indirect);
+typedef void (APIENTRYP PFNGLCOPYIMAGESUBDATAPROC)(GLuint srcName, GLenum srcTarget, GLint srcLevel, GLint srcX, GLint srcY, GLint srcZ,
+                                                   GLuint dstName, GLenum dstTarget, GLint dstLevel, GLint dstX, GLint dstY, GLint dstZ,
+                                                   GLsizei srcWidth, GLsizei srcHeight, GLsizei srcDepth);
+
+PFNGLGETPROGRAMBINARYPROC glad_glGetProgramBinary = NULL;
+PFNGLPROGRAMBINARYPROC glad_glProgramBinary = NULL;
+PFNGLPROGRAMPARAMETERIPROC glad_glProgramParameteri = NULL;
+PFNGLMEMORYBARRIERPROC glad_glMemoryBarrier = NULL;
+PFNGLBINDIMAGETEXTUREPROC glad_glBindImageTexture = NULL;
+PFNGLDISPATCHCOMPUTEPROC glad_glDispatchCompute = NULL;
+PFNGLDISPATCHCOMPUTEINDIRECTPROC glad_glDispatchComputeIndirect = NULL;
+PFNGLCOPYIMAGESUBDATAPROC glad_glCopyImageSubData = NULL;
+
+#define glGetProgramBinary glad_glGetProgramBinary
+#define glProgramBinary glad_glProgramBinary
+#define glProgramParameteri glad_glProgramParameteri
+#define glMemoryBarrier glad_glMemoryBarrier
+#define glBindImageTexture glad_glBindImageTexture
+#define glDispatchCompute glad_glDispatchCompute
+#define glDispatchComputeIndirect glad_glDispatchComputeIndirect
+#define glCopyImageSubData glad_glCopyImageSubData
+
+bool GlVersionAtLeast(int major, int minor)
+{
+    return GLVersion.major > major || (GLVersion.major == major && GLVersion.minor >= minor);
+}
+
+bool HasGlExtension(const char* name)
+{
+    int numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for(int i = 0; i < numExtensions; ++i)
+    {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if(ext && strcmp(ext, name) == 0)
+            return true;
+    }
+    
+    return false;
+}
+
+// Call after the glad loader, with the same function
+void LoadGlExtensions(GLADloadproc load)
+{
+    if(GlVersionAtLeast(4, 1) || HasGlExtension("GL_ARB_get_program_binary"))
+    {
+        glGetProgramBinary  = (PFNGLGETPROGRAMBINARYPROC)load("glGetProgramBinary");
+        glProgramBinary     = (PFNGLPROGRAMBINARYPROC)load("glProgramBinary");
+        glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)load("glProgramParameteri");
+    }
+    
+    if(GlVersionAtLeast(4, 2) || HasGlExtension("GL_ARB_shader_image_load_store"))
+    {
+        glMemoryBarrier    = (PFNGLMEMORYBARRIERPROC)load("glMemoryBarrier");
+        glBindImageTexture = (PFNGLBINDIMAGETEXTUREPROC)load("glBindImageTexture");
+    }
+
+    if(GlVersionAtLeast(4, 3))
+    {
+        glDispatchCompute         = (PFNGLDISPATCHCOMPUTEPROC)load("glDispatchCompute");
+        glDispatchComputeIndirect = (PFNGLDISPATCHCOMPUTEINDIRECTPROC)load("glDispatchComputeIndirect");
+    }
+    
+    if(GlVersionAtLeast(4, 3) || HasGlExtension("GL_ARB_copy_image"))
+        glCopyImageSubData = (PFNGLCOPYIMAGESUBDATAPROC)load("glCopyImageSubData");
+}
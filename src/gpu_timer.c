@@ -0,0 +1,178 @@
+// GPU timings of the render passes, using GL_TIME_ELAPSED queries.
+// Every pass has a ring of query objects used on successive frames. A query is
+// polled every frame until its result is available, and is only reissued once
+// that result was read, so reading the timings never stalls the pipeline and
+// no result is lost to a driver that queues a few frames.
+
+#define GpuTimerWindow 512  // Samples kept for the rolling statistics
+#define GpuTimerSets 4  // Frames whose queries can be in flight at once
+
+enum
+{
+    GpuPass_PathTrace = 0,
+    GpuPass_Reproject,
+    GpuPass_Present,
+    
+    GpuPass_Count
+} typedef GpuPass;
+
+const char* gpuPassNames[GpuPass_Count] = { "pathtrace", "reproject", "present" };
+
+struct
+{
+    uint32_t queries[GpuPass_Count][GpuTimerSets];
+    bool pending[GpuPass_Count][GpuTimerSets];  // Issued, result not read yet
+    uint32_t issueFrame[GpuPass_Count][GpuTimerSets];
+    int cur;  // Query set used by the current frame
+    bool skipped;  // The current pass isn't timed, its query is still pending
+    uint32_t frame;
+    
+    // Ring buffers of the last GpuTimerWindow results, in milliseconds
+    float samples[GpuPass_Count][GpuTimerWindow];
+    int numSamples[GpuPass_Count];
+    int nextSample[GpuPass_Count];
+    uint32_t latestFrame[GpuPass_Count];  // Frame of the newest sample, see GetLatestGpuPassTime
+    
+    FILE* csv;  // Optional, one row per pass and frame
+} typedef GpuTimers;
+
+struct
+{
+    float min, avg, p95, p99;
+    int count;
+} typedef GpuPassStats;
+
+// csvPath can be NULL
+void InitGpuTimers(GpuTimers* timers, const char* csvPath)
+{
+    memset(timers, 0, sizeof(GpuTimers));
+    glGenQueries(GpuPass_Count * GpuTimerSets, &timers->queries[0][0]);
+    
+    if(csvPath)
+    {
+        timers->csv = fopen(csvPath, "w");
+        if(timers->csv)
+            fprintf(timers->csv, "frame,pass,ms\n");
+        else
+            fprintf(stderr, "Could not open %s for writing\n", csvPath);
+    }
+}
+
+void DestroyGpuTimers(GpuTimers* timers)
+{
+    glDeleteQueries(GpuPass_Count * GpuTimerSets, &timers->queries[0][0]);
+    if(timers->csv) fclose(timers->csv);
+    timers->csv = NULL;
+}
+
+// Passes can't overlap, a pass must be ended before the next one begins.
+// If the GPU is more than GpuTimerSets frames behind, the pass isn't timed
+// this frame, since its query still holds an unread result
+void BeginGpuPass(GpuTimers* timers, GpuPass pass)
+{
+    int cur = timers->cur;
+    timers->skipped = timers->pending[pass][cur];
+    if(timers->skipped) return;
+    
+    glBeginQuery(GL_TIME_ELAPSED, timers->queries[pass][cur]);
+    timers->pending[pass][cur] = true;
+    timers->issueFrame[pass][cur] = timers->frame;
+}
+
+void EndGpuPass(GpuTimers* timers)
+{
+    if(!timers->skipped) glEndQuery(GL_TIME_ELAPSED);
+}
+
+// Collects every result that became available, oldest first, and moves on to
+// the next query set. Results that aren't ready yet are polled again next frame
+void GpuTimersEndFrame(GpuTimers* timers)
+{
+    for(int i = 1; i <= GpuTimerSets; ++i)
+    {
+        int set = (timers->cur + i) % GpuTimerSets;
+        for(int pass = 0; pass < GpuPass_Count; ++pass)
+        {
+            if(!timers->pending[pass][set]) continue;
+            
+            int available = 0;
+            glGetQueryObjectiv(timers->queries[pass][set], GL_QUERY_RESULT_AVAILABLE, &available);
+            if(!available) continue;
+            
+            uint64_t ns = 0;
+            glGetQueryObjectui64v(timers->queries[pass][set], GL_QUERY_RESULT, &ns);
+            timers->pending[pass][set] = false;
+            
+            // The first frame also pays for shader compilation and resource creation
+            uint32_t frame = timers->issueFrame[pass][set];
+            if(frame == 0) continue;
+            
+            float ms = (float)((double)ns * 1e-6);
+            timers->samples[pass][timers->nextSample[pass]] = ms;
+            timers->nextSample[pass] = (timers->nextSample[pass] + 1) % GpuTimerWindow;
+            if(timers->numSamples[pass] < GpuTimerWindow) ++timers->numSamples[pass];
+            timers->latestFrame[pass] = frame;
+            
+            if(timers->csv)
+                fprintf(timers->csv, "%u,%s,%.4f\n", frame, gpuPassNames[pass], ms);
+        }
+    }
+    
+    timers->cur = (timers->cur + 1) % GpuTimerSets;
+    ++timers->frame;
+}
+
+// Newest result of a pass, and the frame it was measured in (counting the calls of
+// GpuTimersEndFrame, starting at 0). Results arrive one to GpuTimerSets frames late,
+// depending on how far the GPU lags behind. Returns false if there's none yet
+bool GetLatestGpuPassTime(GpuTimers* timers, GpuPass pass, uint32_t* frame, float* ms)
+{
+    if(timers->numSamples[pass] == 0) return false;
+    
+    int latest = (timers->nextSample[pass] + GpuTimerWindow - 1) % GpuTimerWindow;
+    *frame = timers->latestFrame[pass];
+    *ms = timers->samples[pass][latest];
+    return true;
+}
+
+int CompareFloats(const void* a, const void* b)
+{
+    float fa = *(const float*)a;
+    float fb = *(const float*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+GpuPassStats GetGpuPassStats(GpuTimers* timers, GpuPass pass)
+{
+    GpuPassStats res = {0};
+    int count = timers->numSamples[pass];
+    if(count == 0) return res;
+    
+    float sorted[GpuTimerWindow];
+    memcpy(sorted, timers->samples[pass], count * sizeof(float));
+    qsort(sorted, count, sizeof(float), CompareFloats);
+    
+    double sum = 0.0;
+    for(int i = 0; i < count; ++i) sum += sorted[i];
+    
+    res.count = count;
+    res.min = sorted[0];
+    res.avg = (float)(sum / count);
+    res.p95 = sorted[(int)((count - 1) * 0.95f)];
+    res.p99 = sorted[(int)((count - 1) * 0.99f)];
+    return res;
+}
+
+void PrintGpuTimerStats(GpuTimers* timers)
+{
+    printf("GPU timings (ms, last %d frames at most):\n", GpuTimerWindow);
+    printf("%12s %7s %9s %9s %9s %9s\n", "pass", "frames", "min", "avg", "p95", "p99");
+    for(int pass = 0; pass < GpuPass_Count; ++pass)
+    {
+        GpuPassStats stats = GetGpuPassStats(timers, pass);
+        if(stats.count == 0) continue;
+        printf("%12s %7d %9.3f %9.3f %9.3f %9.3f\n", gpuPassNames[pass], stats.count, stats.min, stats.avg, stats.p95, stats.p99);
+    }
+    
+    if(timers->csv) fflush(timers->csv);
+}
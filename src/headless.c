@@ -0,0 +1,88 @@
+// Offscreen OpenGL context for headless rendering (no window, no display server).
+// On Linux this is an EGL context on Mesa's surfaceless platform, which also
+// works with llvmpipe. Elsewhere creation fails and the caller is expected to
+// fall back to a hidden GLFW window.
+
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+static EGLDisplay headlessDisplay = EGL_NO_DISPLAY;
+static EGLContext headlessContext = EGL_NO_CONTEXT;
+
+bool CreateHeadlessContext()
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(getPlatformDisplay)
+        headlessDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if(headlessDisplay == EGL_NO_DISPLAY)
+        headlessDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if(headlessDisplay == EGL_NO_DISPLAY || !eglInitialize(headlessDisplay, NULL, NULL))
+        return false;
+    
+    if(!eglBindAPI(EGL_OPENGL_API))
+        return false;
+    
+    EGLint configAttribs[] =
+    {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if(!eglChooseConfig(headlessDisplay, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+        return false;
+    
+    // Same version and profile as the windowed context
+    EGLint contextAttribs[] =
+    {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 0,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    
+    headlessContext = eglCreateContext(headlessDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    if(headlessContext == EGL_NO_CONTEXT)
+        return false;
+    
+    // No surface at all, everything is rendered to framebuffer objects
+    if(!eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, headlessContext))
+    {
+        eglDestroyContext(headlessDisplay, headlessContext);
+        headlessContext = EGL_NO_CONTEXT;
+        return false;
+    }
+    
+    return true;
+}
+
+void* GetHeadlessProcAddress(const char* name)
+{
+    return (void*)eglGetProcAddress(name);
+}
+
+void DestroyHeadlessContext()
+{
+    if(headlessContext != EGL_NO_CONTEXT)
+    {
+        eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(headlessDisplay, headlessContext);
+    }
+    
+    if(headlessDisplay != EGL_NO_DISPLAY)
+        eglTerminate(headlessDisplay);
+    
+    headlessContext = EGL_NO_CONTEXT;
+    headlessDisplay = EGL_NO_DISPLAY;
+}
+
+#else
+
+bool CreateHeadlessContext() { return false; }
+void* GetHeadlessProcAddress(const char* name) { return NULL; }
+void DestroyHeadlessContext() {}
+
+#endif
@@ -0,0 +1,385 @@
+// Host-side image processing, for the textures and environment maps.
+
+/////////////////////////////////
+// Environment map importance sampling
+
+// Luminance weighted by sin(theta), so that sampling texels proportionally to it
+// samples directions proportionally to the radiance
+static float EnvMapTexelWeight(float* pixel, int y, int height)
+{
+    float lum = 0.2126f * pixel[0] + 0.7152f * pixel[1] + 0.0722f * pixel[2];
+    float sinTheta = sinf(Pi * ((float)y + 0.5f) / (float)height);
+    return (Max(lum, 0.0f) + 1e-6f) * sinTheta;
+}
+
+// Builds the tables used to importance sample an equirectangular map (RGB floats).
+// Returns width x (height + 1) floats: row y < height is the normalized CDF of the
+// texels in row y, row 'height' is the CDF of the rows (the marginal) in its first
+// 'height' entries. CDFs are inclusive, the last value of each one is 1.
+float* BuildEnvMapCdf(float* pixels, int width, int height)
+{
+    assert(width >= height);
+    float* res = calloc((size_t)width * (height + 1), sizeof(float));
+    double* rowSums = malloc(height * sizeof(double));
+    
+    for(int y = 0; y < height; ++y)
+    {
+        float* row = res + (size_t)y * width;
+        double sum = 0.0;
+        for(int x = 0; x < width; ++x)
+        {
+            sum += EnvMapTexelWeight(pixels + ((size_t)y * width + x) * 3, y, height);
+            row[x] = (float)sum;
+        }
+        
+        for(int x = 0; x < width; ++x)
+            row[x] = (float)(row[x] / sum);
+        row[width - 1] = 1.0f;
+        
+        rowSums[y] = sum;
+    }
+    
+    float* marginal = res + (size_t)height * width;
+    double total = 0.0;
+    for(int y = 0; y < height; ++y)
+        total += rowSums[y];
+    
+    double sum = 0.0;
+    for(int y = 0; y < height; ++y)
+    {
+        sum += rowSums[y];
+        marginal[y] = (float)(sum / total);
+    }
+    marginal[height - 1] = 1.0f;
+    
+    free(rowSums);
+    return res;
+}
+
+/////////////////////////////////
+// Octahedral environment maps
+
+// The upper hemisphere (y > 0) is the diamond in the middle of the square, the
+// lower one is folded over the corners. Same as OctahedralDir in the shader
+void OctahedralDir(float u, float v, float dir[3])
+{
+    float x = u * 2.0f - 1.0f;
+    float z = v * 2.0f - 1.0f;
+    float y = 1.0f - fabsf(x) - fabsf(z);
+    if(y < 0.0f)
+    {
+        float fx = (1.0f - fabsf(z)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float fz = (1.0f - fabsf(x)) * (z >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        z = fz;
+    }
+    
+    float len = sqrtf(x * x + y * y + z * z);
+    dir[0] = x / len;
+    dir[1] = y / len;
+    dir[2] = z / len;
+}
+
+// Bilinear lookup in an equirectangular map (RGB floats), with the same mapping
+// as the shader's equirectangular lookups
+static void SampleEquirect(float* pixels, int width, int height, float dir[3], float res[3])
+{
+    float u = (atan2f(dir[2], dir[0]) + Pi) / (2.0f * Pi);
+    float v = acosf(Clamp(dir[1], -1.0f, 1.0f)) / Pi;
+    float fx = u * (float)width - 0.5f;
+    float fy = v * (float)height - 0.5f;
+    int x0 = (int)floorf(fx), y0 = (int)floorf(fy);
+    float tx = fx - (float)x0, ty = fy - (float)y0;
+    
+    // Wrap around horizontally, clamp at the poles
+    int x1 = (x0 + 1) % width;
+    x0 = (x0 + width) % width;
+    int y1 = y0 + 1 >= height ? height - 1 : y0 + 1;
+    y0 = y0 < 0 ? 0 : y0;
+    
+    float* p00 = pixels + ((size_t)y0 * width + x0) * 3;
+    float* p10 = pixels + ((size_t)y0 * width + x1) * 3;
+    float* p01 = pixels + ((size_t)y1 * width + x0) * 3;
+    float* p11 = pixels + ((size_t)y1 * width + x1) * 3;
+    for(int c = 0; c < 3; ++c)
+    {
+        float top    = p00[c] + (p10[c] - p00[c]) * tx;
+        float bottom = p01[c] + (p11[c] - p01[c]) * tx;
+        res[c] = top + (bottom - top) * ty;
+    }
+}
+
+// Resamples an equirectangular map (RGB floats) to a size x size octahedral one.
+// Each texel averages a 2x2 grid of lookups, since the equirectangular texels
+// get much smaller than the octahedral ones towards the poles
+#define OctahedralSubsamples 2
+float* EquirectToOctahedral(float* pixels, int width, int height, int size)
+{
+    float* res = malloc((size_t)size * size * 3 * sizeof(float));
+    const float weight = 1.0f / (OctahedralSubsamples * OctahedralSubsamples);
+    for(int y = 0; y < size; ++y)
+    {
+        for(int x = 0; x < size; ++x)
+        {
+            float sum[3] = {0};
+            for(int sy = 0; sy < OctahedralSubsamples; ++sy)
+            {
+                for(int sx = 0; sx < OctahedralSubsamples; ++sx)
+                {
+                    float u = ((float)x + ((float)sx + 0.5f) / OctahedralSubsamples) / (float)size;
+                    float v = ((float)y + ((float)sy + 0.5f) / OctahedralSubsamples) / (float)size;
+                    float dir[3], color[3];
+                    OctahedralDir(u, v, dir);
+                    SampleEquirect(pixels, width, height, dir, color);
+                    for(int c = 0; c < 3; ++c)
+                        sum[c] += color[c];
+                }
+            }
+            
+            float* texel = res + ((size_t)y * size + x) * 3;
+            for(int c = 0; c < 3; ++c)
+                texel[c] = sum[c] * weight;
+        }
+    }
+    
+    return res;
+}
+
+/////////////////////////////////
+// Blue noise
+
+// Energy of every pixel with respect to the set points, the sum of a gaussian
+// of the toroidal distance to each of them. 'size' must be a power of 2
+static void BlueNoiseSplat(float* energy, float* kernel, int size, int idx, float sign)
+{
+    int px = idx % size;
+    int py = idx / size;
+    for(int y = 0; y < size; ++y)
+    {
+        for(int x = 0; x < size; ++x)
+        {
+            int dx = (x - px) & (size - 1);
+            int dy = (y - py) & (size - 1);
+            energy[y * size + x] += sign * kernel[dy * size + dx];
+        }
+    }
+}
+
+// Index of the set (or unset) pixel with the highest (or lowest) energy, which
+// is the tightest cluster (or the largest void)
+static int BlueNoiseFind(float* energy, bool* set, int count, bool wantSet, bool highest)
+{
+    int res = -1;
+    for(int i = 0; i < count; ++i)
+    {
+        if(set[i] != wantSet) continue;
+        if(res == -1 || (highest ? energy[i] > energy[res] : energy[i] < energy[res]))
+            res = i;
+    }
+    
+    return res;
+}
+
+// Tileable blue noise mask built with the void and cluster method (Ulichney 1993).
+// Returns size*size values, each of (i + 0.5) / (size*size) appears exactly once.
+// Deterministic, so both backends and every run get the same mask.
+float* GenerateBlueNoise(int size)
+{
+    assert((size & (size - 1)) == 0);
+    int count = size * size;
+    
+    const float sigma = 1.5f;
+    float* kernel = malloc(count * sizeof(float));
+    for(int y = 0; y < size; ++y)
+    {
+        for(int x = 0; x < size; ++x)
+        {
+            int dx = x < size / 2 ? x : size - x;
+            int dy = y < size / 2 ? y : size - y;
+            kernel[y * size + x] = expf(-(float)(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+        }
+    }
+    
+    float* energy = calloc(count, sizeof(float));
+    bool* set = calloc(count, sizeof(bool));
+    int* ranks = malloc(count * sizeof(int));
+    
+    // Initial binary pattern: a random tenth of the pixels
+    uint32_t rng = 0x9e3779b9u;
+    int numSet = 0;
+    while(numSet < count / 10)
+    {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        int idx = (int)(rng % (uint32_t)count);
+        if(set[idx]) continue;
+        set[idx] = true;
+        BlueNoiseSplat(energy, kernel, size, idx, 1.0f);
+        ++numSet;
+    }
+    
+    // Move points from the tightest cluster to the largest void until it's stable
+    while(true)
+    {
+        int cluster = BlueNoiseFind(energy, set, count, true, true);
+        set[cluster] = false;
+        BlueNoiseSplat(energy, kernel, size, cluster, -1.0f);
+        
+        int hole = BlueNoiseFind(energy, set, count, false, false);
+        set[hole] = true;
+        BlueNoiseSplat(energy, kernel, size, hole, 1.0f);
+        if(hole == cluster) break;
+    }
+    
+    bool* prototype = malloc(count * sizeof(bool));
+    float* prototypeEnergy = malloc(count * sizeof(float));
+    memcpy(prototype, set, count * sizeof(bool));
+    memcpy(prototypeEnergy, energy, count * sizeof(float));
+    
+    // Ranks below the prototype's size: remove the tightest clusters
+    for(int rank = numSet - 1; rank >= 0; --rank)
+    {
+        int cluster = BlueNoiseFind(energy, set, count, true, true);
+        set[cluster] = false;
+        BlueNoiseSplat(energy, kernel, size, cluster, -1.0f);
+        ranks[cluster] = rank;
+    }
+    
+    // Ranks above: fill the largest voids. Past half of the pixels the original
+    // method looks for the tightest cluster of unset pixels, which is the same pixel
+    memcpy(set, prototype, count * sizeof(bool));
+    memcpy(energy, prototypeEnergy, count * sizeof(float));
+    for(int rank = numSet; rank < count; ++rank)
+    {
+        int hole = BlueNoiseFind(energy, set, count, false, false);
+        set[hole] = true;
+        BlueNoiseSplat(energy, kernel, size, hole, 1.0f);
+        ranks[hole] = rank;
+    }
+    
+    float* res = malloc(count * sizeof(float));
+    for(int i = 0; i < count; ++i)
+        res[i] = ((float)ranks[i] + 0.5f) / (float)count;
+    
+    free(kernel);
+    free(energy);
+    free(set);
+    free(ranks);
+    free(prototype);
+    free(prototypeEnergy);
+    return res;
+}
+
+/////////////////////////////////
+// Image output
+
+// Same as the filmic curve + gamma in tex2ScreenShaderSrc
+Vec3 TonemapFilmic(Vec3 c, float exposure)
+{
+    c = Mul(c, powf(2.0f, exposure));
+    float* channels = &c.x;
+    for(int i = 0; i < 3; ++i)
+    {
+        float v = channels[i];
+        v = (0.9f*v*v + 0.02f*v) / (0.87f*v*v + 0.35f*v + 0.14f);
+        channels[i] = powf(v, 1.0f / 2.2f);
+    }
+    return c;
+}
+
+// Pixels are linear RGB floats with the bottom row first, like a texture read back
+// from OpenGL. Tonemaps them and writes a binary PPM.
+bool WritePpm(const char* path, float* pixels, int width, int height, float exposure)
+{
+    FILE* f = fopen(path, "wb");
+    if(!f) return false;
+    
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    unsigned char* row = malloc((size_t)width * 3);
+    for(int y = height - 1; y >= 0; --y)
+    {
+        for(int x = 0; x < width; ++x)
+        {
+            float* p = pixels + ((size_t)y * width + x) * 3;
+            Vec3 c = {p[0], p[1], p[2]};
+            c = TonemapFilmic(c, exposure);
+            row[x*3+0] = (unsigned char)(Clamp(c.x, 0.0f, 1.0f) * 255.0f + 0.5f);
+            row[x*3+1] = (unsigned char)(Clamp(c.y, 0.0f, 1.0f) * 255.0f + 0.5f);
+            row[x*3+2] = (unsigned char)(Clamp(c.z, 0.0f, 1.0f) * 255.0f + 0.5f);
+        }
+        
+        fwrite(row, 1, (size_t)width * 3, f);
+    }
+    
+    free(row);
+    return fclose(f) == 0;
+}
+
+// Writes the untonemapped pixels as a little endian PFM, which
+// also stores the bottom row first
+bool WritePfm(const char* path, float* pixels, int width, int height)
+{
+    FILE* f = fopen(path, "wb");
+    if(!f) return false;
+    
+    fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
+    fwrite(pixels, sizeof(float), (size_t)width * height * 3, f);
+    return fclose(f) == 0;
+}
+
+// Picks the format from the extension: .pfm is HDR, anything else is a tonemapped PPM
+bool WriteImage(const char* path, float* pixels, int width, int height, float exposure)
+{
+    const char* ext = strrchr(path, '.');
+    if(ext && strcmp(ext, ".pfm") == 0)
+        return WritePfm(path, pixels, width, height);
+    
+    return WritePpm(path, pixels, width, height, exposure);
+}
+
+// Reads a PFM written by WritePfm (3 channels, little endian).
+// Returns NULL on failure, the result must be freed by the caller.
+float* ReadPfm(const char* path, int* width, int* height)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f) return NULL;
+    
+    char magic[3] = {0};
+    float scale;
+    int w, h;
+    if(fscanf(f, "%2s %d %d %f", magic, &w, &h, &scale) != 4 || strcmp(magic, "PF") != 0 || scale >= 0.0f || w <= 0 || h <= 0)
+    {
+        fclose(f);
+        return NULL;
+    }
+    
+    fgetc(f);  // Single whitespace character before the data
+    
+    size_t count = (size_t)w * h * 3;
+    float* res = malloc(count * sizeof(float));
+    if(fread(res, sizeof(float), count, f) != count)
+    {
+        free(res);
+        res = NULL;
+    }
+    
+    fclose(f);
+    *width = w;
+    *height = h;
+    return res;
+}
+
+// RMSE between two linear RGB images after tonemapping both, so that a few very
+// bright pixels don't dominate the result
+float TonemappedRmse(float* a, float* b, int numPixels)
+{
+    double sqErr = 0.0;
+    for(int i = 0; i < numPixels; ++i)
+    {
+        Vec3 colorA = {a[i*3+0], a[i*3+1], a[i*3+2]};
+        Vec3 colorB = {b[i*3+0], b[i*3+1], b[i*3+2]};
+        Vec3 diff = Sub(TonemapFilmic(colorA, 0.0f), TonemapFilmic(colorB, 0.0f));
+        sqErr += Dot(diff, diff) / 3.0f;
+    }
+    
+    return (float)sqrt(sqErr / numPixels);
+}
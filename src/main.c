@@ -3,14 +3,19 @@
 #include "stdbool.h"
 #include "stdio.h"
 #include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
 #include "math.h"
+#include "float.h"
 
 // Unity build
 #include "glad.c"
+#include "gl_ext.c"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "GLFW/glfw3.h"
 
+#define Pi 3.1415926f
 #define Deg2Rad 0.017453292
 #define ArrayCount(array) sizeof(array) / sizeof(array[0])
 
@@ -29,6 +34,8 @@ float fullScreenQuad[] =
     1.0f,  -1.0f, 0.0f, 1.0f, 0.0f
 };
 
+const int fullScreenQuadVertCount = sizeof(fullScreenQuad) / (sizeof(float) * 5);
+
 char* vertexShaderSrc = "#version 400 core\n"
 "layout(location = 0) in vec3 pos;\n"
 "layout(location = 1) in vec2 inTexCoords;\n"
@@ -39,27 +46,72 @@ char* vertexShaderSrc = "#version 400 core\n"
 "texCoords = inTexCoords;\n"
 "}\n";
 
-// Includes tonemapping to LDR
+// Includes tonemapping to LDR. The alpha of the accumulation is the number of
+// samples it sums (1 if it already holds the average). With dynamic resolution
+// only the renderSize corner of the accumulation is used, and it's upscaled
+// bilinearly in display space, except that taps that differ from the nearest one
+// get less weight, so that edges stay sharp instead of being smeared.
+// At native resolution, every pixel reads exactly its own texel
 char* tex2ScreenShaderSrc = "#version 400 core\n"
 "in vec2 texCoords;\n"
 "out vec4 fragColor;\n"
 "uniform sampler2D tex;\n"
+"uniform sampler2D moments;\n"
+"uniform vec2 renderSize;\n"
 "uniform float exposure;\n"
+"uniform bool showConvergence;\n"
+"uniform float convergenceThreshold;\n"
+"const float edgeSharpness = 8.0f;\n"  // Per unit of display luminance
 "vec3 filmic(vec3 c)\n"
 "{\n"
 "return (0.9f*c*c + 0.02*c)/(0.87f*c*c + 0.35f * c + 0.14f);\n"
 "}\n"
-"void main()\n"
+"vec3 displayColor(ivec2 pixel)\n"
 "{\n"
-"vec3 color = vec3(texture(tex, texCoords));\n"
+"vec4 accum = texelFetch(tex, clamp(pixel, ivec2(0), ivec2(renderSize) - 1), 0);\n"
+"vec3 color = accum.rgb / max(accum.a, 1.0f);\n"  // Sums with image accumulation, see ResizeFramebuffers
 "color = filmic(pow(2.0f, exposure)*color);\n"
-"color.x = pow(color.x, 1.0f/2.2f);\n"
-"color.y = pow(color.y, 1.0f/2.2f);\n"
-"color.z = pow(color.z, 1.0f/2.2f);\n"
+"return pow(color, vec3(1.0f/2.2f));\n"
+"}\n"
+"void main()\n"
+"{\n"
+"vec2 pixel = gl_FragCoord.xy * renderSize / vec2(textureSize(tex, 0)) - 0.5f;\n"
+"ivec2 base = ivec2(floor(pixel));\n"
+"vec2 frac = pixel - vec2(base);\n"
+"ivec2 nearest = base + ivec2(greaterThanEqual(frac, vec2(0.5f)));\n"
+"vec3 nearestColor = displayColor(nearest);\n"
+"float nearestLum = dot(nearestColor, vec3(0.2126f, 0.7152f, 0.0722f));\n"
+"vec3 color = vec3(0.0f);\n"
+"float weightSum = 0.0f;\n"
+"for(int i = 0; i < 4; ++i)\n"
+"{\n"
+"ivec2 offset = ivec2(i & 1, i >> 1);\n"
+"vec2 bilinear = mix(1.0f - frac, frac, vec2(offset));\n"
+"float weight = bilinear.x * bilinear.y;\n"
+"if(weight <= 0.0f) continue;\n"
+"vec3 tap = displayColor(base + offset);\n"
+"weight *= exp(-edgeSharpness * abs(dot(tap, vec3(0.2126f, 0.7152f, 0.0722f)) - nearestLum));\n"
+"color += weight * tap;\n"
+"weightSum += weight;\n"
+"}\n"
+"color /= weightSum;\n"
+"if(showConvergence)\n"
+"{\n"
+"vec4 m = texelFetch(moments, nearest, 0);\n"  // Same as ConvergenceRatio in pathtracer.glsl
+"float ratio = m.w < 2.0f ? 1e6f : sqrt(max(m.y - m.x * m.x, 0.0f) / (m.w - 1.0f)) / convergenceThreshold;\n"
+"vec3 mask = ratio <= 1.0f ? vec3(0.0f, 1.0f, 0.0f) : vec3(min(ratio / 8.0f, 1.0f), 0.0f, 0.0f);\n"
+"color = mix(color, mask, 0.6f);\n"
+"}\n"
 "fragColor = vec4(color, 1.0f);\n"
 "}\n";
 
 char* pathTracerSrcPath = "../../shaders/pathtracer.glsl";
+char* wavefrontSrcPath  = "../../shaders/wavefront.glsl";
+char* reprojectSrcPath  = "../../shaders/reproject.glsl";
+const char* programCachePath = "../../shader_cache/";
+const char* assetCachePath = "../../asset_cache/";
+const char* scenesPath = "../../scenes/";
+const char* benchPath = "../../bench/";
 
 const char* envMaps[] =
 {
@@ -83,32 +135,262 @@ const char* textures[] =
     "../../textures/metal_plate_rough_1k.png",
 };
 
+#define MaxScenes 10
+#define SamplesPerFrame 30  // Of headless and benchmark runs. Interactive ones pick them, see FrameBudgetController
+#define MaxSamplesPerFrame 256  // Keeps single draws far from driver watchdog timeouts
+#define MinInteractiveSamples 8  // While the camera moves, the resolution is lowered rather than going below this
+#define DefaultMinBounces 3   // Russian roulette starts after this many bounces
+#define DefaultMaxBounces 12
+#define AdaptiveMinSamples (16 * SamplesPerFrame)  // Pixels are never considered converged before this
+#define ReprojectMaxSamples (4 * SamplesPerFrame)  // Samples per pixel carried over when the camera moves, at most
+#define DefaultFrameBudgetMs 16.0f  // Path tracing time per frame while the camera moves
+#define DefaultConvergeBudgetMs 32.0f  // And while it's still
+#define MinRenderScale 0.25f  // Of the window size on each axis, with dynamic resolution
+#define RenderScaleStep (1.0f / 16.0f)
+#define DefaultConvergenceThreshold 0.002f  // Standard error of the tonemapped luminance, about half a step of 8 bit color
+#define BlueNoiseSize 64  // Side of the blue noise mask used by the sampler
+#define MaxShaderVariants 16
+#define WavefrontGroupSize 64  // Same as WorkgroupSize in wavefront.glsl
+
+// Texture buffer objects holding a scene's data
+struct
+{
+    uint32_t sphereBuffer, sphereTex;
+    uint32_t quadBuffer, quadTex;
+    uint32_t materialBuffer, materialTex;
+    uint32_t bvhNodeBuffer, bvhNodeTex;
+    uint32_t bvhPrimBuffer, bvhPrimTex;
+    uint32_t lightBuffer, lightTex;
+} typedef SceneBuffers;
+
+// Properties of a scene that the shader is specialized on, see GetSceneVariantKey.
+// Scenes with the same key share a program, so this is compared with memcmp.
+struct
+{
+    int32_t envMap;        // Negative if the scene has no environment
+    uint32_t matTypeMask;  // 1 << matType for every material type in the scene
+    uint32_t hasLights;
+} typedef SceneVariantKey;
+
+// Uniform locations of a program compiled from pathtracer.glsl
+struct
+{
+    uint32_t resolution;
+    uint32_t frameId;
+    uint32_t numSamples;
+    uint32_t accumSamples;
+    uint32_t cameraPos;
+    uint32_t cameraAngle;
+    uint32_t envMaps;
+    uint32_t textures;
+    uint32_t prevFrame;
+    uint32_t accumImage;
+    uint32_t accumMoments;
+    uint32_t sceneSpheres;
+    uint32_t sceneQuads;
+    uint32_t sceneMaterials;
+    uint32_t numSpheres;
+    uint32_t numQuads;
+    uint32_t envMap;
+    uint32_t bvhNodes;
+    uint32_t bvhPrims;
+    uint32_t useBvh;
+    uint32_t sceneLights;
+    uint32_t numLights;
+    uint32_t useNee;
+    uint32_t envCdfs;
+    uint32_t useEnvSampling;
+    uint32_t useRayCones;
+    uint32_t octahedralEnvMaps;
+    uint32_t minBounces;
+    uint32_t maxBounces;
+    uint32_t prevMoments;
+    uint32_t adaptiveSampling;
+    uint32_t convergenceThreshold;
+    uint32_t minAdaptiveSamples;
+    uint32_t samplerType;
+    uint32_t blueNoise;
+    uint32_t envMapLayer;
+    uint32_t textureLayers;
+} typedef PathTracerUniforms;
+
+// A program compiled from pathtracer.glsl for scenes with the given key
+struct
+{
+    SceneVariantKey key;
+    uint32_t program;
+    PathTracerUniforms uniforms;
+} typedef ShaderVariant;
+
+// Kernels of the wavefront path tracer, see shaders/wavefront.glsl
+enum
+{
+    WfKernel_Prepare = 0,
+    WfKernel_Generate,
+    WfKernel_Extend,
+    WfKernel_ShadeMatte,
+    WfKernel_ShadeReflective,
+    WfKernel_ShadeGlossy,
+    WfKernel_ShadeTransparent,
+    WfKernel_Accumulate,
+    
+    WfKernel_Count
+} typedef WfKernel;
+
+// Same values and layouts as in wavefront.glsl
+#define WfNumMatTypes 4
+#define WfQueue_Extend0    0
+#define WfQueue_FirstShade 2
+#define WfQueue_Count      6
+#define WfPrepare_Reset  0
+#define WfPrepare_Extend 1
+#define WfPrepare_Shade  2
+#define WfPathStateSize (6 * 4 * sizeof(float))
+#define WfHitRecordSize (6 * 4 * sizeof(float))
+#define WfQueueCountBufferSize (8 * sizeof(uint32_t) + WfQueue_Count * 3 * sizeof(uint32_t))
+#define WfDispatchArgsOffset(queue) (8 * sizeof(uint32_t) + (queue) * 3 * sizeof(uint32_t))
+
+struct
+{
+    uint32_t kernels[WfKernel_Count];
+    PathTracerUniforms uniforms[WfKernel_Count];
+    uint32_t waveIndex[WfKernel_Count];
+    uint32_t extendQueue[WfKernel_Count];
+    uint32_t prepareStage;
+    
+    // Sized for one path per pixel
+    int numPixels;
+    uint32_t pathBuffer;
+    uint32_t hitBuffer;
+    uint32_t queueBuffer;
+    uint32_t queueCountBuffer;  // Queue sizes and indirect dispatch arguments
+    uint32_t radianceBuffer;
+} typedef WavefrontState;
+
+// Warps the accumulation into the new view when the camera moves, see reproject.glsl
 struct
 {
     uint32_t program;
+    PathTracerUniforms uniforms;
+    uint32_t previousPrimaryHits;
+    uint32_t previousCameraPos;
+    uint32_t previousCameraAngle;
+    uint32_t previousResolution;
+    uint32_t reprojectHistory;
+    uint32_t maxHistorySamples;
+    uint32_t accumulateSums;
+    
+    uint32_t fbo;  // The attachments are set by every pass, since the targets are swapped
+    uint32_t primaryHitTex[2];  // Normals and view depths of the primary hits, [0] for the current view
+    int hitsWidth, hitsHeight;  // Resolution of primaryHitTex[0], see the dynamic resolution in main
+    uint32_t targetTex, targetMoments;  // Only with image accumulation while the camera moves, see ReleaseReprojectTargets
+    int targetWidth, targetHeight;  // Size of the framebuffers
+} typedef ReprojectState;
+
+// What a frame traced, to normalize its cost once it's measured
+struct
+{
+    float scale;
+    uint32_t samples;
+    bool firstFrames;  // No pixel could be converged yet, see FrameBudgetController
+} typedef FrameRecord;
+
+// Picks the samples per pixel and the resolution of the next frames, so that path tracing
+// takes about as long as the budget, from the measured cost of the previous frames.
+// Costs are assumed to be proportional to the number of samples and pixels. With
+// adaptive sampling, converged pixels are skipped, so the later frames of an
+// accumulation get cheaper; the first ones are tracked separately, since they're
+// what every restart costs
+struct
+{
+    float firstFramesMsPerSample;  // Per sample per pixel at native resolution, 0 until measured
+    float msPerSample;  // Same, for the current accumulation
+    uint32_t accumStartFrame;
+    
+    FrameRecord frames[4];  // The last ones, since GPU timings arrive late
+    uint32_t newestFrame;
+    uint32_t lastMeasuredFrame;
+    bool measured;
+} typedef FrameBudgetController;
+
+// GPU formats of the images, see texture_formats.c
+enum
+{
+    ImageFormat_Rgb32f = 0,
+    ImageFormat_Rgb16f,
+    ImageFormat_Rgb9e5,
+    ImageFormat_Bc6h,
+    ImageFormat_Rgba8,
+    ImageFormat_Bc7,
+    ImageFormat_R32f,  // Only for the env map importance sampling tables
+    
+    ImageFormat_Count
+} typedef ImageFormat;
+
+// Texture array layers holding the images of envMaps[] or textures[] that are
+// currently resident, see MakeSceneResident
+#define MaxImageSlots 16
+struct
+{
+    ImageFormat format;
+    int width, height;  // Of the images, which all have full mip chains
+    int numImages;
+    int firstImage;  // Index of the first image for DecodeImage
+    int maxLayers;   // Images that can ever be resident
+    size_t layerSize;  // Bytes of one layer, summed over the arrays that share the slots
+    
+    int numLayers;  // Allocated in the texture arrays
+    int layerOf[MaxImageSlots];  // Per image, -1 if it isn't resident
+    int imageIn[MaxImageSlots];  // Per layer, -1 if it's free
+    uint32_t lastUse[MaxImageSlots];  // Per layer, see RenderState.residencyClock
+} typedef ImageSlots;
+
+struct
+{
+    // Path tracing programs, compiled on demand for each SceneVariantKey
+    ShaderVariant variants[MaxShaderVariants];
+    int numVariants;
+    ShaderVariant generic;  // Not specialized, used if a variant can't be compiled
+    
     uint32_t tex2ScreenProgram;  // For rendering a texture to the screen
     uint32_t vao;
     
-    // For progressive rendering
+    // For progressive rendering. With image accumulation both indices are
+    // the same buffers, which are updated in place (see ResizeFramebuffers)
     uint32_t pingPongFbo[2];
     uint32_t pingPongTex[2];
+    uint32_t pingPongMoments[2];  // Per pixel luminance moments and sample count, for adaptive sampling
     
     // Uniforms
-    uint32_t resolution;
-    uint32_t frameId;
     uint32_t accumulate;
-    uint32_t frameAccum;
-    uint32_t cameraPos;
-    uint32_t cameraAngle;
     uint32_t exposure;
-    uint32_t scene;
-    uint32_t envMaps;
-    uint32_t textures;
-    uint32_t prevFrame;
+    uint32_t presentMoments;
+    uint32_t showConvergence;
+    uint32_t presentRenderSize;
+    uint32_t presentThreshold;
+    
+    // Settings
+    bool disableBvh;  // Brute force intersection, only for benchmarking
+    bool useWavefront;  // Compute kernels instead of the fragment shader, needs GL 4.3
+    bool imageAccumulation;  // Sum the frames in place with image load/store, needs GL 4.2 or ARB_shader_image_load_store
+    bool useReprojection;  // Keep the accumulation when the camera moves, instead of restarting it
+    
+    WavefrontState wavefront;
+    ReprojectState reproject;
     
     // Textures
     uint32_t envMapArray;
+    uint32_t envCdfArray;  // Importance sampling tables, see BuildEnvMapCdf
     uint32_t textureArray;
+    bool octahedralEnvMaps;  // Layout of envMapArray, see EquirectToOctahedral
+    uint32_t blueNoiseTex;
+    ImageSlots envSlots;  // Layers of envMapArray and envCdfArray
+    ImageSlots texSlots;  // Layers of textureArray
+    uint32_t residencyClock;  // Incremented by every MakeSceneResident call
+    size_t textureBudget;  // Bytes of the texture arrays, 0 for no limit
+    
+    // Scenes
+    SceneBuffers sceneBuffers[MaxScenes];
 } typedef RenderState;
 
 struct
@@ -117,7 +399,10 @@ struct
 } typedef Vec3;
 
 Vec3 Sum(Vec3 a, Vec3 b)  { Vec3 res; res.x = a.x+b.x; res.y = a.y+b.y; res.z = a.z+b.z; return res; }
+Vec3 Sub(Vec3 a, Vec3 b)  { Vec3 res; res.x = a.x-b.x; res.y = a.y-b.y; res.z = a.z-b.z; return res; }
 Vec3 Mul(Vec3 a, float f) { Vec3 res = a; res.x *= f; res.y *= f; res.z *= f; return res; }
+float Dot(Vec3 a, Vec3 b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+Vec3 Normalize(Vec3 a)    { return Mul(a, 1.0f / sqrtf(Dot(a, a))); }
 Vec3 CrossProduct(Vec3 a, Vec3 b)
 {
     Vec3 res;
@@ -132,6 +417,51 @@ struct
     float x, y;
 } typedef Vec2;
 
+// Same values as in the shader
+enum
+{
+    Sampler_Sobol = 0,  // Owen scrambled Sobol with a blue noise rotation per pixel
+    Sampler_Pcg,        // Independent random numbers
+} typedef SamplerType;
+
+// Everything needed to render one path tracing frame, regardless of the backend
+struct
+{
+    int width, height;
+    uint32_t frameId;
+    uint32_t numSamples;    // Paths per pixel traced in this frame
+    uint32_t accumSamples;  // Paths per pixel already in the accumulation buffer
+    Vec3 camPos;
+    Vec2 camRot;
+    uint32_t scene;
+    bool useNee;  // Next event estimation (explicit light sampling)
+    bool useEnvSampling;  // Environment map importance sampling
+    bool useRayCones;  // Texture LODs from ray cones, otherwise textures are sampled at the first level
+    uint32_t minBounces;  // Paths are terminated with russian roulette after this many bounces
+    uint32_t maxBounces;  // and always after this many
+    bool adaptiveSampling;  // Skip pixels whose estimated error is below convergenceThreshold
+    float convergenceThreshold;
+    SamplerType sampler;
+} typedef FrameParams;
+
+// Unity build (renderer modules)
+#include "os.c"
+#include "bvh.c"
+#include "scene.c"
+#include "image.c"
+#include "texture_formats.c"
+#include "gpu_timer.c"
+#include "program_cache.c"
+#include "asset_cache.c"
+#include "cpu_pathtracer.c"
+#include "headless.c"
+
+enum
+{
+    Backend_Gpu = 0,
+    Backend_Cpu,
+} typedef Backend;
+
 struct
 {
     Vec2 mouseDelta;
@@ -160,8 +490,9 @@ void MouseButtonCallback(GLFWwindow* window, int button, int action, int mode)
     
 }
 
-// This is global because it's a bit awkward to move outside of this callback
+// These are global because it's a bit awkward to move them outside of the callbacks
 static float exposure = 0.0f;
+static bool showConvergence = false;
 void ScrollCallback(GLFWwindow* window, double xOffset, double yOffset)
 {
     exposure = Max(-10.0f, exposure + yOffset * 0.2f);
@@ -187,6 +518,12 @@ void KeyboardButtonCallback(GLFWwindow* window, int key, int scancode, int actio
     switch(key)
     {
         default: break;
+        case GLFW_KEY_C:
+        {
+            if(action == GLFW_PRESS)
+                showConvergence = !showConvergence;
+            break;
+        }
         case GLFW_KEY_W:
         {
             if(action == GLFW_PRESS)
@@ -238,58 +575,256 @@ void KeyboardButtonCallback(GLFWwindow* window, int key, int scancode, int actio
     }
 }
 
+// Command line options
+struct
+{
+    Backend backend;
+    bool parityCheck;  // Compare the CPU and GPU backends on the built-in scenes, then exit
+    bool benchBvh;  // Measure frame times on generated scenes of increasing size, then exit
+    bool bench;  // Render the built-in scenes from fixed poses, report timings and exit
+    bool benchUpdateReference;  // Render the reference images used by --bench instead
+    int benchFrames;
+    const char* benchJsonPath;  // NULL to print the JSON report to stdout
+    bool gpuTimers;  // Periodically print the GPU time of every pass
+    const char* gpuTimersCsvPath;
+    const char* sceneFile;  // Loaded as scene 0
+    bool disableNee;
+    bool disableEnvSampling;
+    bool disableRayCones;
+    int minBounces, maxBounces;
+    bool disableAdaptive;
+    float convergenceThreshold;
+    SamplerType sampler;
+    bool wavefront;  // Compute kernels instead of the fragment shader, if GL 4.3 is available
+    bool disableImageAccumulation;  // Keep blending into ping pong buffers even if image load/store is available
+    bool disableReprojection;  // Restart the accumulation whenever the camera moves
+    bool disableDynamicResolution;  // Always path trace at native resolution
+    float frameBudgetMs;  // Path tracing time per frame while the camera moves
+    float convergeBudgetMs;  // And while it's still, so that the image converges
+    bool disableProgramCache;
+    bool disableAssetCache;
+    bool buildAssetCache;  // Decode all images into the asset cache, then exit
+    int textureBudgetMb;  // 0 for no limit
+    ImageFormat envFormat;
+    ImageFormat texFormat;
+    bool equirectEnvMaps;  // Sample the env maps in their source layout instead of the octahedral one
+    
+    // Headless rendering: render 'spp' samples of a scene offscreen, write it to 'outPath' and exit
+    bool headless;
+    int scene;  // -1 for the default scene
+    int width, height;
+    int spp;
+    const char* outPath;
+} typedef Options;
+
+Options ParseCommandLine(int argc, char** argv);
+
 RenderState InitRendering();
+PathTracerUniforms GetPathTracerUniforms(uint32_t program);
+ShaderVariant* GetSceneVariant(RenderState* state, uint32_t sceneIdx);
+uint32_t LinkFullScreenProgram(const char** fragSources, int numSources);
+uint32_t CompilePathTracerProgram(const char* defines, bool imageAccumulation);
+uint32_t CompileSceneVariant(SceneVariantKey key, bool imageAccumulation);
+bool ReloadShaders(RenderState* state);
+void InitWavefront(RenderState* state);
+bool CompileWavefrontKernels(uint32_t kernels[WfKernel_Count], bool imageAccumulation);
+void GetWavefrontKernelUniforms(WavefrontState* wf, WfKernel kernel);
+void InitReprojection(RenderState* state);
+uint32_t CompileReprojectProgram();
+void SetReprojectProgram(ReprojectState* rp, uint32_t program);
+void ReleaseReprojectTargets(RenderState* state);
 void ResizeFramebuffers(RenderState* state, int width, int height);
-void UploadImages(RenderState* state);
+void InitImages(RenderState* state, CpuRenderer* cpu, size_t textureBudget, ImageFormat envFormat, ImageFormat texFormat, bool octahedralEnvMaps);
+int BuildAssetCache(ImageFormat envFormat, ImageFormat texFormat, bool octahedralEnvMaps);
+void MakeSceneResident(RenderState* state, uint32_t sceneIdx);
+void UploadAllScenes(RenderState* state);
+void RenderPathTracerGpu(RenderState* state, FrameParams* params);
+void RenderPathTracerWavefront(RenderState* state, FrameParams* params);
+void ReprojectAccumulation(RenderState* state, FrameParams* params, bool reprojectHistory, Vec3 prevCamPos, Vec2 prevCamRot);
+void StartAccumulation(FrameBudgetController* c, uint32_t frame);
+void RecordFrame(FrameBudgetController* c, uint32_t frame, FrameRecord record);
+void AddFrameCost(FrameBudgetController* c, uint32_t frame, float ms);
+uint32_t PickSamplesPerFrame(FrameBudgetController* c, float scale, bool firstFrames, float budgetMs);
+float PickRenderScale(FrameBudgetController* c, float curScale, float budgetMs);
+void UploadCpuFrame(RenderState* state, CpuRenderer* cpu);
+void SwapPingPongBuffers(RenderState* state);
+void ReadAccumulation(RenderState* state, float* rgb, int width, int height);
+int RunParityCheck(RenderState* state, CpuRenderer* cpu);
+int RunBvhBenchmark(RenderState* state);
+int RunHeadless(RenderState* state, CpuRenderer* cpu, Options* options);
+int RunBenchmark(RenderState* state, CpuRenderer* cpu, Options* options);
+void DestroyContext(GLFWwindow* window);
 
 void FirstPersonCamera(Vec3* camPos, Vec2* camRot, float deltaTime);
 
 char* LoadEntireFile(const char* fileName);
 
-int main()
+int main(int argc, char** argv)
 {
-    glfwSetErrorCallback(ErrorCallback);
+    Options options = ParseCommandLine(argc, argv);
+    double startupStart = GetTimeSeconds();
+    
+    InitAssetCache(assetCachePath, !options.disableAssetCache || options.buildAssetCache);
+    if(options.buildAssetCache)
+        return BuildAssetCache(options.envFormat, options.texFormat, !options.equirectEnvMaps);
+    
+    // Headless runs try to get a context without any window system first,
+    // and fall back to a hidden window if that's not possible
+    GLFWwindow* window = NULL;
+    if(options.headless && CreateHeadlessContext())
+    {
+        gladLoadGLLoader((GLADloadproc)GetHeadlessProcAddress);
+        LoadGlExtensions((GLADloadproc)GetHeadlessProcAddress);
+    }
+    else
+    {
+        glfwSetErrorCallback(ErrorCallback);
+        
+        bool ok = glfwInit();
+        assert(ok);
+        
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);  // Required on macOS, apparently
+        glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+        if(options.headless) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        
+        window = glfwCreateWindow(1200, 1000, "Simple Raytracer", NULL, NULL);
+        assert(window);
+        
+        // Input callbacks
+        glfwSetMouseButtonCallback(window, MouseButtonCallback);
+        glfwSetKeyCallback(window, KeyboardButtonCallback);
+        glfwSetScrollCallback(window, ScrollCallback);
+        
+        glfwMakeContextCurrent(window);
+        gladLoadGL();
+        LoadGlExtensions((GLADloadproc)glfwGetProcAddress);
+        
+        // Headless runs never present, so they're not bound by vsync
+        if(!options.headless)
+            glfwSwapInterval(1);  // Enable vsync to not fry my GPU (comment this line for faster rendering)
+    }
+    
+    if(!options.headless)
+    {
+        // Greetings message
+        printf("Simple Raytracer\n\n");
+        printf("Hold right click to look around...\n");
+        printf("While holding right click, press WASD to move horizontally...\n");
+        printf("While holding right click, press Q/E to move down/up...\n");
+        printf("Scroll up/down to adjust exposure...\n");
+        printf("Press C to show which pixels have converged (green) and which are still sampled (red)...\n");
+        printf("Press 1/2/3/4 to change the current scene (0 for the --scene-file scene)...\n");
+        printf("Save shaders/pathtracer.glsl to recompile it without restarting...\n");
+        printf("It would be best (for your poor GPU) to resize the window to a small resolution ;)\n");
+    }
     
-    bool ok = glfwInit();
-    assert(ok);
+    LoadAllScenes();
+    if(options.sceneFile && !LoadScene(options.sceneFile, &scenes[0]))
+        fprintf(stderr, "Could not load scene file %s\n", options.sceneFile);
+    
+    InitProgramCache(programCachePath, !options.disableProgramCache);
+    RenderState renderState = InitRendering();
     
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);  // Required on macOS, apparently
-    glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+    // Image load/store is core since GL 4.2
+    if(!options.disableImageAccumulation)
+        renderState.imageAccumulation = GlVersionAtLeast(4, 2) || HasGlExtension("GL_ARB_shader_image_load_store");
     
-    GLFWwindow* window = glfwCreateWindow(1200, 1000, "Simple Raytracer", NULL, NULL);
-    assert(window);
+    if(options.wavefront)
+    {
+        if(GlVersionAtLeast(4, 3))
+            InitWavefront(&renderState);
+        else
+            fprintf(stderr, "Wavefront path tracing needs OpenGL 4.3 (got %d.%d), using the fragment shader\n", GLVersion.major, GLVersion.minor);
+    }
     
-    // Input callbacks
-    glfwSetMouseButtonCallback(window, MouseButtonCallback);
-    glfwSetKeyCallback(window, KeyboardButtonCallback);
-    glfwSetScrollCallback(window, ScrollCallback);
+    UploadAllScenes(&renderState);
+    PrintProgramCacheStats();
     
-    glfwMakeContextCurrent(window);
-    gladLoadGL();
-    glfwSwapInterval(1);  // Enable vsync to not fry my GPU (comment this line for faster rendering)
+    // The CPU renderer is only created if needed, it keeps
+    // a copy of the resident images in memory
+    static CpuRenderer cpuRenderer = {0};
+    bool useCpu = options.backend == Backend_Cpu || options.parityCheck || options.bench;
+    if(useCpu) InitCpuRenderer(&cpuRenderer);
+    // BPTC is core since GL 4.2
+    if(options.texFormat == ImageFormat_Bc7 && !GlVersionAtLeast(4, 2) && !HasGlExtension("GL_ARB_texture_compression_bptc"))
+    {
+        fprintf(stderr, "BPTC texture compression is not supported, using rgb9e5 env maps and uncompressed textures\n");
+        options.envFormat = ImageFormat_Rgb9e5;
+        options.texFormat = ImageFormat_Rgba8;
+    }
     
-    // Greetings message
-    printf("Simple Raytracer\n\n");
-    printf("Hold right click to look around...\n");
-    printf("While holding right click, press WASD to move horizontally...\n");
-    printf("While holding right click, press Q/E to move down/up...\n");
-    printf("Scroll up/down to adjust exposure...\n");
-    printf("Press 1/2/3/4/5 to change the current scene...\n");
-    printf("It would be best (for your poor GPU) to resize the window to a small resolution ;)\n");
+    InitImages(&renderState, useCpu ? &cpuRenderer : NULL, (size_t)options.textureBudgetMb * 1024 * 1024,
+               options.envFormat, options.texFormat, !options.equirectEnvMaps);
+    printf("Startup took %.2fs\n", GetTimeSeconds() - startupStart);
     
-    RenderState renderState = InitRendering();
+    if(options.parityCheck)
+    {
+        int res = RunParityCheck(&renderState, &cpuRenderer);
+        DestroyContext(window);
+        return res;
+    }
+    
+    if(options.benchBvh)
+    {
+        int res = RunBvhBenchmark(&renderState);
+        DestroyContext(window);
+        return res;
+    }
+    
+    if(options.bench)
+    {
+        int res = RunBenchmark(&renderState, &cpuRenderer, &options);
+        DestroyContext(window);
+        return res;
+    }
+    
+    if(options.headless)
+    {
+        int res = RunHeadless(&renderState, &cpuRenderer, &options);
+        DestroyContext(window);
+        return res;
+    }
+    
+    // The CPU backend accumulates in its own buffer, so it always restarts
+    if(!options.disableReprojection && options.backend != Backend_Cpu)
+        InitReprojection(&renderState);
+    
+    // Converged pixels are skipped with adaptive sampling, so the rest of them
+    // can keep accumulating for longer
+    const uint32_t maxAccumSamples = (options.disableAdaptive ? 500 : 2000) * SamplesPerFrame;
+    const double gpuTimerPrintInterval = 2.0;  // Seconds
+    
+    // Samples per frame and dynamic resolution are picked from the path tracing time of the
+    // previous frames. The CPU backend is measured directly
+    bool dynamicResolution = !options.disableDynamicResolution;
+    FrameBudgetController frameBudget = {0};
+    
+    // The queries are cheap, so they're only skipped if nobody will look at the results
+    bool useGpuTimers = options.gpuTimers || options.gpuTimersCsvPath || options.backend != Backend_Cpu;
+    GpuTimers gpuTimers = {0};
+    if(useGpuTimers) InitGpuTimers(&gpuTimers, options.gpuTimersCsvPath);
+    double lastGpuTimerPrint = glfwGetTime();
     
-    const uint32_t maxNumAccum = 500;
+    // Shaders are recompiled when their source changes, without reloading anything else
+    FileWatch shaderWatches[3];
+    int numShaderWatches = 0;
+    if(InitFileWatch(&shaderWatches[numShaderWatches], pathTracerSrcPath)) ++numShaderWatches;
+    if(renderState.useWavefront && InitFileWatch(&shaderWatches[numShaderWatches], wavefrontSrcPath)) ++numShaderWatches;
+    if(renderState.useReprojection && InitFileWatch(&shaderWatches[numShaderWatches], reprojectSrcPath)) ++numShaderWatches;
     
     // Initialize state
     uint32_t frameCount = 0;
-    uint32_t frameAccum = 0; // Frame counter from start of accumulation
+    uint32_t accumSamples = 0;  // Samples per pixel since the start of accumulation, at most
+    uint32_t carriedSamples = 0;  // Of those, reprojected at the start
+    float renderScale = 1.0f;  // Of the path traced image, on each axis
     Vec3 camPos = {0.0f, 0.0f, -10.0f};
     Vec2 camRot = {0};
-    uint32_t scene = 1;
+    Vec3 prevCamPos = camPos;
+    Vec2 prevCamRot = camRot;
+    uint32_t scene = options.scene >= 0 ? options.scene : (options.sceneFile ? 0 : 1);
     
     int prevWidth  = 0;
     int prevHeight = 0;
@@ -326,21 +861,21 @@ int main()
         }
         
         // Update state
+        bool changedState = changedSize;
+        bool changedView = false;  // Only the camera changed, so the accumulation can be reprojected
         {
-            bool changedState = changedSize;
-            
             if(input.rightClick)
                 glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
             else
                 glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
             
-            changedState |= input.rightClick;
+            changedView |= input.rightClick;
             
             Vec3 oldCamPos = camPos;
             Vec2 oldCamRot = camRot;
             FirstPersonCamera(&camPos, &camRot, deltaTime);
-            changedState |= oldCamPos.x != camPos.x || oldCamPos.y != camPos.y || oldCamPos.z != camPos.z;
-            changedState |= oldCamRot.x != camRot.x || oldCamRot.y != camRot.y;
+            changedView |= oldCamPos.x != camPos.x || oldCamPos.y != camPos.y || oldCamPos.z != camPos.z;
+            changedView |= oldCamRot.x != camRot.x || oldCamRot.y != camRot.y;
             
             int oldScene = scene;
             for(int i = 0; i < 10; ++i)
@@ -354,88 +889,199 @@ int main()
             
             changedState |= oldScene != scene;
             
-            // If the state changed in any way, restart the accumulation
-            if(changedState) frameAccum = 0;
+            bool changedShader = false;
+            for(int i = 0; i < numShaderWatches; ++i)
+                changedShader |= FileWatchChanged(&shaderWatches[i]);
+            
+            if(changedShader)
+            {
+                double reloadStart = GetTimeSeconds();
+                bool reloaded = ReloadShaders(&renderState);
+                if(reloaded)
+                    printf("Reloaded shaders (%.2fs)\n", GetTimeSeconds() - reloadStart);
+                else
+                    fprintf(stderr, "Shader reload failed, keeping the previous shaders\n");
+                changedState |= reloaded;
+            }
+            
+            // While the camera moves, the path tracer renders fewer pixels so that frames
+            // stay within the budget, and it goes back to native resolution once it stops.
+            // The accumulation is reprojected to the new resolution
+            if(dynamicResolution)
+            {
+                float oldScale = renderScale;
+                renderScale = changedView ? PickRenderScale(&frameBudget, renderScale, options.frameBudgetMs) : 1.0f;
+                changedView |= renderScale != oldScale;
+            }
+            
+            // If the state changed in any way, restart the accumulation.
+            // If only the camera did, it restarts from the reprojected one
+            changedView = changedView && !changedState;
+            changedState |= changedView;
+            if(changedState)
+            {
+                accumSamples = 0;
+                carriedSamples = 0;
+                StartAccumulation(&frameBudget, frameCount);
+            }
         }
         
+        bool rendered = accumSamples < maxAccumSamples;
+        
         // Rendering
         {
             // Change framebuffer sizes if needed
             if(changedSize)
                 ResizeFramebuffers(&renderState, width, height);
             
-            glBindFramebuffer(GL_FRAMEBUFFER, renderState.pingPongFbo[1]);
+            // Top left corner of the framebuffers, see tex2ScreenShaderSrc
+            int renderWidth  = (int)Max(1.0f, roundf(width * renderScale));
+            int renderHeight = (int)Max(1.0f, roundf(height * renderScale));
             
             // Render to framebuffer
-            if(frameAccum < maxNumAccum)
+            if(rendered)
             {
-                glViewport(0, 0, width, height);
-                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-                glClear(GL_COLOR_BUFFER_BIT);
-                glUseProgram(renderState.program);
+                FrameParams params = {0};
+                params.width      = renderWidth;
+                params.height     = renderHeight;
+                params.frameId    = frameCount;
+                params.camPos     = camPos;
+                params.camRot     = camRot;
+                params.scene      = scene;
+                params.useNee     = !options.disableNee;
+                params.useEnvSampling = !options.disableEnvSampling;
+                params.useRayCones = !options.disableRayCones;
+                params.minBounces = options.minBounces;
+                params.maxBounces = options.maxBounces;
+                params.adaptiveSampling = !options.disableAdaptive;
+                params.convergenceThreshold = options.convergenceThreshold;
+                params.sampler    = options.sampler;
+                
+                // Image uploads aren't part of the cost of path tracing, see AddFrameCost
+                MakeSceneResident(&renderState, params.scene);
+                
+                // Reprojection also runs on restarts, to store the primary hits of the view
+                bool reproject = changedState && renderState.useReprojection;
+                if(reproject)
+                {
+                    carriedSamples = changedView ? ReprojectMaxSamples : 0;
+                    accumSamples = carriedSamples;
+                }
+                
+                // Frames get the interactive budget while the camera moves
+                FrameRecord record = {0};
+                record.scale = renderScale;
+                record.firstFrames = options.disableAdaptive || accumSamples - carriedSamples < AdaptiveMinSamples;
+                record.samples = PickSamplesPerFrame(&frameBudget, renderScale, record.firstFrames,
+                                                     changedView ? options.frameBudgetMs : options.convergeBudgetMs);
+                if(record.samples > maxAccumSamples - accumSamples) record.samples = maxAccumSamples - accumSamples;
+                RecordFrame(&frameBudget, frameCount, record);
                 
-                // Set uniforms
-                glUniform2f(renderState.resolution, (float)width, (float)height);
-                glUniform1ui(renderState.frameId, frameCount);
-                glUniform1ui(renderState.frameAccum, frameAccum);
-                glUniform3f(renderState.cameraPos, camPos.x, camPos.y, camPos.z);
-                glUniform2f(renderState.cameraAngle, camRot.x, camRot.y);
-                glUniform1ui(renderState.scene, scene);
+                params.numSamples = record.samples;
+                params.accumSamples = accumSamples;
                 
-                // Set textures
-                glUniform1i(renderState.prevFrame, 0);
-                glUniform1i(renderState.envMaps, 1);
-                glUniform1i(renderState.textures, 2);
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, renderState.pingPongTex[0]);
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D_ARRAY, renderState.envMapArray);
-                glActiveTexture(GL_TEXTURE2);
-                glBindTexture(GL_TEXTURE_2D_ARRAY, renderState.textureArray);
+                if(reproject)
+                {
+                    if(useGpuTimers) BeginGpuPass(&gpuTimers, GpuPass_Reproject);
+                    ReprojectAccumulation(&renderState, &params, changedView, prevCamPos, prevCamRot);
+                    if(useGpuTimers) EndGpuPass(&gpuTimers);
+                }
+                else
+                    ReleaseReprojectTargets(&renderState);
+                
+                // Only this pass is measured for the frame budget
+                if(useGpuTimers) BeginGpuPass(&gpuTimers, GpuPass_PathTrace);
+                if(options.backend == Backend_Cpu)
+                {
+                    double cpuStart = GetTimeSeconds();
+                    CpuRenderFrame(&cpuRenderer, &params);
+                    AddFrameCost(&frameBudget, frameCount, (float)((GetTimeSeconds() - cpuStart) * 1000.0));
+                    UploadCpuFrame(&renderState, &cpuRenderer);
+                }
+                else
+                    RenderPathTracerGpu(&renderState, &params);
                 
-                glBindVertexArray(renderState.vao);
-                glDrawArrays(GL_TRIANGLES, 0, sizeof(fullScreenQuad) / (sizeof(float) * 3));
+                if(useGpuTimers) EndGpuPass(&gpuTimers);
+                accumSamples += params.numSamples;
             }
             
             // Render produced image to default framebuffer
+            if(useGpuTimers) BeginGpuPass(&gpuTimers, GpuPass_Present);
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
             glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
             glUseProgram(renderState.tex2ScreenProgram);
             
             glUniform1f(renderState.exposure, exposure);
+            glUniform1i(renderState.presentMoments, 1);
+            glUniform1i(renderState.showConvergence, showConvergence);
+            glUniform2f(renderState.presentRenderSize, (float)renderWidth, (float)renderHeight);
+            glUniform1f(renderState.presentThreshold, options.convergenceThreshold);
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_2D, renderState.pingPongTex[1]);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, renderState.pingPongMoments[1]);
             
             glBindVertexArray(renderState.vao);
-            glDrawArrays(GL_TRIANGLES, 0, sizeof(fullScreenQuad) / (sizeof(float) * 3));
+            glDrawArrays(GL_TRIANGLES, 0, fullScreenQuadVertCount);
+            if(useGpuTimers) EndGpuPass(&gpuTimers);
             
             glfwSwapBuffers(window);
         }
         
-        // Swap framebuffer objects for next frame
-        if(frameAccum < maxNumAccum)
+        if(useGpuTimers)
         {
-            uint32_t tmp = renderState.pingPongFbo[0];
-            renderState.pingPongFbo[0] = renderState.pingPongFbo[1];
-            renderState.pingPongFbo[1] = tmp;
-            tmp = renderState.pingPongTex[0];
-            renderState.pingPongTex[0] = renderState.pingPongTex[1];
-            renderState.pingPongTex[1] = tmp;
+            GpuTimersEndFrame(&gpuTimers);
+            
+            uint32_t measuredFrame;
+            float measuredMs;
+            if(options.backend != Backend_Cpu && GetLatestGpuPassTime(&gpuTimers, GpuPass_PathTrace, &measuredFrame, &measuredMs))
+                AddFrameCost(&frameBudget, measuredFrame, measuredMs);
+            
+            if(options.gpuTimers && curTime - lastGpuTimerPrint >= gpuTimerPrintInterval)
+            {
+                PrintGpuTimerStats(&gpuTimers);
+                lastGpuTimerPrint = curTime;
+            }
         }
         
+        // Swap framebuffer objects for next frame
+        if(rendered)
+            SwapPingPongBuffers(&renderState);
+        
         prevWidth  = width;
         prevHeight = height;
+        prevCamPos = camPos;
+        prevCamRot = camRot;
         ++frameCount;
-        frameAccum = Min(frameAccum + 1, maxNumAccum);
         firstFrame = false;
     }
     
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if(useGpuTimers)
+    {
+        if(options.gpuTimers) PrintGpuTimerStats(&gpuTimers);
+        DestroyGpuTimers(&gpuTimers);
+    }
+    
+    for(int i = 0; i < numShaderWatches; ++i)
+        DestroyFileWatch(&shaderWatches[i]);
+    
+    DestroyContext(window);
     return 0;
 }
 
+// window is NULL if the context was created with CreateHeadlessContext
+void DestroyContext(GLFWwindow* window)
+{
+    if(window)
+    {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+    else
+        DestroyHeadlessContext();
+}
+
 RenderState InitRendering()
 {
     RenderState res = {0};
@@ -469,38 +1115,7 @@ RenderState InitRendering()
         fprintf(stderr, "Vertex shader compilation failed: %s\n", infoLog);
     }
     
-    char* fragSrc = LoadEntireFile(pathTracerSrcPath);
-    uint32_t fragShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragShader, 1, &fragSrc, NULL);
-    glCompileShader(fragShader);
-    glGetShaderiv(fragShader, GL_COMPILE_STATUS, &success);
-    if(!success)
-    {
-        glGetShaderInfoLog(fragShader, 512, NULL, infoLog);
-        fprintf(stderr, "Fragment shader compilation failed: %s\n", infoLog);
-    }
-    
-    res.program = glCreateProgram();
-    glAttachShader(res.program, vertShader);
-    glAttachShader(res.program, fragShader);
-    glLinkProgram(res.program);
-    glGetProgramiv(res.program, GL_LINK_STATUS, &success);
-    if(!success)
-    {
-        glGetProgramInfoLog(res.program, 512, NULL, infoLog);
-        fprintf(stderr, "Shader program linking failed: %s\n", infoLog);
-    }
-    
-    // Setup uniforms
-    res.resolution  = glGetUniformLocation(res.program, "resolution");
-    res.frameId     = glGetUniformLocation(res.program, "frameId");
-    res.frameAccum  = glGetUniformLocation(res.program, "frameAccum");
-    res.cameraPos   = glGetUniformLocation(res.program, "cameraPos");
-    res.cameraAngle = glGetUniformLocation(res.program, "cameraAngle");
-    res.scene       = glGetUniformLocation(res.program, "scene");
-    res.envMaps     = glGetUniformLocation(res.program, "envMaps");
-    res.textures    = glGetUniformLocation(res.program, "textures");
-    res.prevFrame   = glGetUniformLocation(res.program, "previousFrame");
+    // The path tracing programs are compiled per scene, see GetSceneVariant
     
     // Simple texture to screen shader
     uint32_t tex2Screen = glCreateShader(GL_FRAGMENT_SHADER);
@@ -527,110 +1142,2324 @@ RenderState InitRendering()
     }
     
     res.exposure = glGetUniformLocation(res.tex2ScreenProgram, "exposure");
+    res.presentMoments  = glGetUniformLocation(res.tex2ScreenProgram, "moments");
+    res.showConvergence = glGetUniformLocation(res.tex2ScreenProgram, "showConvergence");
+    res.presentRenderSize = glGetUniformLocation(res.tex2ScreenProgram, "renderSize");
+    res.presentThreshold  = glGetUniformLocation(res.tex2ScreenProgram, "convergenceThreshold");
     
     glDeleteShader(vertShader);
-    glDeleteShader(fragShader);
     glDeleteShader(tex2Screen);
     
-    UploadImages(&res);
     return res;
 }
 
-// This is fine to call even if the framebuffers don't exist
-void ResizeFramebuffers(RenderState* state, int width, int height)
+// Loads pathtracer.glsl for programs that put other sources after it. The version
+// directive has to come first, so the one in the file is commented out, and the
+// programs start with their own (see PathTracerVersionHeader)
+char* LoadPathTracerSource()
 {
-    glDeleteTextures(2, state->pingPongTex);
-    glDeleteFramebuffers(2, state->pingPongFbo);
+    char* res = LoadEntireFile(pathTracerSrcPath);
+    char* version = strstr(res, "#version");
+    if(version) memcpy(version, "//", 2);
+    return res;
+}
+
+// Version directive of the fragment shaders made from pathtracer.glsl
+const char* PathTracerVersionHeader(bool imageAccumulation)
+{
+    if(!imageAccumulation) return "#version 400 core\n";
+    return GlVersionAtLeast(4, 2) ? "#version 420 core\n#define IMAGE_ACCUMULATION\n" :
+           "#version 400 core\n#extension GL_ARB_shader_image_load_store : require\n#define IMAGE_ACCUMULATION\n";
+}
+
+// Compiles pathtracer.glsl with the given defines inserted after the version
+// directive, or loads it from the program cache. Returns 0 if it fails.
+uint32_t CompilePathTracerProgram(const char* defines, bool imageAccumulation)
+{
+    char* fragSrc = LoadPathTracerSource();
+    const char* sources[] = { PathTracerVersionHeader(imageAccumulation), defines, fragSrc };
+    
+    uint32_t program = LinkFullScreenProgram(sources, ArrayCount(sources));
+    free(fragSrc);
+    return program;
+}
+
+// Links the fragment shader made of the given sources with the full screen vertex
+// shader, or loads the program from the program cache. Returns 0 if it fails.
+uint32_t LinkFullScreenProgram(const char** fragSources, int numSources)
+{
+    double start = GetTimeSeconds();
     
-    glGenFramebuffers(2, state->pingPongFbo);
-    for(int i = 0; i < 2; ++i)
+    const char* allSources[8] = { vertexShaderSrc };
+    assert(numSources < ArrayCount(allSources));
+    memcpy(allSources + 1, fragSources, numSources * sizeof(char*));
+    uint64_t cacheKey = ProgramCacheKey(allSources, numSources + 1);
+    uint32_t program = LoadCachedProgram(cacheKey);
+    if(program)
     {
-        glBindFramebuffer(GL_FRAMEBUFFER, state->pingPongFbo[i]);
-        uint32_t textureColorBuffer;
-        glGenTextures(1, &textureColorBuffer);
-        glBindTexture(GL_TEXTURE_2D, textureColorBuffer);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorBuffer, 0);
-        
-        state->pingPongTex[i] = textureColorBuffer;
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        ++programCache.numLoaded;
+        programCache.seconds += GetTimeSeconds() - start;
+        return program;
+    }
+    
+    uint32_t vertShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertShader, 1, &vertexShaderSrc, NULL);
+    glCompileShader(vertShader);
+    
+    uint32_t fragShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragShader, numSources, fragSources, NULL);
+    glCompileShader(fragShader);
+    
+    int success;
+    char infoLog[512];
+    glGetShaderiv(fragShader, GL_COMPILE_STATUS, &success);
+    if(!success)
+    {
+        glGetShaderInfoLog(fragShader, 512, NULL, infoLog);
+        fprintf(stderr, "Fragment shader compilation failed: %s\n", infoLog);
     }
     
-    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    program = glCreateProgram();
+    glAttachShader(program, vertShader);
+    glAttachShader(program, fragShader);
+    PrepareProgramForCache(program);
+    glLinkProgram(program);
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+    
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if(!success)
     {
-        fprintf(stderr, "Failed to create frame buffer object\n");
+        glGetProgramInfoLog(program, 512, NULL, infoLog);
+        fprintf(stderr, "Shader program linking failed: %s\n", infoLog);
+        glDeleteProgram(program);
+        return 0;
     }
+    
+    StoreCachedProgram(cacheKey, program);
+    ++programCache.numCompiled;
+    programCache.seconds += GetTimeSeconds() - start;
+    return program;
 }
 
-void UploadImages(RenderState* state)
+// Returns the program specialized for the scene, compiling it if no other scene
+// has needed it yet. Falls back to the generic program if that fails.
+ShaderVariant* GetSceneVariant(RenderState* state, uint32_t sceneIdx)
 {
-    float* loadedEnvMaps[ArrayCount(envMaps)] = {0};
-    stbi_uc* loadedTextures[ArrayCount(textures)] = {0};
+    SceneVariantKey key = GetSceneVariantKey(&scenes[sceneIdx]);
+    for(int i = 0; i < state->numVariants; ++i)
+    {
+        if(memcmp(&state->variants[i].key, &key, sizeof(key)) == 0)
+            return &state->variants[i];
+    }
     
-    const int envMapWidth  = 1024;
-    const int envMapHeight = 512;
-    const int texWidth     = 1024;
-    const int texHeight    = 1024;
+    if(state->numVariants < MaxShaderVariants)
+    {
+        uint32_t program = CompileSceneVariant(key, state->imageAccumulation);
+        if(program)
+        {
+            ShaderVariant* variant = &state->variants[state->numVariants++];
+            variant->key = key;
+            variant->program = program;
+            variant->uniforms = GetPathTracerUniforms(program);
+            return variant;
+        }
+    }
     
-    // Load env maps from disk
-    for(int i = 0; i < ArrayCount(envMaps); ++i)
+    if(!state->generic.program)
     {
-        int width, height, comp;
-        loadedEnvMaps[i] = stbi_loadf(envMaps[i], &width, &height, &comp, 3);
-        assert(loadedEnvMaps[i]);
-        assert(width == envMapWidth);
-        assert(height == envMapHeight);
-        assert(comp == 3);
+        state->generic.program = CompilePathTracerProgram("", state->imageAccumulation);
+        state->generic.uniforms = GetPathTracerUniforms(state->generic.program);
     }
     
-    // Load textures from disk
-    for(int i = 0; i < ArrayCount(textures); ++i)
+    return &state->generic;
+}
+
+uint32_t CompileSceneVariant(SceneVariantKey key, bool imageAccumulation)
+{
+    char defines[512];
+    snprintf(defines, sizeof(defines),
+                 "#define SCENE_VARIANT\n"
+                 "#define SCENE_ENV_MAP %d\n"
+                 "#define SCENE_HAS_MATTE %d\n"
+                 "#define SCENE_HAS_REFLECTIVE %d\n"
+                 "#define SCENE_HAS_GLOSSY %d\n"
+                 "#define SCENE_HAS_TRANSPARENT %d\n"
+                 "#define SCENE_HAS_LIGHTS %d\n",
+                 key.envMap,
+                 (key.matTypeMask >> MatType_Matte) & 1,
+                 (key.matTypeMask >> MatType_Reflective) & 1,
+                 (key.matTypeMask >> MatType_Glossy) & 1,
+                 (key.matTypeMask >> MatType_Transparent) & 1,
+                 key.hasLights);
+    
+    return CompilePathTracerProgram(defines, imageAccumulation);
+}
+
+// Recompiles every path tracing program from the current shader sources. The new
+// programs replace the old ones only if all of them compile, otherwise the old ones
+// are kept. Returns true if they were replaced.
+bool ReloadShaders(RenderState* state)
+{
+    // Also compiled from pathtracer.glsl
+    uint32_t reproject = 0;
+    if(state->useReprojection)
     {
-        int width, height, comp;
-        // Always add the alpha, to test coverage
-        loadedTextures[i] = stbi_load(textures[i], &width, &height, &comp, 4);
-        assert(loadedTextures[i]);
-        assert(width == texWidth);
-        assert(height == texHeight);
+        reproject = CompileReprojectProgram();
+        if(!reproject) return false;
     }
     
-    // Upload env maps to GPU
+    if(state->useWavefront)
     {
-        glGenTextures(1, &state->envMapArray);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, state->envMapArray);
-        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB32F, envMapWidth, envMapHeight, ArrayCount(envMaps), 0, GL_RGB, GL_FLOAT, NULL);
-        
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        WavefrontState* wf = &state->wavefront;
+        uint32_t kernels[WfKernel_Count];
+        if(!CompileWavefrontKernels(kernels, state->imageAccumulation))
+        {
+            glDeleteProgram(reproject);
+            return false;
+        }
         
-        for(int i = 0; i < ArrayCount(envMaps); ++i)
+        for(int i = 0; i < WfKernel_Count; ++i)
         {
-            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, envMapWidth, envMapHeight, 1, GL_RGB, GL_FLOAT, loadedEnvMaps[i]);
-            stbi_image_free(loadedEnvMaps[i]);
+            glDeleteProgram(wf->kernels[i]);
+            wf->kernels[i] = kernels[i];
+            GetWavefrontKernelUniforms(wf, i);
         }
+        
+        if(reproject) SetReprojectProgram(&state->reproject, reproject);
+        return true;
     }
     
-    // Upload textures to GPU
+    uint32_t programs[MaxShaderVariants] = {0};
+    uint32_t generic = 0;
+    bool ok = true;
+    for(int i = 0; ok && i < state->numVariants; ++i)
     {
-        glGenTextures(1, &state->textureArray);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, state->textureArray);
-        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, texWidth, texHeight, ArrayCount(textures), 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        
-        for(int i = 0; i < ArrayCount(textures); ++i)
-        {
-            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, texWidth, texHeight, 1, GL_RGBA, GL_UNSIGNED_BYTE, loadedTextures[i]);
-            stbi_image_free(loadedTextures[i]);
-        }
+        programs[i] = CompileSceneVariant(state->variants[i].key, state->imageAccumulation);
+        ok = programs[i] != 0;
     }
+    
+    if(ok && state->generic.program)
+    {
+        generic = CompilePathTracerProgram("", state->imageAccumulation);
+        ok = generic != 0;
+    }
+    
+    if(!ok)
+    {
+        for(int i = 0; i < state->numVariants; ++i)
+            glDeleteProgram(programs[i]);  // Zero is ignored
+        glDeleteProgram(generic);
+        glDeleteProgram(reproject);
+        return false;
+    }
+    
+    for(int i = 0; i < state->numVariants; ++i)
+    {
+        glDeleteProgram(state->variants[i].program);
+        state->variants[i].program = programs[i];
+        state->variants[i].uniforms = GetPathTracerUniforms(programs[i]);
+    }
+    
+    if(generic)
+    {
+        glDeleteProgram(state->generic.program);
+        state->generic.program = generic;
+        state->generic.uniforms = GetPathTracerUniforms(generic);
+    }
+    
+    if(reproject) SetReprojectProgram(&state->reproject, reproject);
+    return true;
+}
+
+PathTracerUniforms GetPathTracerUniforms(uint32_t program)
+{
+    PathTracerUniforms res = {0};
+    res.resolution  = glGetUniformLocation(program, "resolution");
+    res.frameId     = glGetUniformLocation(program, "frameId");
+    res.numSamples  = glGetUniformLocation(program, "numSamples");
+    res.accumSamples = glGetUniformLocation(program, "accumSamples");
+    res.cameraPos   = glGetUniformLocation(program, "cameraPos");
+    res.cameraAngle = glGetUniformLocation(program, "cameraAngle");
+    res.envMaps     = glGetUniformLocation(program, "envMaps");
+    res.textures    = glGetUniformLocation(program, "textures");
+    res.prevFrame   = glGetUniformLocation(program, "previousFrame");
+    res.accumImage   = glGetUniformLocation(program, "accumImage");
+    res.accumMoments = glGetUniformLocation(program, "accumMoments");
+    res.sceneSpheres   = glGetUniformLocation(program, "sceneSpheres");
+    res.sceneQuads     = glGetUniformLocation(program, "sceneQuads");
+    res.sceneMaterials = glGetUniformLocation(program, "sceneMaterials");
+    res.numSpheres     = glGetUniformLocation(program, "numSpheres");
+    res.numQuads       = glGetUniformLocation(program, "numQuads");
+    res.envMap         = glGetUniformLocation(program, "envMap");
+    res.bvhNodes       = glGetUniformLocation(program, "bvhNodes");
+    res.bvhPrims       = glGetUniformLocation(program, "bvhPrims");
+    res.useBvh         = glGetUniformLocation(program, "useBvh");
+    res.sceneLights    = glGetUniformLocation(program, "sceneLights");
+    res.numLights      = glGetUniformLocation(program, "numLights");
+    res.useNee         = glGetUniformLocation(program, "useNee");
+    res.envCdfs        = glGetUniformLocation(program, "envCdfs");
+    res.useEnvSampling = glGetUniformLocation(program, "useEnvSampling");
+    res.useRayCones    = glGetUniformLocation(program, "useRayCones");
+    res.octahedralEnvMaps = glGetUniformLocation(program, "octahedralEnvMaps");
+    res.minBounces     = glGetUniformLocation(program, "minBounces");
+    res.maxBounces     = glGetUniformLocation(program, "maxBounces");
+    res.prevMoments    = glGetUniformLocation(program, "previousMoments");
+    res.adaptiveSampling     = glGetUniformLocation(program, "adaptiveSampling");
+    res.convergenceThreshold = glGetUniformLocation(program, "convergenceThreshold");
+    res.minAdaptiveSamples   = glGetUniformLocation(program, "minAdaptiveSamples");
+    res.samplerType    = glGetUniformLocation(program, "samplerType");
+    res.blueNoise      = glGetUniformLocation(program, "blueNoise");
+    res.envMapLayer    = glGetUniformLocation(program, "envMapLayer");
+    res.textureLayers  = glGetUniformLocation(program, "textureLayers");
+    return res;
+}
+
+void GetWavefrontKernelUniforms(WavefrontState* wf, WfKernel kernel)
+{
+    wf->uniforms[kernel]    = GetPathTracerUniforms(wf->kernels[kernel]);
+    wf->waveIndex[kernel]   = glGetUniformLocation(wf->kernels[kernel], "waveIndex");
+    wf->extendQueue[kernel] = glGetUniformLocation(wf->kernels[kernel], "extendQueue");
+    if(kernel == WfKernel_Prepare)
+        wf->prepareStage = glGetUniformLocation(wf->kernels[kernel], "prepareStage");
+}
+
+// Compiles every kernel of wavefront.glsl. It's appended to pathtracer.glsl, so
+// the kernels share all of the intersection and shading code with the fragment shader.
+// Returns false (and no programs) if any of them fails.
+bool CompileWavefrontKernels(uint32_t kernels[WfKernel_Count], bool imageAccumulation)
+{
+    const char* kernelDefines[WfKernel_Count] =
+    {
+        "#define KERNEL_PREPARE\n",
+        "#define KERNEL_GENERATE\n",
+        "#define KERNEL_EXTEND\n",
+        "#define KERNEL_SHADE\n#define SHADE_MAT_TYPE MatType_Matte\n",
+        "#define KERNEL_SHADE\n#define SHADE_MAT_TYPE MatType_Reflective\n",
+        "#define KERNEL_SHADE\n#define SHADE_MAT_TYPE MatType_Glossy\n",
+        "#define KERNEL_SHADE\n#define SHADE_MAT_TYPE MatType_Transparent\n",
+        "#define KERNEL_ACCUMULATE\n",
+    };
+    
+    // The kernels need GL 4.3 anyway, so they have their own version directive
+    char* pathTracerSrc = LoadPathTracerSource();
+    char* wavefrontSrc  = LoadEntireFile(wavefrontSrcPath);
+    
+    bool ok = true;
+    for(int i = 0; i < WfKernel_Count; ++i)
+    {
+        const char* sources[] =
+        {
+            "#version 430 core\n#define WAVEFRONT_KERNEL\n",
+            imageAccumulation ? "#define IMAGE_ACCUMULATION\n" : "",
+            kernelDefines[i],
+            pathTracerSrc,
+            wavefrontSrc
+        };
+        
+        double start = GetTimeSeconds();
+        uint64_t cacheKey = ProgramCacheKey(sources, ArrayCount(sources));
+        kernels[i] = LoadCachedProgram(cacheKey);
+        if(kernels[i])
+        {
+            ++programCache.numLoaded;
+            programCache.seconds += GetTimeSeconds() - start;
+            continue;
+        }
+        
+        uint32_t shader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(shader, ArrayCount(sources), sources, NULL);
+        glCompileShader(shader);
+        int success;
+        char infoLog[512];
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+        if(!success)
+        {
+            glGetShaderInfoLog(shader, 512, NULL, infoLog);
+            fprintf(stderr, "Wavefront kernel %d compilation failed: %s\n", i, infoLog);
+            ok = false;
+        }
+        
+        kernels[i] = glCreateProgram();
+        glAttachShader(kernels[i], shader);
+        PrepareProgramForCache(kernels[i]);
+        glLinkProgram(kernels[i]);
+        glGetProgramiv(kernels[i], GL_LINK_STATUS, &success);
+        if(!success)
+        {
+            glGetProgramInfoLog(kernels[i], 512, NULL, infoLog);
+            fprintf(stderr, "Wavefront kernel %d linking failed: %s\n", i, infoLog);
+            ok = false;
+        }
+        else
+            StoreCachedProgram(cacheKey, kernels[i]);
+        
+        glDeleteShader(shader);
+        ++programCache.numCompiled;
+        programCache.seconds += GetTimeSeconds() - start;
+    }
+    
+    free(pathTracerSrc);
+    free(wavefrontSrc);
+    
+    if(!ok)
+    {
+        for(int i = 0; i < WfKernel_Count; ++i)
+            glDeleteProgram(kernels[i]);
+        memset(kernels, 0, WfKernel_Count * sizeof(uint32_t));
+    }
+    
+    return ok;
+}
+
+// If the kernels fail to compile, the fragment shader is used instead
+void InitWavefront(RenderState* state)
+{
+    WavefrontState* wf = &state->wavefront;
+    if(!CompileWavefrontKernels(wf->kernels, state->imageAccumulation))
+    {
+        fprintf(stderr, "Using the fragment shader instead\n");
+        return;
+    }
+    
+    for(int i = 0; i < WfKernel_Count; ++i)
+        GetWavefrontKernelUniforms(wf, i);
+    
+    glGenBuffers(1, &wf->pathBuffer);
+    glGenBuffers(1, &wf->hitBuffer);
+    glGenBuffers(1, &wf->queueBuffer);
+    glGenBuffers(1, &wf->queueCountBuffer);
+    glGenBuffers(1, &wf->radianceBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wf->queueCountBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, WfQueueCountBufferSize, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    
+    state->useWavefront = true;
+}
+
+// If the program fails to compile, the accumulation restarts on every camera move.
+// Call before the framebuffers are created
+void InitReprojection(RenderState* state)
+{
+    ReprojectState* rp = &state->reproject;
+    uint32_t program = CompileReprojectProgram();
+    if(!program)
+    {
+        fprintf(stderr, "Reprojection is disabled\n");
+        return;
+    }
+    
+    SetReprojectProgram(rp, program);
+    glGenFramebuffers(1, &rp->fbo);
+    state->useReprojection = true;
+}
+
+// reproject.glsl is appended to pathtracer.glsl. Returns 0 if it fails
+uint32_t CompileReprojectProgram()
+{
+    // The pass writes render targets even with image accumulation, see ReprojectAccumulation
+    char* pathTracerSrc = LoadPathTracerSource();
+    char* reprojectSrc  = LoadEntireFile(reprojectSrcPath);
+    const char* sources[] = { PathTracerVersionHeader(false), "#define REPROJECTION_PASS\n", pathTracerSrc, reprojectSrc };
+    uint32_t program = LinkFullScreenProgram(sources, ArrayCount(sources));
+    free(pathTracerSrc);
+    free(reprojectSrc);
+    return program;
+}
+
+// Replaces the program (if any) and gets its uniforms
+void SetReprojectProgram(ReprojectState* rp, uint32_t program)
+{
+    glDeleteProgram(rp->program);
+    rp->program = program;
+    rp->uniforms = GetPathTracerUniforms(program);
+    rp->previousPrimaryHits = glGetUniformLocation(program, "previousPrimaryHits");
+    rp->previousCameraPos   = glGetUniformLocation(program, "previousCameraPos");
+    rp->previousCameraAngle = glGetUniformLocation(program, "previousCameraAngle");
+    rp->previousResolution  = glGetUniformLocation(program, "previousResolution");
+    rp->reprojectHistory    = glGetUniformLocation(program, "reprojectHistory");
+    rp->maxHistorySamples   = glGetUniformLocation(program, "maxHistorySamples");
+    rp->accumulateSums      = glGetUniformLocation(program, "accumulateSums");
+}
+
+// Per pixel buffer, without filtering
+uint32_t CreateScreenTexture(uint32_t internalFormat, int width, int height)
+{
+    uint32_t tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return tex;
+}
+
+// This is fine to call even if the framebuffers don't exist. With image accumulation
+// there is a single RGBA32F buffer, which holds the sum of the samples of each pixel
+// and their count (the present pass divides them), and is read and written in place
+// by the path tracer; both ping pong indices refer to it, so swapping does nothing.
+// Otherwise every frame blends the previous average into the other buffer.
+void ResizeFramebuffers(RenderState* state, int width, int height)
+{
+    // With image accumulation both names are the same, deleting it twice is fine
+    glDeleteTextures(2, state->pingPongTex);
+    glDeleteTextures(2, state->pingPongMoments);
+    glDeleteFramebuffers(2, state->pingPongFbo);
+    
+    int numBuffers = state->imageAccumulation ? 1 : 2;
+    glGenFramebuffers(numBuffers, state->pingPongFbo);
+    for(int i = 0; i < numBuffers; ++i)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, state->pingPongFbo[i]);
+        uint32_t textureColorBuffer;
+        glGenTextures(1, &textureColorBuffer);
+        glBindTexture(GL_TEXTURE_2D, textureColorBuffer);
+        // RGBA because the wavefront kernels write it as an image, which can't be RGB.
+        // Sums need the full precision, half floats would stop growing
+        uint32_t colorFormat = state->imageAccumulation ? GL_RGBA32F : GL_RGBA16F;
+        glTexImage2D(GL_TEXTURE_2D, 0, colorFormat, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorBuffer, 0);
+        
+        // Written by the path tracer along with the color (second render target)
+        uint32_t momentsBuffer;
+        glGenTextures(1, &momentsBuffer);
+        glBindTexture(GL_TEXTURE_2D, momentsBuffer);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, momentsBuffer, 0);
+        
+        // The images are written with imageStore instead, the attachments only set the viewport size
+        uint32_t drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        if(state->imageAccumulation) drawBuffers[0] = drawBuffers[1] = GL_NONE;
+        glDrawBuffers(2, drawBuffers);
+        
+        // Checked while bound, headless contexts don't have a default framebuffer
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            fprintf(stderr, "Failed to create frame buffer object\n");
+        }
+        
+        state->pingPongTex[i] = textureColorBuffer;
+        state->pingPongMoments[i] = momentsBuffer;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    
+    if(state->imageAccumulation)
+    {
+        state->pingPongFbo[1] = state->pingPongFbo[0];
+        state->pingPongTex[1] = state->pingPongTex[0];
+        state->pingPongMoments[1] = state->pingPongMoments[0];
+    }
+    
+    // Half floats are enough for the surface test, see SameSurface in reproject.glsl
+    if(state->useReprojection)
+    {
+        ReprojectState* rp = &state->reproject;
+        glDeleteTextures(2, rp->primaryHitTex);
+        ReleaseReprojectTargets(state);
+        rp->targetWidth = width;
+        rp->targetHeight = height;
+        
+        for(int i = 0; i < 2; ++i)
+            rp->primaryHitTex[i] = CreateScreenTexture(GL_RGBA16F, width, height);
+    }
+    
+    // The wavefront buffers hold one path per pixel
+    if(state->useWavefront)
+    {
+        WavefrontState* wf = &state->wavefront;
+        wf->numPixels = width * height;
+        
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, wf->pathBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)wf->numPixels * WfPathStateSize, NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, wf->hitBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)wf->numPixels * WfHitRecordSize, NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, wf->queueBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)wf->numPixels * WfQueue_Count * sizeof(uint32_t), NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, wf->radianceBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)wf->numPixels * 4 * sizeof(float), NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+}
+
+#define EnvMapWidth   1024  // Of the source images and of the importance sampling CDFs
+#define EnvMapHeight  512
+#define TextureWidth  1024
+#define TextureHeight 1024
+
+// Octahedral env maps are square. Twice the texels of the equirectangular sources
+// are needed to keep their detail away from the horizon, 512 is visibly blurrier
+#define OctEnvMapSize 1024
+
+static inline int EnvMapLayoutWidth(bool octahedral)  { return octahedral ? OctEnvMapSize : EnvMapWidth; }
+static inline int EnvMapLayoutHeight(bool octahedral) { return octahedral ? OctEnvMapSize : EnvMapHeight; }
+
+// Images are decoded by a thread pool, and the main thread uploads them as they
+// finish (GL calls have to stay on the main thread). Image indices are env maps
+// first, then textures.
+#define NumDecodedImages (ArrayCount(envMaps) + ArrayCount(textures))
+
+struct
+{
+    ImageFormat envFormat;
+    ImageFormat texFormat;
+    bool octahedralEnvMaps;  // Convert the env maps, see EquirectToOctahedral
+    bool forCpu;  // Also decode the images for the CPU renderer
+    bool rebuildCache;  // Decode and store every image, even if it's cached
+    bool measureQuality;  // Fill psnr when encoding
+    
+    // Per image: the pixels in the GPU format, and the same pixels as RGB floats
+    // or RGBA8 for the CPU renderer (which point to the same data if the format is
+    // uncompressed). Env maps also get their importance sampling CDF
+    void* pixels[NumDecodedImages];
+    void* cpuPixels[NumDecodedImages];
+    float* envCdfs[ArrayCount(envMaps)];
+    float psnr[NumDecodedImages];
+    
+    // Images found in the asset cache point into these mappings instead of
+    // being allocated
+    CachedAsset cached[NumDecodedImages];
+    
+    // Indices of the finished images, in the order they finished
+    Mutex mutex;
+    CondVar imageDone;
+    int done[NumDecodedImages];
+    int numDone;
+    double lastDoneTime;
+} typedef ImageDecodeState;
+
+struct
+{
+    ImageDecodeState* state;
+    int idx;
+} typedef ImageDecodeJob;
+
+ImageFormat DecodedImageFormat(ImageDecodeState* state, int idx)
+{
+    return idx < ArrayCount(envMaps) ? state->envFormat : state->texFormat;
+}
+
+void DecodeImage(ImageDecodeState* state, int idx)
+{
+    bool isEnvMap = idx < ArrayCount(envMaps);
+    ImageFormat format = DecodedImageFormat(state, idx);
+    const char* path = isEnvMap ? envMaps[idx] : textures[idx - ArrayCount(envMaps)];
+    int width  = isEnvMap ? EnvMapLayoutWidth(state->octahedralEnvMaps)  : TextureWidth;
+    int height = isEnvMap ? EnvMapLayoutHeight(state->octahedralEnvMaps) : TextureHeight;
+    size_t pixelsSize = ImageMipChainSize(format, width, height);
+    size_t cdfSize = isEnvMap ? ImageFormatSize(ImageFormat_R32f, EnvMapWidth, EnvMapHeight + 1) : 0;
+    
+    // Env maps are stored along with their importance sampling CDF, e.g. "bc6h-oct1024+cdf"
+    char layout[16] = "";
+    if(isEnvMap && state->octahedralEnvMaps) snprintf(layout, sizeof(layout), "-oct%d", OctEnvMapSize);
+    char cacheFormat[32];
+    snprintf(cacheFormat, sizeof(cacheFormat), "%s%s%s", imageFormats[format].name, layout, isEnvMap ? "+cdf" : "");
+    
+    CachedAsset* cached = &state->cached[idx];
+    if(!state->rebuildCache && LoadCachedAsset(path, cacheFormat, cached))
+    {
+        assert(cached->width == width);
+        assert(cached->height == height);
+        assert(cached->file.size == sizeof(AssetCacheHeader) + pixelsSize + cdfSize);
+        state->pixels[idx] = cached->pixels;
+        if(isEnvMap) state->envCdfs[idx] = (float*)cached->extra;
+    }
+    else
+    {
+        // Always add the alpha to textures, to test coverage
+        int w, h, comp;
+        void* src = isEnvMap ? (void*)stbi_loadf(path, &w, &h, &comp, 3) : (void*)stbi_load(path, &w, &h, &comp, 4);
+        assert(src);
+        assert(w == (isEnvMap ? EnvMapWidth : width));
+        assert(h == (isEnvMap ? EnvMapHeight : height));
+        assert(!isEnvMap || comp == 3);
+        if(isEnvMap) state->envCdfs[idx] = BuildEnvMapCdf((float*)src, w, h);
+        
+        // The CDF stays equirectangular, only the lookups by direction change
+        if(isEnvMap && state->octahedralEnvMaps)
+        {
+            float* oct = EquirectToOctahedral((float*)src, w, h, OctEnvMapSize);
+            stbi_image_free(src);
+            src = oct;
+        }
+        
+        void* mips = BuildMipChain(isEnvMap, src, width, height);
+        if(isEnvMap && state->octahedralEnvMaps)
+            free(src);
+        else
+            stbi_image_free(src);
+        state->pixels[idx] = EncodeImageFormat(format, mips, width, height);
+        if(state->pixels[idx])
+        {
+            if(state->measureQuality)
+                state->psnr[idx] = ImageFormatPsnr(format, mips, state->pixels[idx], width, height);
+            free(mips);
+        }
+        else
+            state->pixels[idx] = mips;
+        
+        StoreCachedAsset(path, cacheFormat, width, height, state->pixels[idx], pixelsSize,
+                         isEnvMap ? state->envCdfs[idx] : NULL, cdfSize);
+    }
+    
+    state->cpuPixels[idx] = NULL;
+    if(state->forCpu)
+    {
+        state->cpuPixels[idx] = DecodeImageFormat(format, state->pixels[idx], width, height);
+        if(!state->cpuPixels[idx]) state->cpuPixels[idx] = state->pixels[idx];
+    }
+}
+
+void FreeDecodedImage(ImageDecodeState* state, int idx)
+{
+    if(state->cpuPixels[idx] != state->pixels[idx])
+        free(state->cpuPixels[idx]);
+    
+    if(state->cached[idx].pixels)
+        UnmapFile(&state->cached[idx].file);
+    else
+    {
+        free(state->pixels[idx]);
+        if(idx < ArrayCount(envMaps))
+            free(state->envCdfs[idx]);
+    }
+    
+    memset(&state->cached[idx], 0, sizeof(CachedAsset));
+    state->pixels[idx] = NULL;
+    state->cpuPixels[idx] = NULL;
+}
+
+void DecodeImageJob(void* userData)
+{
+    ImageDecodeJob* job = (ImageDecodeJob*)userData;
+    ImageDecodeState* state = job->state;
+    DecodeImage(state, job->idx);
+    
+    LockMutex(&state->mutex);
+    state->done[state->numDone++] = job->idx;
+    state->lastDoneTime = GetTimeSeconds();
+    SignalCondVar(&state->imageDone);
+    UnlockMutex(&state->mutex);
+}
+
+void RebuildAssetCacheEntry(void* userData, int idx)
+{
+    ImageDecodeState* state = (ImageDecodeState*)userData;
+    DecodeImage(state, idx);
+    FreeDecodedImage(state, idx);
+}
+
+// Decodes every env map and texture, encodes them in the given formats and stores
+// them in the asset cache. Doesn't need a GL context
+int BuildAssetCache(ImageFormat envFormat, ImageFormat texFormat, bool octahedralEnvMaps)
+{
+    if(!assetCache.enabled)
+    {
+        fprintf(stderr, "Could not create the asset cache in %s\n", assetCache.path);
+        return 1;
+    }
+    
+    double start = GetTimeSeconds();
+    static ImageDecodeState decode;
+    memset(&decode, 0, sizeof(decode));
+    decode.envFormat = envFormat;
+    decode.texFormat = texFormat;
+    decode.octahedralEnvMaps = octahedralEnvMaps;
+    decode.rebuildCache = true;
+    decode.measureQuality = true;
+    
+    ThreadPool pool;
+    InitThreadPool(&pool, 0);
+    ParallelFor(&pool, NumDecodedImages, RebuildAssetCacheEntry, &decode);
+    DestroyThreadPool(&pool);
+    
+    for(int i = 0; i < NumDecodedImages; ++i)
+    {
+        bool isEnvMap = i < ArrayCount(envMaps);
+        ImageFormat format = DecodedImageFormat(&decode, i);
+        size_t size = isEnvMap ? ImageMipChainSize(format, EnvMapLayoutWidth(octahedralEnvMaps), EnvMapLayoutHeight(octahedralEnvMaps)) :
+                                 ImageMipChainSize(format, TextureWidth, TextureHeight);
+        printf("%-48s %-6s %6.2f MB", isEnvMap ? envMaps[i] : textures[i - ArrayCount(envMaps)],
+               imageFormats[format].name, size / (1024.0 * 1024.0));
+        if(isfinite(decode.psnr[i]))
+            printf(", PSNR %.1f dB", decode.psnr[i]);
+        printf("\n");
+    }
+    
+    printf("Stored %d images in %s (%.2fs)\n", (int)NumDecodedImages, assetCache.path, GetTimeSeconds() - start);
+    return 0;
+}
+
+// Workers for LoadImages
+static ThreadPool imagePool;
+static ImageDecodeState imageDecode;
+
+// If not NULL, gets its own copy of every resident image
+static CpuRenderer* imageCpu;
+
+void InitImageSlots(ImageSlots* slots, int numImages, int firstImage, int maxLayers, size_t layerSize)
+{
+    assert(numImages <= MaxImageSlots);
+    memset(slots, 0, sizeof(ImageSlots));
+    slots->numImages = numImages;
+    slots->firstImage = firstImage;
+    slots->maxLayers = maxLayers;
+    slots->layerSize = layerSize;
+    for(int i = 0; i < MaxImageSlots; ++i)
+    {
+        slots->layerOf[i] = -1;
+        slots->imageIn[i] = -1;
+    }
+}
+
+// Sets up the image residency (nothing is resident until a scene needs it, see
+// MakeSceneResident) and creates the blue noise texture. If cpu is not NULL, the
+// images are also kept in memory for the CPU renderer.
+void InitImages(RenderState* state, CpuRenderer* cpu, size_t textureBudget, ImageFormat envFormat, ImageFormat texFormat, bool octahedralEnvMaps)
+{
+    double start = GetTimeSeconds();
+    
+    imageCpu = cpu;
+    imageDecode.envFormat = envFormat;
+    imageDecode.texFormat = texFormat;
+    imageDecode.octahedralEnvMaps = octahedralEnvMaps;
+    imageDecode.forCpu = cpu != NULL;
+    InitMutex(&imageDecode.mutex);
+    InitCondVar(&imageDecode.imageDone);
+    InitThreadPool(&imagePool, 0);
+    
+    state->textureBudget = textureBudget;
+    state->octahedralEnvMaps = octahedralEnvMaps;
+    if(cpu)
+    {
+        cpu->octahedralEnvMaps = octahedralEnvMaps;
+        cpu->envCdfWidth  = EnvMapWidth;
+        cpu->envCdfHeight = EnvMapHeight;
+    }
+    
+    int envWidth  = EnvMapLayoutWidth(octahedralEnvMaps);
+    int envHeight = EnvMapLayoutHeight(octahedralEnvMaps);
+    size_t envLayerSize = ImageMipChainSize(envFormat, envWidth, envHeight) +
+                          ImageFormatSize(ImageFormat_R32f, EnvMapWidth, EnvMapHeight + 1);
+    size_t texLayerSize = ImageMipChainSize(texFormat, TextureWidth, TextureHeight);
+    InitImageSlots(&state->envSlots, ArrayCount(envMaps), 0, ArrayCount(envMaps), envLayerSize);
+    // Texture 0 is white and never sampled
+    InitImageSlots(&state->texSlots, ArrayCount(textures), ArrayCount(envMaps), ArrayCount(textures) - 1, texLayerSize);
+    state->envSlots.format = envFormat;
+    state->texSlots.format = texFormat;
+    state->envSlots.width  = envWidth;
+    state->envSlots.height = envHeight;
+    state->texSlots.width  = TextureWidth;
+    state->texSlots.height = TextureHeight;
+    
+    // The arrays have no layers until they're needed. Images have full mip chains,
+    // which the shader samples with explicit LODs
+    glGenTextures(1, &state->envMapArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, state->envMapArray);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, ImageMipLevels(envWidth, envHeight) - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    
+    // Importance sampling tables, one layer per map
+    glGenTextures(1, &state->envCdfArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, state->envCdfArray);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    
+    glGenTextures(1, &state->textureArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, state->textureArray);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, ImageMipLevels(TextureWidth, TextureHeight) - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    // Blue noise mask for the sampler, tiled over the screen
+    float* blueNoise = GenerateBlueNoise(BlueNoiseSize);
+    glGenTextures(1, &state->blueNoiseTex);
+    glBindTexture(GL_TEXTURE_2D, state->blueNoiseTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, BlueNoiseSize, BlueNoiseSize, 0, GL_RED, GL_FLOAT, blueNoise);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    
+    if(cpu)
+        cpu->blueNoise = blueNoise;
+    else
+        free(blueNoise);
+    
+    printf("Generated the blue noise mask in %.2fs\n", GetTimeSeconds() - start);
+}
+
+// Uploads whole layers of a texture array. The data holds the levels one after
+// the other (as in ImageLevelOffset), each one with all of the layers
+void UploadImageLayers(uint32_t texture, ImageFormat format, int width, int height, int numLevels,
+                       int firstLayer, int numLayers, const void* data)
+{
+    const ImageFormatInfo* info = &imageFormats[format];
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    for(int level = 0; level < numLevels; ++level)
+    {
+        int w = MipSize(width, level), h = MipSize(height, level);
+        const uint8_t* levelData = (const uint8_t*)data + ImageLevelOffset(format, width, height, level) * numLayers;
+        if(IsBlockCompressed(format))
+        {
+            GLsizei size = (GLsizei)(ImageFormatSize(format, w, h) * numLayers);
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, firstLayer, w, h, numLayers, info->internalFormat, size, levelData);
+        }
+        else
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, firstLayer, w, h, numLayers, info->format, info->type, levelData);
+    }
+}
+
+// Reallocates a texture array with numLayers layers, the first numKept of which get the
+// contents of the old layers srcLayers[0..numKept). Returns the new texture, the old one is
+// deleted. The copy stays on the GPU with glCopyImageSubData (GL 4.3 or ARB_copy_image),
+// older contexts read the old array back to the CPU first
+uint32_t ResizeTextureArray(uint32_t texture, ImageFormat format, int width, int height, int numLevels,
+                            int oldLayers, const int* srcLayers, int numKept, int numLayers)
+{
+    const ImageFormatInfo* info = &imageFormats[format];
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    uint8_t* old = NULL;
+    if(numKept > 0 && !glCopyImageSubData)
+    {
+        old = (uint8_t*)malloc(ImageLevelOffset(format, width, height, numLevels) * oldLayers);
+        for(int level = 0; level < numLevels; ++level)
+        {
+            uint8_t* levelData = old + ImageLevelOffset(format, width, height, level) * oldLayers;
+            if(IsBlockCompressed(format))
+                glGetCompressedTexImage(GL_TEXTURE_2D_ARRAY, level, levelData);
+            else
+                glGetTexImage(GL_TEXTURE_2D_ARRAY, level, info->format, info->type, levelData);
+        }
+    }
+    
+    // Same sampling parameters as the old array, see InitImages
+    const uint32_t paramNames[] = { GL_TEXTURE_MAX_LEVEL, GL_TEXTURE_MIN_FILTER, GL_TEXTURE_MAG_FILTER, GL_TEXTURE_WRAP_S, GL_TEXTURE_WRAP_T };
+    int params[ArrayCount(paramNames)];
+    for(int i = 0; i < ArrayCount(paramNames); ++i)
+        glGetTexParameteriv(GL_TEXTURE_2D_ARRAY, paramNames[i], &params[i]);
+    
+    uint32_t res;
+    glGenTextures(1, &res);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, res);
+    for(int i = 0; i < ArrayCount(paramNames); ++i)
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, paramNames[i], params[i]);
+    
+    for(int level = 0; level < numLevels; ++level)
+    {
+        int w = MipSize(width, level), h = MipSize(height, level);
+        if(IsBlockCompressed(format))
+        {
+            GLsizei size = (GLsizei)(ImageFormatSize(format, w, h) * numLayers);
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, info->internalFormat, w, h, numLayers, 0, size, NULL);
+        }
+        else
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, level, info->internalFormat, w, h, numLayers, 0, info->format, info->type, NULL);
+    }
+    
+    // Only once every level is defined, drivers can move the storage until then
+    for(int level = 0; level < numLevels; ++level)
+    {
+        int w = MipSize(width, level), h = MipSize(height, level);
+        for(int i = 0; i < numKept; ++i)
+        {
+            if(!old)
+            {
+                glCopyImageSubData(texture, GL_TEXTURE_2D_ARRAY, level, 0, 0, srcLayers[i],
+                                   res, GL_TEXTURE_2D_ARRAY, level, 0, 0, i, w, h, 1);
+                continue;
+            }
+            
+            size_t layerSize = ImageFormatSize(format, w, h);
+            const uint8_t* layerData = old + ImageLevelOffset(format, width, height, level) * oldLayers + layerSize * srcLayers[i];
+            if(IsBlockCompressed(format))
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, i, w, h, 1, info->internalFormat, (GLsizei)layerSize, layerData);
+            else
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, i, w, h, 1, info->format, info->type, layerData);
+        }
+    }
+    
+    glDeleteTextures(1, &texture);
+    free(old);
+    return res;
+}
+
+// Reallocates the arrays of the slots with numLayers layers. Growing keeps every image
+// in its layer, shrinking packs the resident images into the first layers (they have to fit)
+void ResizeImageLayers(RenderState* state, ImageSlots* slots, int numLayers)
+{
+    int srcLayers[MaxImageSlots];
+    int numKept = 0;
+    if(numLayers >= slots->numLayers)
+    {
+        for(int i = 0; i < slots->numLayers; ++i)
+            srcLayers[numKept++] = i;
+    }
+    else
+    {
+        ImageSlots old = *slots;
+        for(int i = 0; i < MaxImageSlots; ++i)
+        {
+            slots->imageIn[i] = -1;
+            slots->lastUse[i] = 0;
+        }
+        
+        for(int i = 0; i < old.numLayers; ++i)
+        {
+            int image = old.imageIn[i];
+            if(image < 0) continue;
+            
+            slots->imageIn[numKept] = image;
+            slots->lastUse[numKept] = old.lastUse[i];
+            slots->layerOf[image] = numKept;
+            srcLayers[numKept++] = i;
+        }
+        assert(numKept <= numLayers);
+    }
+    
+    if(slots == &state->envSlots)
+    {
+        state->envMapArray = ResizeTextureArray(state->envMapArray, slots->format, slots->width, slots->height,
+                                                ImageMipLevels(slots->width, slots->height), slots->numLayers, srcLayers, numKept, numLayers);
+        state->envCdfArray = ResizeTextureArray(state->envCdfArray, ImageFormat_R32f, EnvMapWidth, EnvMapHeight + 1, 1,
+                                                slots->numLayers, srcLayers, numKept, numLayers);
+    }
+    else
+    {
+        state->textureArray = ResizeTextureArray(state->textureArray, slots->format, slots->width, slots->height,
+                                                 ImageMipLevels(slots->width, slots->height), slots->numLayers, srcLayers, numKept, numLayers);
+    }
+    
+    slots->numLayers = numLayers;
+}
+
+size_t ResidentImageBytes(RenderState* state)
+{
+    return state->envSlots.numLayers * state->envSlots.layerSize +
+           state->texSlots.numLayers * state->texSlots.layerSize;
+}
+
+// Frees the layer of a resident image, and its copy in the CPU renderer
+void EvictImage(ImageSlots* slots, int image)
+{
+    int layer = slots->layerOf[image];
+    slots->layerOf[image] = -1;
+    slots->imageIn[layer] = -1;
+    slots->lastUse[layer] = 0;
+    if(!imageCpu) return;
+    
+    int idx = slots->firstImage + image;
+    FreeDecodedImage(&imageDecode, idx);
+    if(idx < ArrayCount(envMaps))
+    {
+        memset(&imageCpu->envMaps[image], 0, sizeof(HdrImage));
+        imageCpu->envCdfs[image] = NULL;
+    }
+    else
+        memset(&imageCpu->textures[image], 0, sizeof(LdrImage));
+}
+
+// Gives layers of the slots back to the texture budget, until neededBytes more fit in it:
+// the free layers, and if that's not enough the least recently used images of other
+// scenes, which are evicted. The arrays shrink to the images that are left
+void ReleaseImageLayers(RenderState* state, ImageSlots* slots, size_t neededBytes)
+{
+    size_t otherBytes = ResidentImageBytes(state) - slots->numLayers * slots->layerSize;
+    if(ResidentImageBytes(state) + neededBytes <= state->textureBudget) return;
+    
+    int numResident = 0;
+    for(int i = 0; i < slots->numLayers; ++i)
+        numResident += slots->imageIn[i] >= 0;
+    
+    while(numResident > 0 && otherBytes + numResident * slots->layerSize + neededBytes > state->textureBudget)
+    {
+        int layer = -1;
+        for(int i = 0; i < slots->numLayers; ++i)
+        {
+            if(slots->imageIn[i] >= 0 && slots->lastUse[i] != state->residencyClock && (layer < 0 || slots->lastUse[i] < slots->lastUse[layer]))
+                layer = i;
+        }
+        
+        if(layer < 0) break;
+        EvictImage(slots, slots->imageIn[layer]);
+        --numResident;
+    }
+    
+    if(numResident < slots->numLayers)
+        ResizeImageLayers(state, slots, numResident);
+}
+
+// Marks the resident images in 'used' as used by the current MakeSceneResident call,
+// which keeps them from being evicted by it
+void MarkUsedImages(RenderState* state, ImageSlots* slots, const bool* used)
+{
+    for(int i = 0; i < slots->numImages; ++i)
+    {
+        if(used[i] && slots->layerOf[i] >= 0)
+            slots->lastUse[slots->layerOf[i]] = state->residencyClock;
+    }
+}
+
+// Assigns layers to the images in 'used' that aren't resident yet, growing the
+// arrays while the texture budget allows it and evicting the least recently used
+// images of other scenes otherwise. Writes the DecodeImage indices of the images
+// that have to be loaded to 'missing', and returns how many there are.
+// The resident images of the scene have to be marked already, see MarkUsedImages
+int AssignImageLayers(RenderState* state, ImageSlots* slots, const bool* used, int* missing)
+{
+    int numUsed = 0;
+    int numMissing = 0;
+    for(int i = 0; i < slots->numImages; ++i)
+    {
+        numUsed += used[i];
+        numMissing += used[i] && slots->layerOf[i] < 0;
+    }
+    
+    if(numMissing == 0) return 0;
+    
+    int numFree = 0;
+    for(int i = 0; i < slots->numLayers; ++i)
+        numFree += slots->imageIn[i] < 0;
+    
+    if(numFree < numMissing)
+    {
+        // Grow by doubling, so that going through the scenes doesn't copy the arrays
+        // every time. Over the budget, only what this scene needs is added, and the
+        // other scenes' images are evicted instead
+        int needed = slots->numLayers + (numMissing - numFree);
+        int numLayers = needed > 2 * slots->numLayers ? needed : 2 * slots->numLayers;
+        if(numLayers > slots->maxLayers) numLayers = slots->maxLayers;
+        
+        int minLayers = numUsed > slots->numLayers ? numUsed : slots->numLayers;
+        if(state->textureBudget > 0)
+        {
+            // The layers that the other kind of image doesn't need now make room first
+            ImageSlots* other = slots == &state->envSlots ? &state->texSlots : &state->envSlots;
+            int neededLayers = needed < numLayers ? needed : numLayers;
+            ReleaseImageLayers(state, other, (neededLayers - slots->numLayers) * slots->layerSize);
+            
+            size_t otherBytes = ResidentImageBytes(state) - slots->numLayers * slots->layerSize;
+            while(numLayers > minLayers && otherBytes + numLayers * slots->layerSize > state->textureBudget)
+                --numLayers;
+            
+            if(otherBytes + numLayers * slots->layerSize > state->textureBudget)
+                fprintf(stderr, "The scene's images don't fit in the texture budget (%.1f MB)\n", state->textureBudget / (1024.0 * 1024.0));
+        }
+        
+        if(numLayers > slots->numLayers)
+            ResizeImageLayers(state, slots, numLayers);
+    }
+    
+    int count = 0;
+    for(int i = 0; i < slots->numImages; ++i)
+    {
+        if(!used[i] || slots->layerOf[i] >= 0) continue;
+        
+        // First free layer, or the least recently used one
+        int layer = -1;
+        for(int j = 0; j < slots->numLayers; ++j)
+        {
+            if(slots->imageIn[j] < 0)
+            {
+                layer = j;
+                break;
+            }
+            
+            if(slots->lastUse[j] != state->residencyClock && (layer < 0 || slots->lastUse[j] < slots->lastUse[layer]))
+                layer = j;
+        }
+        
+        assert(layer >= 0);
+        if(slots->imageIn[layer] >= 0)
+            EvictImage(slots, slots->imageIn[layer]);
+        
+        slots->imageIn[layer] = i;
+        slots->layerOf[i] = layer;
+        slots->lastUse[layer] = state->residencyClock;
+        missing[count++] = slots->firstImage + i;
+    }
+    
+    return count;
+}
+
+// Uploads a decoded image to its layer, and hands it over to the CPU renderer
+void UploadDecodedImage(RenderState* state, int idx)
+{
+    ImageDecodeState* decode = &imageDecode;
+    if(idx < ArrayCount(envMaps))
+    {
+        ImageSlots* slots = &state->envSlots;
+        int layer = slots->layerOf[idx];
+        UploadImageLayers(state->envMapArray, slots->format, slots->width, slots->height,
+                          ImageMipLevels(slots->width, slots->height), layer, 1, decode->pixels[idx]);
+        UploadImageLayers(state->envCdfArray, ImageFormat_R32f, EnvMapWidth, EnvMapHeight + 1, 1, layer, 1, decode->envCdfs[idx]);
+        
+        if(imageCpu)
+        {
+            imageCpu->envMaps[idx] = MakeHdrImage(slots->width, slots->height, (float*)decode->cpuPixels[idx]);
+            imageCpu->envCdfs[idx] = decode->envCdfs[idx];
+        }
+    }
+    else
+    {
+        int texIdx = idx - ArrayCount(envMaps);
+        int layer = state->texSlots.layerOf[texIdx];
+        UploadImageLayers(state->textureArray, state->texSlots.format, TextureWidth, TextureHeight,
+                          ImageMipLevels(TextureWidth, TextureHeight), layer, 1, decode->pixels[idx]);
+        
+        if(imageCpu)
+        {
+            imageCpu->textures[texIdx] = MakeLdrImage(TextureWidth, TextureHeight, (uint8_t*)decode->cpuPixels[idx]);
+        }
+    }
+}
+
+// Decodes the images on the thread pool, and uploads each one as soon as it's done.
+// Their layers have to be assigned already
+void LoadImages(RenderState* state, uint32_t sceneIdx, const int* images, int count)
+{
+    double start = GetTimeSeconds();
+    ImageDecodeState* decode = &imageDecode;
+    decode->numDone = 0;
+    
+    ImageDecodeJob jobs[NumDecodedImages];
+    for(int i = 0; i < count; ++i)
+    {
+        jobs[i].state = decode;
+        jobs[i].idx = images[i];
+        PushJob(&imagePool, DecodeImageJob, &jobs[i]);
+    }
+    
+    double uploadTime = 0.0;
+    int numCached = 0;
+    for(int numUploaded = 0; numUploaded < count; ++numUploaded)
+    {
+        LockMutex(&decode->mutex);
+        while(decode->numDone == numUploaded)
+            WaitCondVar(&decode->imageDone, &decode->mutex);
+        int idx = decode->done[numUploaded];
+        UnlockMutex(&decode->mutex);
+        
+        double uploadStart = GetTimeSeconds();
+        UploadDecodedImage(state, idx);
+        if(decode->cached[idx].pixels) ++numCached;
+        
+        // The CPU renderer keeps the images (or their mappings) until they're evicted
+        if(!imageCpu) FreeDecodedImage(decode, idx);
+        uploadTime += GetTimeSeconds() - uploadStart;
+    }
+    
+    double decodeTime = decode->lastDoneTime - start;
+    printf("Scene %u: loaded %d images in %.2fs, %d from the asset cache%s (decoding done after %.2fs on %d threads, upload %.2fs), %.1f MB of textures resident\n",
+           sceneIdx, count, GetTimeSeconds() - start, numCached, assetCache.enabled ? "" : " (disabled)",
+           decodeTime, imagePool.numThreads, uploadTime, ResidentImageBytes(state) / (1024.0 * 1024.0));
+}
+
+// Makes the images used by the scene resident, loading the ones that aren't.
+// Called before every frame, and cheap when nothing is missing
+void MakeSceneResident(RenderState* state, uint32_t sceneIdx)
+{
+    Scene* scene = &scenes[sceneIdx];
+    ++state->residencyClock;
+    
+    bool usedEnvMaps[MaxImageSlots] = {0};
+    bool usedTextures[MaxImageSlots] = {0};
+    if(scene->loaded) usedEnvMaps[scene->envMap] = true;
+    for(int i = 0; i < scene->numMaterials; ++i)
+    {
+        Material* mat = &scene->materials[i];
+        usedTextures[mat->emission]  = true;
+        usedTextures[mat->color]     = true;
+        usedTextures[mat->roughness] = true;
+    }
+    usedTextures[0] = false;  // White, never sampled
+    
+    MarkUsedImages(state, &state->envSlots, usedEnvMaps);
+    MarkUsedImages(state, &state->texSlots, usedTextures);
+    int missing[NumDecodedImages];
+    int numMissing = AssignImageLayers(state, &state->envSlots, usedEnvMaps, missing);
+    numMissing += AssignImageLayers(state, &state->texSlots, usedTextures, missing + numMissing);
+    if(numMissing > 0)
+        LoadImages(state, sceneIdx, missing, numMissing);
+}
+
+// Every scene is kept resident on the GPU, switching scenes only changes bindings
+void UploadAllScenes(RenderState* state)
+{
+    for(int i = 0; i < MaxScenes; ++i)
+    {
+        DeleteSceneBuffers(&state->sceneBuffers[i]);
+        UploadScene(&state->sceneBuffers[i], &scenes[i]);
+    }
+    
+    // Compile the programs up front, so switching scenes doesn't stall
+    if(!state->useWavefront)
+    {
+        for(int i = 0; i < MaxScenes; ++i)
+            GetSceneVariant(state, i);
+    }
+}
+
+// Sets the uniforms and textures of a program compiled from pathtracer.glsl,
+// which must be bound
+void SetPathTracerInputs(RenderState* state, PathTracerUniforms* u, FrameParams* params)
+{
+    // Set uniforms
+    glUniform2f(u->resolution, (float)params->width, (float)params->height);
+    glUniform1ui(u->frameId, params->frameId);
+    glUniform1ui(u->numSamples, params->numSamples);
+    glUniform1ui(u->accumSamples, params->accumSamples);
+    glUniform3f(u->cameraPos, params->camPos.x, params->camPos.y, params->camPos.z);
+    glUniform2f(u->cameraAngle, params->camRot.x, params->camRot.y);
+    
+    // Set scene
+    Scene* scene = &scenes[params->scene];
+    SceneBuffers* sceneBuffers = &state->sceneBuffers[params->scene];
+    glUniform1i(u->numSpheres, scene->numSpheres);
+    glUniform1i(u->numQuads, scene->numQuads);
+    glUniform1i(u->envMap, scene->loaded ? (int)scene->envMap : -1);
+    
+    // Layers of the resident images, non resident ones are never sampled
+    int envMapLayer = scene->loaded ? state->envSlots.layerOf[scene->envMap] : -1;
+    int textureLayers[ArrayCount(textures)];
+    for(int i = 0; i < ArrayCount(textures); ++i)
+        textureLayers[i] = state->texSlots.layerOf[i] < 0 ? 0 : state->texSlots.layerOf[i];
+    glUniform1i(u->envMapLayer, envMapLayer < 0 ? 0 : envMapLayer);
+    glUniform1iv(u->textureLayers, ArrayCount(textures), textureLayers);
+    glUniform1i(u->useBvh, !state->disableBvh);
+    glUniform1i(u->numLights, scene->numLights);
+    glUniform1i(u->useNee, params->useNee);
+    glUniform1i(u->useEnvSampling, params->useEnvSampling);
+    glUniform1i(u->useRayCones, params->useRayCones);
+    glUniform1i(u->octahedralEnvMaps, state->octahedralEnvMaps);
+    glUniform1ui(u->minBounces, params->minBounces);
+    glUniform1ui(u->maxBounces, params->maxBounces);
+    glUniform1i(u->adaptiveSampling, params->adaptiveSampling);
+    glUniform1f(u->convergenceThreshold, params->convergenceThreshold);
+    glUniform1ui(u->minAdaptiveSamples, AdaptiveMinSamples);
+    glUniform1i(u->samplerType, params->sampler);
+    
+    // Set textures
+    glUniform1i(u->prevFrame, 0);
+    glUniform1i(u->envMaps, 1);
+    glUniform1i(u->textures, 2);
+    glUniform1i(u->sceneSpheres, 3);
+    glUniform1i(u->sceneQuads, 4);
+    glUniform1i(u->sceneMaterials, 5);
+    glUniform1i(u->bvhNodes, 6);
+    glUniform1i(u->bvhPrims, 7);
+    glUniform1i(u->sceneLights, 8);
+    glUniform1i(u->envCdfs, 9);
+    glUniform1i(u->prevMoments, 10);
+    glUniform1i(u->blueNoise, 11);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, state->pingPongTex[0]);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, state->envMapArray);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, state->textureArray);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_BUFFER, sceneBuffers->sphereTex);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_BUFFER, sceneBuffers->quadTex);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_BUFFER, sceneBuffers->materialTex);
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_BUFFER, sceneBuffers->bvhNodeTex);
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_BUFFER, sceneBuffers->bvhPrimTex);
+    glActiveTexture(GL_TEXTURE8);
+    glBindTexture(GL_TEXTURE_BUFFER, sceneBuffers->lightTex);
+    glActiveTexture(GL_TEXTURE9);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, state->envCdfArray);
+    glActiveTexture(GL_TEXTURE10);
+    glBindTexture(GL_TEXTURE_2D, state->pingPongMoments[0]);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, state->blueNoiseTex);
+    
+    // Read and written in place, see ResizeFramebuffers
+    if(state->imageAccumulation)
+    {
+        glUniform1i(u->accumImage, 0);
+        glUniform1i(u->accumMoments, 1);
+        glBindImageTexture(0, state->pingPongTex[1], 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindImageTexture(1, state->pingPongMoments[1], 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    }
+}
+
+// Renders one path tracing frame into pingPongFbo[1], blending with pingPongTex[0]
+// (or adding to it in place, with image accumulation)
+void RenderPathTracerGpu(RenderState* state, FrameParams* params)
+{
+    MakeSceneResident(state, params->scene);
+    
+    if(state->useWavefront)
+    {
+        RenderPathTracerWavefront(state, params);
+        return;
+    }
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, state->pingPongFbo[1]);
+    glViewport(0, 0, params->width, params->height);
+    if(!state->imageAccumulation)
+    {
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    ShaderVariant* variant = GetSceneVariant(state, params->scene);
+    glUseProgram(variant->program);
+    SetPathTracerInputs(state, &variant->uniforms, params);
+    
+    glBindVertexArray(state->vao);
+    glDrawArrays(GL_TRIANGLES, 0, fullScreenQuadVertCount);
+    
+    // The result is read as a texture, or with glGetTexImage
+    if(state->imageAccumulation) glMemoryBarrier(GL_ALL_BARRIER_BITS);
+}
+
+// Traces one frame with the wavefront kernels, with the same inputs and outputs as
+// the fragment shader. Each of the numSamples waves starts one path per pixel, then
+// alternates extend and shading kernels for maxBounces bounces. The queue sizes are
+// only known on the GPU, so the kernels are dispatched indirectly, with the sizes
+// computed by the prepare kernel. Bounces with no paths left are empty dispatches.
+void RenderPathTracerWavefront(RenderState* state, FrameParams* params)
+{
+    WavefrontState* wf = &state->wavefront;
+    const uint32_t numPixelGroups = (params->width * params->height + WavefrontGroupSize - 1) / WavefrontGroupSize;
+    const GLbitfield barrier = GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT;
+    
+    for(int i = 0; i < WfKernel_Count; ++i)
+    {
+        glUseProgram(wf->kernels[i]);
+        SetPathTracerInputs(state, &wf->uniforms[i], params);
+    }
+    
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, wf->pathBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, wf->hitBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, wf->queueBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, wf->queueCountBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, wf->radianceBuffer);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, wf->queueCountBuffer);
+    if(!state->imageAccumulation)  // Otherwise bound by SetPathTracerInputs
+    {
+        glBindImageTexture(0, state->pingPongTex[1], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(1, state->pingPongMoments[1], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    }
+    
+    for(uint32_t wave = 0; wave < params->numSamples; ++wave)
+    {
+        glUseProgram(wf->kernels[WfKernel_Prepare]);
+        glUniform1i(wf->prepareStage, WfPrepare_Reset);
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(barrier);
+        
+        glUseProgram(wf->kernels[WfKernel_Generate]);
+        glUniform1ui(wf->waveIndex[WfKernel_Generate], wave);
+        glUniform1ui(wf->extendQueue[WfKernel_Generate], WfQueue_Extend0);
+        glDispatchCompute(numPixelGroups, 1, 1);
+        glMemoryBarrier(barrier);
+        
+        for(uint32_t bounce = 0; bounce < params->maxBounces; ++bounce)
+        {
+            uint32_t extendQueue = WfQueue_Extend0 + bounce % 2;
+            
+            glUseProgram(wf->kernels[WfKernel_Prepare]);
+            glUniform1i(wf->prepareStage, WfPrepare_Extend);
+            glUniform1ui(wf->extendQueue[WfKernel_Prepare], extendQueue);
+            glDispatchCompute(1, 1, 1);
+            glMemoryBarrier(barrier);
+            
+            glUseProgram(wf->kernels[WfKernel_Extend]);
+            glUniform1ui(wf->extendQueue[WfKernel_Extend], extendQueue);
+            glDispatchComputeIndirect(WfDispatchArgsOffset(extendQueue));
+            glMemoryBarrier(barrier);
+            
+            glUseProgram(wf->kernels[WfKernel_Prepare]);
+            glUniform1i(wf->prepareStage, WfPrepare_Shade);
+            glDispatchCompute(1, 1, 1);
+            glMemoryBarrier(barrier);
+            
+            // The shading kernels push to different queues, so they don't need barriers in between
+            for(int matType = 0; matType < WfNumMatTypes; ++matType)
+            {
+                WfKernel kernel = WfKernel_ShadeMatte + matType;
+                glUseProgram(wf->kernels[kernel]);
+                glUniform1ui(wf->extendQueue[kernel], extendQueue);
+                glDispatchComputeIndirect(WfDispatchArgsOffset(WfQueue_FirstShade + matType));
+            }
+            glMemoryBarrier(barrier);
+        }
+    }
+    
+    glUseProgram(wf->kernels[WfKernel_Accumulate]);
+    glDispatchCompute(numPixelGroups, 1, 1);
+    
+    // The result is read as a texture, or with glGetTexImage
+    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+// Warps the accumulation of the previous camera into the view of params (see
+// reproject.glsl), so that the next frame adds to it. If reprojectHistory is false,
+// it only stores the primary hits of the view, for the next move, and the
+// accumulation restarts. The result replaces pingPongTex[0]
+void ReprojectAccumulation(RenderState* state, FrameParams* params, bool reprojectHistory, Vec3 prevCamPos, Vec2 prevCamRot)
+{
+    MakeSceneResident(state, params->scene);
+    ReprojectState* rp = &state->reproject;
+    
+    // The accumulation can't be updated in place, since pixels read their neighbors.
+    // With image accumulation, the result goes to another pair of buffers instead
+    if(state->imageAccumulation && !rp->targetTex)
+    {
+        rp->targetTex = CreateScreenTexture(GL_RGBA32F, rp->targetWidth, rp->targetHeight);
+        rp->targetMoments = CreateScreenTexture(GL_RGBA32F, rp->targetWidth, rp->targetHeight);
+    }
+    
+    uint32_t targetTex = state->imageAccumulation ? rp->targetTex : state->pingPongTex[1];
+    uint32_t targetMoments = state->imageAccumulation ? rp->targetMoments : state->pingPongMoments[1];
+    glBindFramebuffer(GL_FRAMEBUFFER, rp->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, targetTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, targetMoments, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, rp->primaryHitTex[1], 0);
+    uint32_t drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+    glDrawBuffers(3, drawBuffers);
+    glViewport(0, 0, params->width, params->height);
+    
+    // The previous accumulation is bound like for the path tracer
+    glUseProgram(rp->program);
+    SetPathTracerInputs(state, &rp->uniforms, params);
+    glUniform1i(rp->previousPrimaryHits, 12);
+    glUniform3f(rp->previousCameraPos, prevCamPos.x, prevCamPos.y, prevCamPos.z);
+    glUniform2f(rp->previousCameraAngle, prevCamRot.x, prevCamRot.y);
+    glUniform2f(rp->previousResolution, (float)rp->hitsWidth, (float)rp->hitsHeight);
+    glUniform1i(rp->reprojectHistory, reprojectHistory);
+    glUniform1f(rp->maxHistorySamples, (float)ReprojectMaxSamples);
+    glUniform1i(rp->accumulateSums, state->imageAccumulation);
+    glActiveTexture(GL_TEXTURE12);
+    glBindTexture(GL_TEXTURE_2D, rp->primaryHitTex[0]);
+    
+    glBindVertexArray(state->vao);
+    glDrawArrays(GL_TRIANGLES, 0, fullScreenQuadVertCount);
+    
+    uint32_t tmp = rp->primaryHitTex[0];
+    rp->primaryHitTex[0] = rp->primaryHitTex[1];
+    rp->primaryHitTex[1] = tmp;
+    rp->hitsWidth  = params->width;
+    rp->hitsHeight = params->height;
+    
+    // With image accumulation pingPongFbo isn't written, but it has to
+    // let go of the old buffers, which ReleaseReprojectTargets deletes
+    if(state->imageAccumulation)
+    {
+        tmp = rp->targetTex;
+        rp->targetTex = state->pingPongTex[0];
+        state->pingPongTex[0] = state->pingPongTex[1] = tmp;
+        tmp = rp->targetMoments;
+        rp->targetMoments = state->pingPongMoments[0];
+        state->pingPongMoments[0] = state->pingPongMoments[1] = tmp;
+        
+        glBindFramebuffer(GL_FRAMEBUFFER, state->pingPongFbo[0]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, state->pingPongTex[0], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, state->pingPongMoments[0], 0);
+    }
+    else
+        SwapPingPongBuffers(state);
+}
+
+// The buffers that ReprojectAccumulation swaps with the accumulation double its memory,
+// so they're only kept while the camera moves. Call on frames that don't reproject
+void ReleaseReprojectTargets(RenderState* state)
+{
+    ReprojectState* rp = &state->reproject;
+    glDeleteTextures(1, &rp->targetTex);
+    glDeleteTextures(1, &rp->targetMoments);
+    rp->targetTex = rp->targetMoments = 0;
+}
+
+// The estimate of the new accumulation starts from the cost of the first frames
+void StartAccumulation(FrameBudgetController* c, uint32_t frame)
+{
+    c->accumStartFrame = frame;
+    c->msPerSample = c->firstFramesMsPerSample;
+}
+
+void RecordFrame(FrameBudgetController* c, uint32_t frame, FrameRecord record)
+{
+    c->frames[frame % ArrayCount(c->frames)] = record;
+    c->newestFrame = frame;
+}
+
+// ms is the time it took to path trace the given frame, without the reprojection
+// and the image uploads, which don't depend on the samples. Frames that are too old to
+// know what they traced, or that were already measured, are ignored
+void AddFrameCost(FrameBudgetController* c, uint32_t frame, float ms)
+{
+    if(c->measured && frame <= c->lastMeasuredFrame) return;
+    if(frame > c->newestFrame || c->newestFrame - frame >= ArrayCount(c->frames)) return;
+    
+    FrameRecord record = c->frames[frame % ArrayCount(c->frames)];
+    float msPerSample = ms / (record.scale * record.scale * record.samples);
+    if(record.firstFrames)
+    {
+        float prev = c->firstFramesMsPerSample;
+        c->firstFramesMsPerSample = prev > 0.0f ? prev + 0.25f * (msPerSample - prev) : msPerSample;
+    }
+    
+    // Frames of the previous accumulation would drag it towards their convergence
+    if(frame >= c->accumStartFrame)
+    {
+        float prev = c->msPerSample;
+        c->msPerSample = prev > 0.0f ? prev + 0.25f * (msPerSample - prev) : msPerSample;
+    }
+    
+    c->lastMeasuredFrame = frame;
+    c->measured = true;
+}
+
+// Samples per pixel for the next frame at the given scale. firstFrames is
+// true if no pixel of the accumulation could be converged yet
+uint32_t PickSamplesPerFrame(FrameBudgetController* c, float scale, bool firstFrames, float budgetMs)
+{
+    float msPerSample = firstFrames ? c->firstFramesMsPerSample : c->msPerSample;
+    if(msPerSample <= 0.0f) return SamplesPerFrame;
+    
+    float samples = budgetMs / (msPerSample * scale * scale);
+    return (uint32_t)Clamp(samples, 1.0f, (float)MaxSamplesPerFrame);
+}
+
+// The scale for the next frame while the camera moves, on each axis. The resolution
+// is only lowered if MinInteractiveSamples don't fit in the budget at native resolution.
+// It moves in steps, and only when the budget is off by more than one, so that it
+// doesn't change on every frame
+float PickRenderScale(FrameBudgetController* c, float curScale, float budgetMs)
+{
+    if(c->firstFramesMsPerSample <= 0.0f) return curScale;
+    
+    float scale = Clamp(sqrtf(budgetMs / (c->firstFramesMsPerSample * MinInteractiveSamples)), MinRenderScale, 1.0f);
+    if(fabsf(scale - curScale) < RenderScaleStep) return curScale;
+    return Max(floorf(scale / RenderScaleStep) * RenderScaleStep, MinRenderScale);
+}
+
+// The CPU backend accumulates in its own buffer, which has the same
+// layout as pingPongTex, so it can be presented the same way
+void UploadCpuFrame(RenderState* state, CpuRenderer* cpu)
+{
+    glBindTexture(GL_TEXTURE_2D, state->pingPongTex[1]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cpu->width, cpu->height, GL_RGB, GL_FLOAT, cpu->accum);
+    glBindTexture(GL_TEXTURE_2D, state->pingPongMoments[1]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cpu->width, cpu->height, GL_RGBA, GL_FLOAT, cpu->moments);
+}
+
+void SwapPingPongBuffers(RenderState* state)
+{
+    uint32_t tmp = state->pingPongFbo[0];
+    state->pingPongFbo[0] = state->pingPongFbo[1];
+    state->pingPongFbo[1] = tmp;
+    tmp = state->pingPongTex[0];
+    state->pingPongTex[0] = state->pingPongTex[1];
+    state->pingPongTex[1] = tmp;
+    tmp = state->pingPongMoments[0];
+    state->pingPongMoments[0] = state->pingPongMoments[1];
+    state->pingPongMoments[1] = tmp;
+}
+
+// Reads back the accumulated image (pingPongTex[0]) as RGB, divided by
+// the sample count in alpha. Waits for the rendering to finish
+void ReadAccumulation(RenderState* state, float* rgb, int width, int height)
+{
+    float* rgba = malloc(sizeof(float) * 4 * width * height);
+    glBindTexture(GL_TEXTURE_2D, state->pingPongTex[0]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, rgba);
+    for(int i = 0; i < width * height; ++i)
+    {
+        float count = fmaxf(rgba[i*4+3], 1.0f);
+        for(int c = 0; c < 3; ++c)
+            rgb[i*3+c] = rgba[i*4+c] / count;
+    }
+    
+    free(rgba);
+}
+
+// Feeds synthetic frame estimates with a known variance to the accumulation of the
+// moments, with the given samples per frame (repeated), and returns the average estimated
+// squared standard error of the pixels over the true one, which should be about 1
+float CheckConvergenceEstimator(const uint32_t* frameSamples, int numPatternFrames, int numFrames)
+{
+    const int numPixels = 20000;
+    const float sampleStdDev = 0.1f;
+    const float threshold = 0.01f;
+    
+    uint32_t rng = 1234;
+    double sumRatio = 0.0;
+    for(int i = 0; i < numPixels; ++i)
+    {
+        float moments[4] = {0};
+        uint32_t totalSamples = 0;
+        for(int j = 0; j < numFrames; ++j)
+        {
+            uint32_t samples = frameSamples[j % numPatternFrames];
+            
+            // Normally distributed mean of the frame's samples (Box-Muller)
+            rng = rng * 1664525u + 1013904223u;
+            float u1 = ((rng >> 8) + 1.0f) / 16777217.0f;
+            rng = rng * 1664525u + 1013904223u;
+            float u2 = (rng >> 8) / 16777216.0f;
+            float gaussian = sqrtf(-2.0f * logf(u1)) * cosf(2.0f * Pi * u2);
+            float lum = 0.5f + gaussian * sampleStdDev / sqrtf((float)samples);
+            
+            AccumulateMoments(moments, lum, samples);
+            totalSamples += samples;
+        }
+        
+        float error = ConvergenceRatio(moments, threshold) * threshold;
+        float trueError2 = sampleStdDev * sampleStdDev / totalSamples;
+        sumRatio += error * error / trueError2;
+    }
+    
+    return (float)(sumRatio / numPixels);
+}
+
+// Renders all built-in scenes with both backends and compares the
+// tonemapped results. Returns 0 if all scenes are within the tolerance.
+int RunParityCheck(RenderState* state, CpuRenderer* cpu)
+{
+    const int width  = 96;
+    const int height = 72;
+    const uint32_t numFrames = 32;
+    const float maxRmse = 0.05f;
+    
+    // Interactive runs change the samples of every frame (see FrameBudgetController),
+    // which neither the convergence estimate nor the backends may depend on
+    const uint32_t frameSamples[] = { 6, 54 };
+    
+    int res = 0;
+    printf("\nConvergence estimator check (estimated over true squared standard error)\n");
+    const uint32_t patterns[][2] = { {30, 30}, {1, 64}, {64, 1} };
+    for(int i = 0; i < ArrayCount(patterns); ++i)
+    {
+        float ratio = CheckConvergenceEstimator(patterns[i], 2, 32);
+        bool passed = fabsf(ratio - 1.0f) <= 0.1f;
+        if(!passed) res = 1;
+        printf("%u/%u samples per frame: %f %s\n", patterns[i][0], patterns[i][1], ratio, passed ? "(ok)" : "(FAILED)");
+    }
+    
+    ResizeFramebuffers(state, width, height);
+    float* gpuPixels = malloc(sizeof(float) * 3 * width * height);
+    
+    printf("\nBackend parity check (%dx%d, %d frames of %u/%u samples)\n", width, height, numFrames, frameSamples[0], frameSamples[1]);
+    
+    for(uint32_t scene = 1; scene <= 4; ++scene)
+    {
+        FrameParams params = {0};
+        params.width  = width;
+        params.height = height;
+        params.camPos.z = -10.0f;
+        params.scene  = scene;
+        params.useNee = true;
+        params.useEnvSampling = true;
+        params.useRayCones = true;
+        params.minBounces = DefaultMinBounces;
+        params.maxBounces = DefaultMaxBounces;
+        params.adaptiveSampling = true;
+        params.convergenceThreshold = DefaultConvergenceThreshold;
+        
+        for(uint32_t i = 0; i < numFrames; ++i)
+        {
+            params.frameId = i;
+            params.numSamples = frameSamples[i % 2];
+            RenderPathTracerGpu(state, &params);
+            SwapPingPongBuffers(state);
+            CpuRenderFrame(cpu, &params);
+            params.accumSamples += params.numSamples;
+        }
+        
+        ReadAccumulation(state, gpuPixels, width, height);
+        
+        float rmse = TonemappedRmse(gpuPixels, cpu->accum, width * height);
+        bool passed = rmse <= maxRmse;
+        if(!passed) res = 1;
+        printf("Scene %d: RMSE %f %s\n", scene, rmse, passed ? "(ok)" : "(FAILED)");
+    }
+    
+    free(gpuPixels);
+    return res;
+}
+
+// Renders generated scenes of increasing size with and without the BVH,
+// and prints the average frame time for each. Overwrites scene 0.
+int RunBvhBenchmark(RenderState* state)
+{
+    const int width  = 256;
+    const int height = 256;
+    const int numFrames = 4;
+    const int objectCounts[] = {10, 100, 1000, 10000, 100000};
+    const int maxBruteForceObjects = 1000;  // Beyond this, frames take long enough to trip driver timeouts
+    
+    ResizeFramebuffers(state, width, height);
+    
+    printf("\nBVH benchmark (%dx%d, %d frames per run)\n", width, height, numFrames);
+    printf("%10s %10s %12s %14s %14s\n", "objects", "nodes", "build (ms)", "bvh (ms/f)", "linear (ms/f)");
+    
+    for(int i = 0; i < ArrayCount(objectCounts); ++i)
+    {
+        Scene* scene = &scenes[0];
+        float extent = GenerateRandomScene(scene, objectCounts[i], 1234);
+        
+        double buildStart = GetTimeSeconds();
+        BuildSceneBvh(scene);
+        double buildTime = GetTimeSeconds() - buildStart;
+        
+        DeleteSceneBuffers(&state->sceneBuffers[0]);
+        UploadScene(&state->sceneBuffers[0], scene);
+        
+        FrameParams params = {0};
+        params.width  = width;
+        params.height = height;
+        params.camPos.z = -extent - 4.0f;
+        params.scene  = 0;
+        params.numSamples = SamplesPerFrame;
+        params.useNee = true;
+        params.useEnvSampling = true;
+        params.useRayCones = true;
+        params.minBounces = DefaultMinBounces;
+        params.maxBounces = DefaultMaxBounces;
+        params.convergenceThreshold = DefaultConvergenceThreshold;
+        
+        double frameTimes[2] = {-1.0, -1.0};  // BVH, linear
+        for(int linear = 0; linear < 2; ++linear)
+        {
+            if(linear && objectCounts[i] > maxBruteForceObjects) continue;
+            
+            state->disableBvh = linear;
+            
+            // Warm up
+            RenderPathTracerGpu(state, &params);
+            SwapPingPongBuffers(state);
+            glFinish();
+            
+            double start = GetTimeSeconds();
+            for(int j = 0; j < numFrames; ++j)
+            {
+                params.frameId = j;
+                params.accumSamples = j * SamplesPerFrame;
+                RenderPathTracerGpu(state, &params);
+                SwapPingPongBuffers(state);
+            }
+            glFinish();
+            frameTimes[linear] = (GetTimeSeconds() - start) * 1000.0 / numFrames;
+        }
+        
+        state->disableBvh = false;
+        
+        char linearStr[32] = "-";
+        if(frameTimes[1] >= 0.0) snprintf(linearStr, sizeof(linearStr), "%.2f", frameTimes[1]);
+        printf("%10d %10d %12.2f %14.2f %14s\n", objectCounts[i], scene->bvh.numNodes,
+               buildTime * 1000.0, frameTimes[0], linearStr);
+    }
+    
+    return 0;
+}
+
+// Accumulates exactly options->spp samples per pixel offscreen, then writes the
+// result to options->outPath. There is no presentation, so the time it
+// takes is only bound by rendering.
+int RunHeadless(RenderState* state, CpuRenderer* cpu, Options* options)
+{
+    const int width  = options->width;
+    const int height = options->height;
+    
+    FrameParams params = {0};
+    params.width  = width;
+    params.height = height;
+    params.camPos.z = -10.0f;
+    params.scene  = options->scene >= 0 ? options->scene : (options->sceneFile ? 0 : 1);
+    params.useNee = !options->disableNee;
+    params.useEnvSampling = !options->disableEnvSampling;
+    params.useRayCones = !options->disableRayCones;
+    params.minBounces = options->minBounces;
+    params.maxBounces = options->maxBounces;
+    params.adaptiveSampling = !options->disableAdaptive;
+    params.convergenceThreshold = options->convergenceThreshold;
+    params.sampler = options->sampler;
+    
+    if(!scenes[params.scene].loaded)
+        fprintf(stderr, "Warning: scene %d is not loaded, the result will be empty\n", params.scene);
+    
+    bool useCpu = options->backend == Backend_Cpu;
+    if(!useCpu) ResizeFramebuffers(state, width, height);
+    
+    printf("Rendering scene %d at %dx%d, %d samples per pixel (%s backend)\n",
+           params.scene, width, height, options->spp, useCpu ? "CPU" : (state->useWavefront ? "GPU wavefront" : "GPU"));
+    
+    // Full frames first, the last one traces whatever is left
+    double start = GetTimeSeconds();
+    uint32_t numFrames = 0;
+    while(params.accumSamples < (uint32_t)options->spp)
+    {
+        params.frameId = numFrames;
+        params.numSamples = Min(SamplesPerFrame, options->spp - params.accumSamples);
+        
+        if(useCpu)
+        {
+            MakeSceneResident(state, params.scene);
+            CpuRenderFrame(cpu, &params);
+        }
+        else
+        {
+            RenderPathTracerGpu(state, &params);
+            SwapPingPongBuffers(state);
+        }
+        
+        params.accumSamples += params.numSamples;
+        ++numFrames;
+    }
+    
+    float* pixels = NULL;
+    if(useCpu)
+        pixels = cpu->accum;
+    else
+    {
+        pixels = malloc(sizeof(float) * 3 * width * height);
+        ReadAccumulation(state, pixels, width, height);  // Waits for the rendering to finish
+    }
+    
+    double elapsed = GetTimeSeconds() - start;
+    printf("Rendered %d frames in %.3fs (%.2f ms/frame, %.0f samples/s)\n", numFrames, elapsed,
+           elapsed * 1000.0 / numFrames, (double)width * height * options->spp / elapsed);
+    
+    bool ok = WriteImage(options->outPath, pixels, width, height, exposure);
+    if(ok)
+        printf("Wrote %s\n", options->outPath);
+    else
+        fprintf(stderr, "Could not write %s\n", options->outPath);
+    
+    if(!useCpu) free(pixels);
+    return ok ? 0 : 1;
+}
+
+// Fixed camera poses used by --bench, so that timings don't depend on where the camera is
+struct
+{
+    uint32_t scene;
+    const char* name;
+    Vec3 camPos;
+    Vec2 camRot;
+} typedef BenchPose;
+
+static const BenchPose benchPoses[] =
+{
+    {1, "front", {0.0f, 0.0f, -10.0f}, {0.0f, 0.0f}},
+    {1, "close", {2.5f, 1.5f, -3.5f},  {-0.559f, 0.308f}},
+    {2, "front", {0.0f, 0.0f, -10.0f}, {0.0f, 0.0f}},
+    {2, "close", {2.5f, 1.5f, -3.5f},  {-0.559f, 0.308f}},
+    {3, "front", {0.0f, 0.0f, -10.0f}, {0.0f, 0.0f}},
+    {3, "close", {2.5f, 1.5f, -3.5f},  {-0.559f, 0.308f}},
+    {4, "front", {0.0f, 0.0f, -10.0f}, {0.0f, 0.0f}},
+    {4, "close", {2.5f, 1.5f, -3.5f},  {-0.559f, 0.308f}},
+};
+
+#define BenchWidth  128
+#define BenchHeight 96
+#define BenchReferenceSamples 4096
+#define BenchReferenceFrames ((BenchReferenceSamples + SamplesPerFrame - 1) / SamplesPerFrame)
+
+struct
+{
+    double msPerFrame;
+    double samplesPerSec;
+    double raysPerSec;
+    double raysPerSample;
+    float rmse;  // Negative if there is no reference
+} typedef BenchResult;
+
+// Accumulates numFrames frames of the pose into the current backend's buffer. frameId
+// always starts from 0, so the noise (and the result) is the same on every run.
+// Returns the time taken, not counting the warmup frame.
+double RenderBenchPose(RenderState* state, CpuRenderer* cpu, bool useCpu, FrameParams* params, int numFrames)
+{
+    // Warm up (shader compilation on first use, image loading, caches)
+    params->frameId = 0;
+    params->accumSamples = 0;
+    MakeSceneResident(state, params->scene);
+    if(useCpu)
+        CpuRenderFrame(cpu, params);
+    else
+    {
+        RenderPathTracerGpu(state, params);
+        SwapPingPongBuffers(state);
+        glFinish();
+    }
+    
+    double start = GetTimeSeconds();
+    for(int i = 0; i < numFrames; ++i)
+    {
+        params->frameId = i;
+        params->accumSamples = i * params->numSamples;
+        if(useCpu)
+            CpuRenderFrame(cpu, params);
+        else
+        {
+            RenderPathTracerGpu(state, params);
+            SwapPingPongBuffers(state);
+        }
+    }
+    
+    if(!useCpu) glFinish();
+    return GetTimeSeconds() - start;
+}
+
+// Name of the --texture-compression mode, which is set by the format of the env maps
+const char* TextureCompressionName(ImageFormat envFormat)
+{
+    switch(envFormat)
+    {
+        case ImageFormat_Rgb16f: return "rgb16f";
+        case ImageFormat_Rgb9e5: return "rgb9e5";
+        case ImageFormat_Bc6h:   return "bptc";
+        default:                 return "none";
+    }
+}
+
+void PrintBenchJson(FILE* f, RenderState* state, Options* options, BenchResult* results)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"backend\": \"%s\",\n", options->backend == Backend_Cpu ? "cpu" : "gpu");
+    fprintf(f, "  \"renderer\": \"%s\",\n", options->backend == Backend_Cpu ? "cpu" : (const char*)glGetString(GL_RENDERER));
+    fprintf(f, "  \"wavefront\": %s,\n", options->backend != Backend_Cpu && state->useWavefront ? "true" : "false");
+    fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n", BenchWidth, BenchHeight);
+    fprintf(f, "  \"frames\": %d,\n  \"samplesPerFrame\": %d,\n", options->benchFrames, SamplesPerFrame);
+    fprintf(f, "  \"minBounces\": %d,\n  \"maxBounces\": %d,\n", options->minBounces, options->maxBounces);
+    fprintf(f, "  \"adaptive\": %s,\n", options->disableAdaptive ? "false" : "true");
+    fprintf(f, "  \"rayCones\": %s,\n", options->disableRayCones ? "false" : "true");
+    fprintf(f, "  \"envLayout\": \"%s\",\n", options->equirectEnvMaps ? "equirect" : "octahedral");
+    fprintf(f, "  \"textureCompression\": \"%s\",\n", TextureCompressionName(options->envFormat));
+    fprintf(f, "  \"sampler\": \"%s\",\n", options->sampler == Sampler_Pcg ? "pcg" : "sobol");
+    fprintf(f, "  \"poses\": [\n");
+    for(int i = 0; i < ArrayCount(benchPoses); ++i)
+    {
+        BenchResult* r = &results[i];
+        fprintf(f, "    {\"scene\": %d, \"pose\": \"%s\", \"msPerFrame\": %.3f, \"samplesPerSec\": %.0f, \"raysPerSec\": %.0f, \"rmse\": ",
+                benchPoses[i].scene, benchPoses[i].name, r->msPerFrame, r->samplesPerSec, r->raysPerSec);
+        if(r->rmse >= 0.0f) fprintf(f, "%.6f}", r->rmse);
+        else                fprintf(f, "null}");
+        fprintf(f, "%s\n", i + 1 < ArrayCount(benchPoses) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// Options that change the converged image. Written next to the references when they are
+// rendered, so that --bench can tell when they no longer match its configuration
+void FormatBenchReferenceConfig(char* buf, size_t size, Options* options)
+{
+    snprintf(buf, size, "{\n  \"samples\": %d,\n  \"rayCones\": %s,\n  \"envLayout\": \"%s\",\n  \"textureCompression\": \"%s\",\n"
+                        "  \"minBounces\": %d,\n  \"maxBounces\": %d\n}\n",
+             BenchReferenceFrames * SamplesPerFrame, options->disableRayCones ? "false" : "true",
+             options->equirectEnvMaps ? "equirect" : "octahedral", TextureCompressionName(options->envFormat),
+             options->minBounces, options->maxBounces);
+}
+
+// Renders every pose in benchPoses with a fixed seed and reports ms/frame, samples/s,
+// rays/s and the RMSE against the stored reference. The GPU can't count its rays,
+// so they are counted by the CPU backend on the first frame of the same pose (it
+// traces the same paths) and scaled by the GPU's sample rate.
+int RunBenchmark(RenderState* state, CpuRenderer* cpu, Options* options)
+{
+    const int width  = BenchWidth;
+    const int height = BenchHeight;
+    const int numFrames = options->benchUpdateReference ? BenchReferenceFrames : options->benchFrames;
+    bool useCpu = options->backend == Backend_Cpu;
+    const char* backendName = useCpu ? "CPU" : (state->useWavefront ? "GPU wavefront" : "GPU");
+    
+    if(!useCpu) ResizeFramebuffers(state, width, height);
+    float* pixels = malloc(sizeof(float) * 3 * width * height);
+    BenchResult results[ArrayCount(benchPoses)] = {0};
+    
+    char configPath[512];
+    char config[512];
+    snprintf(configPath, sizeof(configPath), "%sreference.json", benchPath);
+    FormatBenchReferenceConfig(config, sizeof(config), options);
+    
+    int res = 0;
+    if(options->benchUpdateReference)
+    {
+        printf("\nRendering benchmark references (%dx%d, %d samples per pixel, %s backend)\n", width, height, numFrames * SamplesPerFrame, backendName);
+        FILE* f = fopen(configPath, "wb");
+        if(f)
+        {
+            fputs(config, f);
+            fclose(f);
+        }
+        else
+        {
+            fprintf(stderr, "Could not write %s\n", configPath);
+            res = 1;
+        }
+    }
+    else
+    {
+        char* refConfig = LoadEntireFile(configPath);
+        if(strcmp(refConfig, config) != 0)
+            printf("\nWarning: the references were rendered with other options (see %s), the RMSE includes the difference\n", configPath);
+        free(refConfig);
+        
+        printf("\nBenchmark (%dx%d, %d frames of %d samples, %s backend)\n", width, height, numFrames, SamplesPerFrame, backendName);
+        printf("%6s %6s %10s %14s %14s %10s\n", "scene", "pose", "ms/frame", "Msamples/s", "Mrays/s", "RMSE");
+    }
+    
+    for(int i = 0; i < ArrayCount(benchPoses); ++i)
+    {
+        const BenchPose* pose = &benchPoses[i];
+        BenchResult* result = &results[i];
+        
+        FrameParams params = {0};
+        params.width  = width;
+        params.height = height;
+        params.camPos = pose->camPos;
+        params.camRot = pose->camRot;
+        params.scene  = pose->scene;
+        params.numSamples = SamplesPerFrame;
+        params.useNee = !options->disableNee;
+        params.useEnvSampling = !options->disableEnvSampling;
+        params.useRayCones = !options->disableRayCones;
+        params.minBounces = options->minBounces;
+        params.maxBounces = options->maxBounces;
+        params.adaptiveSampling = !options->disableAdaptive;
+        params.convergenceThreshold = options->convergenceThreshold;
+        params.sampler = options->sampler;
+        
+        char refPath[512];
+        snprintf(refPath, sizeof(refPath), "%sscene%d_%s.pfm", benchPath, pose->scene, pose->name);
+        
+        // Count the rays of the first frame on the CPU
+        MakeSceneResident(state, params.scene);
+        cpu->numRays = 0;
+        params.frameId = 0;
+        params.accumSamples = 0;
+        if(!options->benchUpdateReference)
+        {
+            CpuRenderFrame(cpu, &params);
+            result->raysPerSample = (double)cpu->numRays / ((double)width * height * SamplesPerFrame);
+        }
+        
+        double elapsed = RenderBenchPose(state, cpu, useCpu, &params, numFrames);
+        
+        if(useCpu)
+            memcpy(pixels, cpu->accum, sizeof(float) * 3 * width * height);
+        else
+            ReadAccumulation(state, pixels, width, height);
+        
+        if(options->benchUpdateReference)
+        {
+            bool ok = WritePfm(refPath, pixels, width, height);
+            printf("%s %s (%.1fs)\n", ok ? "Wrote" : "Could not write", refPath, elapsed);
+            if(!ok) res = 1;
+            continue;
+        }
+        
+        result->msPerFrame = elapsed * 1000.0 / numFrames;
+        result->samplesPerSec = (double)width * height * SamplesPerFrame * numFrames / elapsed;
+        result->raysPerSec = result->samplesPerSec * result->raysPerSample;
+        result->rmse = -1.0f;
+        
+        int refWidth, refHeight;
+        float* ref = ReadPfm(refPath, &refWidth, &refHeight);
+        if(ref && refWidth == width && refHeight == height)
+            result->rmse = TonemappedRmse(pixels, ref, width * height);
+        free(ref);
+        
+        char rmseStr[32] = "-";
+        if(result->rmse >= 0.0f) snprintf(rmseStr, sizeof(rmseStr), "%.5f", result->rmse);
+        printf("%6d %6s %10.2f %14.3f %14.3f %10s\n", pose->scene, pose->name, result->msPerFrame,
+               result->samplesPerSec * 1e-6, result->raysPerSec * 1e-6, rmseStr);
+    }
+    
+    if(!options->benchUpdateReference)
+    {
+        if(options->benchJsonPath)
+        {
+            FILE* f = fopen(options->benchJsonPath, "w");
+            if(f)
+            {
+                PrintBenchJson(f, state, options, results);
+                fclose(f);
+                printf("Wrote %s\n", options->benchJsonPath);
+            }
+            else
+            {
+                fprintf(stderr, "Could not write %s\n", options->benchJsonPath);
+                res = 1;
+            }
+        }
+        else
+        {
+            printf("\n");
+            PrintBenchJson(stdout, state, options, results);
+        }
+    }
+    
+    free(pixels);
+    return res;
+}
+
+Options ParseCommandLine(int argc, char** argv)
+{
+    Options res = {0};
+    res.backend = Backend_Gpu;
+    res.scene = -1;
+    res.width = 800;
+    res.height = 600;
+    res.spp = 1024;
+    res.outPath = "render.ppm";
+    res.benchFrames = 16;
+    res.minBounces = DefaultMinBounces;
+    res.maxBounces = DefaultMaxBounces;
+    res.convergenceThreshold = DefaultConvergenceThreshold;
+    res.sampler = Sampler_Sobol;
+    res.envFormat = ImageFormat_Rgb32f;
+    res.frameBudgetMs = DefaultFrameBudgetMs;
+    res.convergeBudgetMs = DefaultConvergeBudgetMs;
+    res.texFormat = ImageFormat_Rgba8;
+    
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--backend=cpu") == 0)
+            res.backend = Backend_Cpu;
+        else if(strcmp(argv[i], "--backend=gpu") == 0)
+            res.backend = Backend_Gpu;
+        else if(strcmp(argv[i], "--sampler=sobol") == 0)
+            res.sampler = Sampler_Sobol;
+        else if(strcmp(argv[i], "--sampler=pcg") == 0)
+            res.sampler = Sampler_Pcg;
+        else if(strcmp(argv[i], "--wavefront") == 0)
+            res.wavefront = true;
+        else if(strcmp(argv[i], "--no-program-cache") == 0)
+            res.disableProgramCache = true;
+        else if(strcmp(argv[i], "--no-asset-cache") == 0)
+            res.disableAssetCache = true;
+        else if(strcmp(argv[i], "--build-asset-cache") == 0)
+            res.buildAssetCache = true;
+        else if(strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc)
+        {
+            res.textureBudgetMb = atoi(argv[++i]);
+            if(res.textureBudgetMb < 0) res.textureBudgetMb = 0;
+        }
+        else if(strcmp(argv[i], "--texture-compression") == 0 && i + 1 < argc)
+        {
+            const char* mode = argv[++i];
+            if(strcmp(mode, "none") == 0 || strcmp(mode, "rgb16f") == 0 || strcmp(mode, "rgb9e5") == 0)
+            {
+                res.envFormat = mode[0] == 'n' ? ImageFormat_Rgb32f : mode[3] == '1' ? ImageFormat_Rgb16f : ImageFormat_Rgb9e5;
+                res.texFormat = ImageFormat_Rgba8;
+            }
+            else if(strcmp(mode, "bptc") == 0)
+            {
+                res.envFormat = ImageFormat_Bc6h;
+                res.texFormat = ImageFormat_Bc7;
+            }
+            else
+                fprintf(stderr, "Unknown texture compression '%s' (none, rgb16f, rgb9e5 or bptc)\n", mode);
+        }
+        else if(strcmp(argv[i], "--env-layout") == 0 && i + 1 < argc)
+        {
+            const char* layout = argv[++i];
+            if(strcmp(layout, "octahedral") == 0 || strcmp(layout, "equirect") == 0)
+                res.equirectEnvMaps = layout[0] == 'e';
+            else
+                fprintf(stderr, "Unknown env map layout '%s' (octahedral or equirect)\n", layout);
+        }
+        else if(strcmp(argv[i], "--parity-check") == 0)
+            res.parityCheck = true;
+        else if(strcmp(argv[i], "--no-nee") == 0)
+            res.disableNee = true;
+        else if(strcmp(argv[i], "--no-env-sampling") == 0)
+            res.disableEnvSampling = true;
+        else if(strcmp(argv[i], "--no-ray-cones") == 0)
+            res.disableRayCones = true;
+        else if(strcmp(argv[i], "--no-image-accumulation") == 0)
+            res.disableImageAccumulation = true;
+        else if(strcmp(argv[i], "--no-reprojection") == 0)
+            res.disableReprojection = true;
+        else if(strcmp(argv[i], "--no-dynamic-resolution") == 0)
+            res.disableDynamicResolution = true;
+        else if(strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc)
+            res.frameBudgetMs = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "--converge-budget") == 0 && i + 1 < argc)
+            res.convergeBudgetMs = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "--min-bounces") == 0 && i + 1 < argc)
+            res.minBounces = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--max-bounces") == 0 && i + 1 < argc)
+            res.maxBounces = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--no-adaptive") == 0)
+            res.disableAdaptive = true;
+        else if(strcmp(argv[i], "--convergence-threshold") == 0 && i + 1 < argc)
+            res.convergenceThreshold = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "--bench-bvh") == 0)
+            res.benchBvh = true;
+        else if(strcmp(argv[i], "--bench") == 0)
+            res.bench = true;
+        else if(strcmp(argv[i], "--bench-update-reference") == 0)
+            res.bench = res.benchUpdateReference = true;
+        else if(strcmp(argv[i], "--bench-frames") == 0 && i + 1 < argc)
+        {
+            res.benchFrames = atoi(argv[++i]);
+            if(res.benchFrames <= 0) res.benchFrames = 1;
+        }
+        else if(strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc)
+            res.benchJsonPath = argv[++i];
+        else if(strcmp(argv[i], "--gpu-timers") == 0)
+            res.gpuTimers = true;
+        else if(strcmp(argv[i], "--gpu-timers-csv") == 0 && i + 1 < argc)
+            res.gpuTimersCsvPath = argv[++i];
+        else if(strcmp(argv[i], "--scene-file") == 0 && i + 1 < argc)
+            res.sceneFile = argv[++i];
+        else if(strcmp(argv[i], "--headless") == 0)
+            res.headless = true;
+        else if(strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+        {
+            res.scene = atoi(argv[++i]);
+            if(res.scene < 0 || res.scene >= MaxScenes)
+            {
+                fprintf(stderr, "Scene index must be between 0 and %d\n", MaxScenes - 1);
+                res.scene = -1;
+            }
+        }
+        else if(strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            int width, height;
+            if(sscanf(argv[++i], "%dx%d", &width, &height) == 2 && width > 0 && height > 0)
+            {
+                res.width = width;
+                res.height = height;
+            }
+            else
+                fprintf(stderr, "Invalid size: %s (expected WxH)\n", argv[i]);
+        }
+        else if(strcmp(argv[i], "--spp") == 0 && i + 1 < argc)
+        {
+            res.spp = atoi(argv[++i]);
+            if(res.spp <= 0) res.spp = 1;
+        }
+        else if(strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            res.outPath = argv[++i];
+        else
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+    }
+    
+    if(res.maxBounces < 1) res.maxBounces = 1;
+    if(res.minBounces < 0) res.minBounces = 0;
+    if(res.minBounces > res.maxBounces) res.minBounces = res.maxBounces;
+    if(res.frameBudgetMs <= 0.0f) res.frameBudgetMs = DefaultFrameBudgetMs;
+    if(res.convergeBudgetMs <= 0.0f) res.convergeBudgetMs = DefaultConvergeBudgetMs;
+    
+    return res;
 }
 
 void FirstPersonCamera(Vec3* camPos, Vec2* camRot, float deltaTime)
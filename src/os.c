@@ -0,0 +1,602 @@
+// Small platform layer: timing, files, threads and a simple job system.
+// Only what the renderer needs, implemented for Win32 and POSIX.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <errno.h>
+#endif
+
+#include "stdlib.h"
+
+#ifdef _WIN32
+#define ThreadLocal __declspec(thread)
+#else
+#define ThreadLocal __thread
+#endif
+
+/////////////////////////////////
+// Timing
+
+double GetTimeSeconds()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq = {0};
+    if(freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#endif
+}
+
+int GetNumCores()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long res = sysconf(_SC_NPROCESSORS_ONLN);
+    return res > 0 ? (int)res : 1;
+#endif
+}
+
+/////////////////////////////////
+// Files
+
+// Returns true if the directory exists afterwards
+bool MakeDirectory(const char* path)
+{
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    struct stat st;
+    return mkdir(path, 0755) == 0 || (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+#endif
+}
+
+// Returns false if the file doesn't exist
+bool GetFileInfo(const char* path, int64_t* mtime, int64_t* size)
+{
+    struct stat st;
+    if(stat(path, &st) != 0) return false;
+    *mtime = (int64_t)st.st_mtime;
+    *size = (int64_t)st.st_size;
+    return true;
+}
+
+// Replaces 'to' if it exists. Used to publish files written under a temporary name
+bool RenameFile(const char* from, const char* to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+// Sets the modification time of a file to now
+bool TouchFile(const char* path)
+{
+#ifdef _WIN32
+    return _utime(path, NULL) == 0;
+#else
+    return utime(path, NULL) == 0;
+#endif
+}
+
+typedef void (*ListFilesFunc)(void* userData, const char* name);
+
+// Calls func with the name of every entry of the directory except the hidden ones,
+// not recursively. The path ends with a slash. Returns false if it can't be read
+bool ListFiles(const char* dir, ListFilesFunc func, void* userData)
+{
+#ifdef _WIN32
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s*", dir);
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(pattern, &data);
+    if(find == INVALID_HANDLE_VALUE) return false;
+    
+    do
+    {
+        if(data.cFileName[0] != '.') func(userData, data.cFileName);
+    }
+    while(FindNextFileA(find, &data));
+    
+    FindClose(find);
+    return true;
+#else
+    DIR* d = opendir(dir);
+    if(!d) return false;
+    
+    struct dirent* entry;
+    while((entry = readdir(d)))
+    {
+        if(entry->d_name[0] != '.') func(userData, entry->d_name);
+    }
+    
+    closedir(d);
+    return true;
+#endif
+}
+
+// Read-only view of a whole file
+struct
+{
+    void* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} typedef MappedFile;
+
+bool MapFile(const char* path, MappedFile* res)
+{
+    memset(res, 0, sizeof(MappedFile));
+#ifdef _WIN32
+    res->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(res->file == INVALID_HANDLE_VALUE) return false;
+    
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(res->file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(res->file);
+        return false;
+    }
+    
+    res->mapping = CreateFileMappingA(res->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    res->data = res->mapping ? MapViewOfFile(res->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if(!res->data)
+    {
+        if(res->mapping) CloseHandle(res->mapping);
+        CloseHandle(res->file);
+        return false;
+    }
+    res->size = (size_t)size.QuadPart;
+    return true;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    
+    // The mapping stays valid after the descriptor is closed
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return false;
+    res->data = data;
+    res->size = (size_t)st.st_size;
+    return true;
+#endif
+}
+
+void UnmapFile(MappedFile* file)
+{
+    if(!file->data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+    CloseHandle(file->file);
+#else
+    munmap(file->data, file->size);
+#endif
+    memset(file, 0, sizeof(MappedFile));
+}
+
+// Watches a file for modifications, without blocking. On Linux this is an inotify watch
+// on the file's directory, so it also catches editors that save by renaming a new file
+// over the old one. Elsewhere the modification time is polled.
+struct
+{
+    char dir[256];
+    const char* name;  // Points into the path passed to InitFileWatch
+#ifdef __linux__
+    int fd;
+#else
+    const char* path;
+    time_t mtime;
+#endif
+} typedef FileWatch;
+
+#ifndef __linux__
+time_t GetFileModTime(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_mtime : 0;
+}
+#endif
+
+// Returns false if the file can't be watched
+bool InitFileWatch(FileWatch* watch, const char* path)
+{
+    memset(watch, 0, sizeof(FileWatch));
+    const char* slash = strrchr(path, '/');
+    watch->name = slash ? slash + 1 : path;
+    int dirLen = slash ? (int)(slash - path) : 1;
+    snprintf(watch->dir, sizeof(watch->dir), "%.*s", dirLen, slash ? path : ".");
+    
+#ifdef __linux__
+    watch->fd = inotify_init1(IN_NONBLOCK);
+    if(watch->fd < 0) return false;
+    if(inotify_add_watch(watch->fd, watch->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(watch->fd);
+        watch->fd = -1;
+        return false;
+    }
+    return true;
+#else
+    watch->path = path;
+    watch->mtime = GetFileModTime(path);
+    return true;
+#endif
+}
+
+// True if the file was written since the last call. Consumes all pending events,
+// so a save that touches the file several times is only reported once
+bool FileWatchChanged(FileWatch* watch)
+{
+#ifdef __linux__
+    if(watch->fd < 0) return false;
+    
+    bool changed = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;)
+    {
+        ssize_t len = read(watch->fd, buf, sizeof(buf));
+        if(len <= 0) break;
+        
+        for(char* ptr = buf; ptr < buf + len; )
+        {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            if(event->len > 0 && strcmp(event->name, watch->name) == 0)
+                changed = true;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    
+    return changed;
+#else
+    time_t mtime = GetFileModTime(watch->path);
+    bool changed = mtime != watch->mtime;
+    watch->mtime = mtime;
+    return changed;
+#endif
+}
+
+void DestroyFileWatch(FileWatch* watch)
+{
+#ifdef __linux__
+    if(watch->fd >= 0) close(watch->fd);
+    watch->fd = -1;
+#endif
+}
+
+/////////////////////////////////
+// Atomics
+
+// Returns the value after the increment
+int32_t AtomicIncrement(volatile int32_t* value)
+{
+#ifdef _WIN32
+    return InterlockedIncrement((volatile LONG*)value);
+#else
+    return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Returns the value after the addition
+int64_t AtomicAdd64(volatile int64_t* value, int64_t add)
+{
+#ifdef _WIN32
+    return InterlockedAdd64((volatile LONG64*)value, add);
+#else
+    return __atomic_add_fetch(value, add, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/////////////////////////////////
+// Threads and synchronization
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE CondVar;
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t CondVar;
+#endif
+
+typedef void (*ThreadFunc)(void* userData);
+
+struct
+{
+    ThreadFunc func;
+    void* userData;
+} typedef ThreadStartInfo;
+
+#ifdef _WIN32
+DWORD WINAPI ThreadEntry(LPVOID param)
+{
+    ThreadStartInfo info = *(ThreadStartInfo*)param;
+    free(param);
+    info.func(info.userData);
+    return 0;
+}
+#else
+void* ThreadEntry(void* param)
+{
+    ThreadStartInfo info = *(ThreadStartInfo*)param;
+    free(param);
+    info.func(info.userData);
+    return NULL;
+}
+#endif
+
+Thread StartThread(ThreadFunc func, void* userData)
+{
+    ThreadStartInfo* info = malloc(sizeof(ThreadStartInfo));
+    info->func = func;
+    info->userData = userData;
+    
+    Thread res;
+#ifdef _WIN32
+    res = CreateThread(NULL, 0, ThreadEntry, info, 0, NULL);
+#else
+    pthread_create(&res, NULL, ThreadEntry, info);
+#endif
+    return res;
+}
+
+void JoinThread(Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void InitMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void LockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void UnlockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void InitCondVar(CondVar* cond)
+{
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+// The mutex must be locked by the caller
+void WaitCondVar(CondVar* cond, Mutex* mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void SignalCondVar(CondVar* cond)
+{
+#ifdef _WIN32
+    WakeConditionVariable(cond);
+#else
+    pthread_cond_signal(cond);
+#endif
+}
+
+void BroadcastCondVar(CondVar* cond)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+/////////////////////////////////
+// Job system
+
+typedef void (*JobFunc)(void* userData);
+
+struct
+{
+    JobFunc func;
+    void* userData;
+} typedef Job;
+
+#define MaxQueuedJobs 1024
+#define MaxWorkerThreads 64
+
+struct
+{
+    Thread threads[MaxWorkerThreads];
+    int numThreads;
+    
+    Mutex mutex;
+    CondVar jobAvailable;
+    CondVar allJobsDone;
+    
+    // Ring buffer of jobs waiting to be picked up
+    Job queue[MaxQueuedJobs];
+    int head;
+    int numQueued;
+    int numPending;  // Queued + currently running
+    
+    bool quit;
+} typedef ThreadPool;
+
+void WorkerThread(void* userData)
+{
+    ThreadPool* pool = (ThreadPool*)userData;
+    
+    LockMutex(&pool->mutex);
+    while(true)
+    {
+        while(pool->numQueued == 0 && !pool->quit)
+            WaitCondVar(&pool->jobAvailable, &pool->mutex);
+        
+        if(pool->quit) break;
+        
+        Job job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % MaxQueuedJobs;
+        --pool->numQueued;
+        
+        UnlockMutex(&pool->mutex);
+        job.func(job.userData);
+        LockMutex(&pool->mutex);
+        
+        --pool->numPending;
+        if(pool->numPending == 0)
+            BroadcastCondVar(&pool->allJobsDone);
+    }
+    UnlockMutex(&pool->mutex);
+}
+
+// Passing 0 threads uses one worker per core
+void InitThreadPool(ThreadPool* pool, int numThreads)
+{
+    if(numThreads <= 0) numThreads = GetNumCores();
+    if(numThreads > MaxWorkerThreads) numThreads = MaxWorkerThreads;
+    
+    InitMutex(&pool->mutex);
+    InitCondVar(&pool->jobAvailable);
+    InitCondVar(&pool->allJobsDone);
+    pool->head = 0;
+    pool->numQueued = 0;
+    pool->numPending = 0;
+    pool->quit = false;
+    
+    pool->numThreads = numThreads;
+    for(int i = 0; i < numThreads; ++i)
+        pool->threads[i] = StartThread(WorkerThread, pool);
+}
+
+void DestroyThreadPool(ThreadPool* pool)
+{
+    LockMutex(&pool->mutex);
+    pool->quit = true;
+    BroadcastCondVar(&pool->jobAvailable);
+    UnlockMutex(&pool->mutex);
+    
+    for(int i = 0; i < pool->numThreads; ++i)
+        JoinThread(pool->threads[i]);
+    
+    pool->numThreads = 0;
+}
+
+void PushJob(ThreadPool* pool, JobFunc func, void* userData)
+{
+    LockMutex(&pool->mutex);
+    assert(pool->numQueued < MaxQueuedJobs);
+    
+    int tail = (pool->head + pool->numQueued) % MaxQueuedJobs;
+    pool->queue[tail].func = func;
+    pool->queue[tail].userData = userData;
+    ++pool->numQueued;
+    ++pool->numPending;
+    
+    SignalCondVar(&pool->jobAvailable);
+    UnlockMutex(&pool->mutex);
+}
+
+void WaitForAllJobs(ThreadPool* pool)
+{
+    LockMutex(&pool->mutex);
+    while(pool->numPending > 0)
+        WaitCondVar(&pool->allJobsDone, &pool->mutex);
+    UnlockMutex(&pool->mutex);
+}
+
+// Parallel for: calls func(userData, i) for every i in [0, count),
+// distributing indices to the workers dynamically.
+typedef void (*ParallelForFunc)(void* userData, int idx);
+
+struct
+{
+    ParallelForFunc func;
+    void* userData;
+    int count;
+    volatile int32_t next;
+} typedef ParallelForState;
+
+void ParallelForWorker(void* userData)
+{
+    ParallelForState* state = (ParallelForState*)userData;
+    while(true)
+    {
+        int idx = AtomicIncrement(&state->next) - 1;
+        if(idx >= state->count) break;
+        state->func(state->userData, idx);
+    }
+}
+
+void ParallelFor(ThreadPool* pool, int count, ParallelForFunc func, void* userData)
+{
+    ParallelForState state = {0};
+    state.func = func;
+    state.userData = userData;
+    state.count = count;
+    state.next = 0;
+    
+    for(int i = 0; i < pool->numThreads; ++i)
+        PushJob(pool, ParallelForWorker, &state);
+    
+    WaitForAllJobs(pool);
+}
@@ -0,0 +1,234 @@
+// On-disk cache of linked GL programs, using glGetProgramBinary (GL 4.1 or
+// ARB_get_program_binary). Programs are keyed by a hash of their sources and of
+// the driver's vendor, renderer and version strings. Binaries are driver specific
+// and drivers can reject them (e.g. after an update that keeps the same strings),
+// so a cached program that fails to load is simply compiled again.
+// Every edit of a shader makes new keys, so the least recently used programs are
+// deleted when the folder grows past ProgramCacheMaxBytes.
+
+#define ProgramCacheMagic 0x42505253  // "SRPB"
+#define ProgramCacheMaxBytes (64ll << 20)
+
+struct
+{
+    uint32_t magic;
+    uint32_t format;  // binaryFormat from glGetProgramBinary
+    uint32_t length;
+} typedef ProgramCacheHeader;
+
+struct
+{
+    bool enabled;
+    const char* path;
+    
+    // Startup statistics
+    int numLoaded;
+    int numCompiled;
+    double seconds;  // Spent creating programs, loaded or compiled
+} typedef ProgramCache;
+
+static ProgramCache programCache = {0};
+
+// FNV-1a
+uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    
+    return hash;
+}
+
+uint64_t HashString(uint64_t hash, const char* str)
+{
+    // Include the terminator, so that ("ab", "c") and ("a", "bc") differ
+    return str ? HashBytes(hash, str, strlen(str) + 1) : hash;
+}
+
+// The cache is only used if the driver supports at least one binary format
+void InitProgramCache(const char* path, bool enabled)
+{
+    programCache.path = path;
+    programCache.enabled = false;
+    if(!enabled || !glGetProgramBinary || !glProgramBinary || !glProgramParameteri) return;
+    
+    int numFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+    programCache.enabled = numFormats > 0 && MakeDirectory(path);
+}
+
+uint64_t ProgramCacheKey(const char** sources, int numSources)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = HashString(hash, (const char*)glGetString(GL_VENDOR));
+    hash = HashString(hash, (const char*)glGetString(GL_RENDERER));
+    hash = HashString(hash, (const char*)glGetString(GL_VERSION));
+    for(int i = 0; i < numSources; ++i)
+        hash = HashString(hash, sources[i]);
+    
+    return hash;
+}
+
+void ProgramCacheFilePath(char* buf, size_t bufSize, uint64_t key)
+{
+    snprintf(buf, bufSize, "%s%016llx.bin", programCache.path, (unsigned long long)key);
+}
+
+// Returns a linked program, or 0 if it isn't in the cache (or the driver rejects it)
+uint32_t LoadCachedProgram(uint64_t key)
+{
+    if(!programCache.enabled) return 0;
+    
+    char path[512];
+    ProgramCacheFilePath(path, sizeof(path), key);
+    FILE* f = fopen(path, "rb");
+    if(!f) return 0;
+    
+    uint32_t program = 0;
+    ProgramCacheHeader header;
+    if(fread(&header, sizeof(header), 1, f) == 1 && header.magic == ProgramCacheMagic)
+    {
+        void* binary = malloc(header.length);
+        if(fread(binary, header.length, 1, f) == 1)
+        {
+            program = glCreateProgram();
+            glProgramBinary(program, header.format, binary, header.length);
+            
+            int success;
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            if(!success)
+            {
+                glDeleteProgram(program);
+                program = 0;
+            }
+        }
+        
+        free(binary);
+    }
+    
+    fclose(f);
+    
+    // The modification time is the last use, for PruneProgramCache
+    if(program) TouchFile(path);
+    return program;
+}
+
+// Call before linking a program that will be stored
+void PrepareProgramForCache(uint32_t program)
+{
+    if(programCache.enabled)
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+struct
+{
+    char name[32];
+    int64_t mtime;
+    int64_t size;
+} typedef ProgramCacheFile;
+
+struct
+{
+    ProgramCacheFile* files;
+    int numFiles;
+    int capacity;
+} typedef ProgramCacheListing;
+
+void AddProgramCacheFile(void* userData, const char* name)
+{
+    ProgramCacheListing* listing = (ProgramCacheListing*)userData;
+    size_t len = strlen(name);
+    if(len < 4 || len >= sizeof(listing->files[0].name) || strcmp(name + len - 4, ".bin") != 0) return;
+    
+    if(listing->numFiles == listing->capacity)
+    {
+        listing->capacity = listing->capacity ? listing->capacity * 2 : 64;
+        listing->files = realloc(listing->files, listing->capacity * sizeof(ProgramCacheFile));
+    }
+    
+    char path[512];
+    ProgramCacheFile* file = &listing->files[listing->numFiles];
+    snprintf(path, sizeof(path), "%s%s", programCache.path, name);
+    if(!GetFileInfo(path, &file->mtime, &file->size)) return;
+    
+    strcpy(file->name, name);
+    ++listing->numFiles;
+}
+
+int CompareProgramCacheFiles(const void* a, const void* b)
+{
+    int64_t mtimeA = ((const ProgramCacheFile*)a)->mtime;
+    int64_t mtimeB = ((const ProgramCacheFile*)b)->mtime;
+    return mtimeA < mtimeB ? 1 : mtimeA > mtimeB ? -1 : 0;  // Most recent first
+}
+
+// Deletes the least recently used programs until the folder fits in ProgramCacheMaxBytes.
+// The one that was just stored is always kept
+void PruneProgramCache(uint64_t keepKey)
+{
+    char keepName[32];
+    snprintf(keepName, sizeof(keepName), "%016llx.bin", (unsigned long long)keepKey);
+    
+    ProgramCacheListing listing = {0};
+    ListFiles(programCache.path, AddProgramCacheFile, &listing);
+    qsort(listing.files, listing.numFiles, sizeof(ProgramCacheFile), CompareProgramCacheFiles);
+    
+    int64_t totalSize = 0;
+    for(int i = 0; i < listing.numFiles; ++i)
+    {
+        totalSize += listing.files[i].size;
+        if(totalSize <= ProgramCacheMaxBytes || strcmp(listing.files[i].name, keepName) == 0) continue;
+        
+        char path[512];
+        snprintf(path, sizeof(path), "%s%s", programCache.path, listing.files[i].name);
+        remove(path);
+    }
+    
+    free(listing.files);
+}
+
+// Written under a temporary name and renamed, so that an interrupted write
+// doesn't leave a truncated program behind
+void StoreCachedProgram(uint64_t key, uint32_t program)
+{
+    if(!programCache.enabled) return;
+    
+    int length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0) return;
+    
+    void* binary = malloc(length);
+    ProgramCacheHeader header = {ProgramCacheMagic, 0, 0};
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &header.format, binary);
+    header.length = (uint32_t)written;
+    
+    char path[512];
+    ProgramCacheFilePath(path, sizeof(path), key);
+    char tmpPath[520];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    
+    FILE* f = fopen(tmpPath, "wb");
+    if(f)
+    {
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = ok && fwrite(binary, written, 1, f) == 1;
+        ok = fclose(f) == 0 && ok;
+        
+        if(ok) ok = RenameFile(tmpPath, path);
+        if(!ok) remove(tmpPath);
+        if(ok) PruneProgramCache(key);
+    }
+    
+    free(binary);
+}
+
+void PrintProgramCacheStats()
+{
+    printf("Shader programs: %d compiled, %d loaded from the cache%s (%.2fs)\n",
+           programCache.numCompiled, programCache.numLoaded,
+           programCache.enabled ? "" : " (disabled)", programCache.seconds);
+}
@@ -0,0 +1,472 @@
+// Scene description, loaded from text files and shared by both backends.
+// See scenes/scene1.txt for the file format.
+
+#define MatType_Matte       0
+#define MatType_Reflective  1
+#define MatType_Glossy      2
+#define MatType_Transparent 3
+
+struct
+{
+    uint32_t matType;
+    
+    Vec3 emissionScale;
+    Vec3 colorScale;
+    float roughnessScale;
+    
+    // Texture ids (texture 0 is always white)
+    uint32_t emission;
+    uint32_t color;
+    uint32_t roughness;
+} typedef Material;
+
+struct
+{
+    Vec3 pos;
+    float rad;
+    uint32_t matId;
+} typedef Sphere;
+
+// Same conventions as the Quad struct in the shader:
+// triangles are (p0, p1, p2, p1, p3, p2)
+struct
+{
+    Vec3 p[4];
+    Vec2 coords[4];
+    uint32_t matId;
+} typedef Quad;
+
+struct
+{
+    bool loaded;  // Scenes which aren't loaded render as black
+    uint32_t envMap;
+    
+    Material* materials;
+    int numMaterials;
+    Sphere* spheres;
+    int numSpheres;
+    Quad* quads;
+    int numQuads;
+    
+    Bvh bvh;  // Over spheres and quads, see PrimRefQuadBit
+    
+    // Indices of the emissive spheres, for next event estimation
+    uint32_t* lights;
+    int numLights;
+} typedef Scene;
+
+// Indexed by the scene number (keys 0-9)
+static Scene scenes[MaxScenes];
+
+// Layout of the scene data in the texture buffers (RGBA32F texels per object),
+// must match the Get* functions in the shader
+#define SphereTexels   2  // (pos, rad), (matId, -, -, -)
+#define QuadTexels     6  // (p0, matId), p1, p2, p3, (uv0, uv1), (uv2, uv3)
+#define MaterialTexels 3  // (type, emission, color, roughness), (emissionScale, roughnessScale), colorScale
+#define BvhNodeTexels  2  // (min, offset), (max, count), see BvhNode
+
+// BVH leaves reference spheres by index, and quads by index with the top bit set
+#define PrimRefQuadBit 0x80000000u
+
+#define MaxMaterialName 64
+
+int FindMaterial(char (*names)[MaxMaterialName], int numNames, const char* name)
+{
+    for(int i = 0; i < numNames; ++i)
+    {
+        if(strcmp(names[i], name) == 0)
+            return i;
+    }
+    
+    return -1;
+}
+
+int ParseMatType(const char* str)
+{
+    if(strcmp(str, "matte") == 0)       return MatType_Matte;
+    if(strcmp(str, "reflective") == 0)  return MatType_Reflective;
+    if(strcmp(str, "glossy") == 0)      return MatType_Glossy;
+    if(strcmp(str, "transparent") == 0) return MatType_Transparent;
+    return -1;
+}
+
+// Grows the array if it's full. Returns the (possibly moved) array.
+void* GrowArray(void* array, int count, int* capacity, size_t elemSize)
+{
+    if(count < *capacity) return array;
+    
+    *capacity = *capacity == 0 ? 16 : *capacity * 2;
+    return realloc(array, *capacity * elemSize);
+}
+
+void FreeScene(Scene* scene)
+{
+    free(scene->materials);
+    free(scene->spheres);
+    free(scene->quads);
+    FreeBvh(&scene->bvh);
+    free(scene->lights);
+    memset(scene, 0, sizeof(Scene));
+}
+
+void BuildSceneBvh(Scene* scene)
+{
+    int numPrims = scene->numSpheres + scene->numQuads;
+    Aabb* bounds = malloc(numPrims * sizeof(Aabb));
+    uint32_t* refs = malloc(numPrims * sizeof(uint32_t));
+    
+    for(int i = 0; i < scene->numSpheres; ++i)
+    {
+        Sphere* s = &scene->spheres[i];
+        float r = fabsf(s->rad);
+        Vec3 ext = {r, r, r};
+        bounds[i].min = Sub(s->pos, ext);
+        bounds[i].max = Sum(s->pos, ext);
+        refs[i] = (uint32_t)i;
+    }
+    
+    for(int i = 0; i < scene->numQuads; ++i)
+    {
+        Aabb* b = &bounds[scene->numSpheres + i];
+        *b = EmptyAabb();
+        for(int j = 0; j < 4; ++j)
+            *b = AabbGrow(*b, scene->quads[i].p[j]);
+        
+        refs[scene->numSpheres + i] = (uint32_t)i | PrimRefQuadBit;
+    }
+    
+    FreeBvh(&scene->bvh);
+    scene->bvh = BuildBvh(bounds, refs, numPrims);
+    
+    free(bounds);
+    free(refs);
+}
+
+// Every sphere with an emissive material is a light
+void BuildSceneLights(Scene* scene)
+{
+    free(scene->lights);
+    scene->lights = malloc((scene->numSpheres + 1) * sizeof(uint32_t));
+    scene->numLights = 0;
+    
+    for(int i = 0; i < scene->numSpheres; ++i)
+    {
+        Vec3 e = scene->materials[scene->spheres[i].matId].emissionScale;
+        if(e.x > 0.0f || e.y > 0.0f || e.z > 0.0f)
+            scene->lights[scene->numLights++] = (uint32_t)i;
+    }
+}
+
+SceneVariantKey GetSceneVariantKey(Scene* scene)
+{
+    SceneVariantKey res = {0};
+    res.envMap = scene->loaded ? (int32_t)scene->envMap : -1;
+    res.hasLights = scene->numLights > 0;
+    for(int i = 0; i < scene->numMaterials; ++i)
+        res.matTypeMask |= 1u << scene->materials[i].matType;
+    
+    return res;
+}
+
+// Returns false if the file couldn't be opened or is malformed
+bool LoadScene(const char* path, Scene* scene)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f) return false;
+    
+    Scene res = {0};
+    res.loaded = true;
+    
+    char (*matNames)[MaxMaterialName] = NULL;
+    int matCapacity = 0, sphereCapacity = 0, quadCapacity = 0;
+    
+    bool ok = true;
+    int lineNum = 0;
+    char line[1024];
+    while(ok && fgets(line, sizeof(line), f))
+    {
+        ++lineNum;
+        
+        char keyword[32];
+        if(sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#')
+            continue;
+        
+        if(strcmp(keyword, "envmap") == 0)
+        {
+            ok = sscanf(line, "%*s %u", &res.envMap) == 1 && res.envMap < ArrayCount(envMaps);
+        }
+        else if(strcmp(keyword, "material") == 0)
+        {
+            Material mat = {0};
+            char name[MaxMaterialName];
+            char type[32];
+            Vec3* e = &mat.emissionScale;
+            Vec3* c = &mat.colorScale;
+            int read = sscanf(line, "%*s %63s %31s %f %f %f %f %f %f %f %u %u %u", name, type,
+                              &e->x, &e->y, &e->z, &c->x, &c->y, &c->z, &mat.roughnessScale,
+                              &mat.emission, &mat.color, &mat.roughness);
+            int matType = ParseMatType(type);
+            ok = read == 12 && matType != -1 &&
+                 mat.emission < ArrayCount(textures) && mat.color < ArrayCount(textures) && mat.roughness < ArrayCount(textures);
+            if(!ok) break;
+            mat.matType = matType;
+            
+            int idx = res.numMaterials++;
+            int namesCapacity = matCapacity;
+            res.materials = GrowArray(res.materials, idx, &matCapacity, sizeof(Material));
+            matNames = GrowArray(matNames, idx, &namesCapacity, sizeof(matNames[0]));
+            res.materials[idx] = mat;
+            strcpy(matNames[idx], name);
+        }
+        else if(strcmp(keyword, "sphere") == 0)
+        {
+            Sphere sphere = {0};
+            char matName[MaxMaterialName];
+            int read = sscanf(line, "%*s %f %f %f %f %63s", &sphere.pos.x, &sphere.pos.y, &sphere.pos.z, &sphere.rad, matName);
+            int matId = read == 5 ? FindMaterial(matNames, res.numMaterials, matName) : -1;
+            ok = matId != -1;
+            if(!ok) break;
+            sphere.matId = matId;
+            
+            res.spheres = GrowArray(res.spheres, res.numSpheres, &sphereCapacity, sizeof(Sphere));
+            res.spheres[res.numSpheres++] = sphere;
+        }
+        else if(strcmp(keyword, "quad") == 0)
+        {
+            Quad quad = {0};
+            char matName[MaxMaterialName];
+            Vec3* p = quad.p;
+            Vec2* uv = quad.coords;
+            int read = sscanf(line, "%*s %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %63s",
+                              &p[0].x, &p[0].y, &p[0].z, &p[1].x, &p[1].y, &p[1].z,
+                              &p[2].x, &p[2].y, &p[2].z, &p[3].x, &p[3].y, &p[3].z,
+                              &uv[0].x, &uv[0].y, &uv[1].x, &uv[1].y, &uv[2].x, &uv[2].y, &uv[3].x, &uv[3].y,
+                              matName);
+            int matId = read == 21 ? FindMaterial(matNames, res.numMaterials, matName) : -1;
+            ok = matId != -1;
+            if(!ok) break;
+            quad.matId = matId;
+            
+            res.quads = GrowArray(res.quads, res.numQuads, &quadCapacity, sizeof(Quad));
+            res.quads[res.numQuads++] = quad;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    
+    fclose(f);
+    free(matNames);
+    
+    if(!ok)
+    {
+        fprintf(stderr, "Failed to parse scene file %s (line %d)\n", path, lineNum);
+        FreeScene(&res);
+        return false;
+    }
+    
+    BuildSceneBvh(&res);
+    BuildSceneLights(&res);
+    
+    FreeScene(scene);
+    *scene = res;
+    return true;
+}
+
+// Loads scenes/scene<N>.txt for every scene number that has a file
+void LoadAllScenes()
+{
+    for(int i = 0; i < MaxScenes; ++i)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%sscene%d.txt", scenesPath, i);
+        LoadScene(path, &scenes[i]);
+    }
+}
+
+// Xorshift, only used for generating test scenes
+float SceneRandomFloat(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Fills a cube with randomly placed spheres (over a floor quad), for benchmarking.
+// The cube grows with the number of objects so that the density stays the same.
+// Returns the half size of the cube. The BVH is left for the caller to build.
+float GenerateRandomScene(Scene* scene, int numObjects, uint32_t seed)
+{
+    FreeScene(scene);
+    scene->loaded = true;
+    scene->envMap = 0;
+    
+    Material mats[] =
+    {
+        {MatType_Matte,       {0}, {0.8f, 0.2f, 0.2f}, 0.0f, 0, 0, 0},
+        {MatType_Matte,       {0}, {0.2f, 0.8f, 0.2f}, 0.0f, 0, 0, 0},
+        {MatType_Matte,       {0}, {0.8f, 0.8f, 0.8f}, 0.0f, 0, 3, 0},
+        {MatType_Reflective,  {0}, {0.9f, 0.9f, 0.9f}, 0.0f, 0, 0, 0},
+        {MatType_Glossy,      {0}, {0.2f, 0.2f, 0.8f}, 0.3f, 0, 0, 0},
+        {MatType_Transparent, {0}, {1.0f, 1.0f, 1.0f}, 0.0f, 0, 0, 0},
+        {MatType_Matte,       {4.0f, 4.0f, 3.0f}, {0}, 0.0f, 0, 0, 0},
+    };
+    
+    scene->numMaterials = ArrayCount(mats);
+    scene->materials = malloc(sizeof(mats));
+    memcpy(scene->materials, mats, sizeof(mats));
+    
+    float extent = 0.6f * cbrtf((float)numObjects);
+    
+    int numSpheres = numObjects > 1 ? numObjects - 1 : 0;
+    scene->numSpheres = numSpheres;
+    scene->spheres = malloc(numSpheres * sizeof(Sphere));
+    uint32_t rng = seed ? seed : 1;
+    for(int i = 0; i < numSpheres; ++i)
+    {
+        Sphere* s = &scene->spheres[i];
+        s->pos.x = (SceneRandomFloat(&rng) * 2.0f - 1.0f) * extent;
+        s->pos.y = (SceneRandomFloat(&rng) * 2.0f - 1.0f) * extent;
+        s->pos.z = (SceneRandomFloat(&rng) * 2.0f - 1.0f) * extent;
+        s->rad = 0.1f + 0.2f * SceneRandomFloat(&rng);
+        s->matId = (uint32_t)(SceneRandomFloat(&rng) * scene->numMaterials) % scene->numMaterials;
+    }
+    
+    float y = -extent - 0.5f;
+    float size = extent * 4.0f;
+    Quad ground =
+    {
+        {{-size, y, -size}, {-size, y, size}, {size, y, -size}, {size, y, size}},
+        {{0.0f, 0.0f}, {0.0f, 5.0f}, {5.0f, 0.0f}, {5.0f, 5.0f}},
+        2
+    };
+    
+    scene->numQuads = 1;
+    scene->quads = malloc(sizeof(Quad));
+    scene->quads[0] = ground;
+    
+    BuildSceneLights(scene);
+    return extent;
+}
+
+/////////////////////////////////
+// GPU upload
+
+// Writes the scene in the texture buffer layout expected by the shader
+// (see SphereTexels, QuadTexels and MaterialTexels)
+float* PackSpheres(Scene* scene)
+{
+    float* res = calloc((size_t)scene->numSpheres * SphereTexels * 4, sizeof(float));
+    for(int i = 0; i < scene->numSpheres; ++i)
+    {
+        Sphere* s = &scene->spheres[i];
+        float* t = res + (size_t)i * SphereTexels * 4;
+        t[0] = s->pos.x; t[1] = s->pos.y; t[2] = s->pos.z; t[3] = s->rad;
+        t[4] = (float)s->matId;
+    }
+    
+    return res;
+}
+
+float* PackQuads(Scene* scene)
+{
+    float* res = calloc((size_t)scene->numQuads * QuadTexels * 4, sizeof(float));
+    for(int i = 0; i < scene->numQuads; ++i)
+    {
+        Quad* q = &scene->quads[i];
+        float* t = res + (size_t)i * QuadTexels * 4;
+        for(int j = 0; j < 4; ++j)
+        {
+            t[j*4+0] = q->p[j].x;
+            t[j*4+1] = q->p[j].y;
+            t[j*4+2] = q->p[j].z;
+        }
+        t[3] = (float)q->matId;
+        
+        for(int j = 0; j < 4; ++j)
+        {
+            t[16 + j*2 + 0] = q->coords[j].x;
+            t[16 + j*2 + 1] = q->coords[j].y;
+        }
+    }
+    
+    return res;
+}
+
+float* PackMaterials(Scene* scene)
+{
+    float* res = calloc((size_t)scene->numMaterials * MaterialTexels * 4, sizeof(float));
+    for(int i = 0; i < scene->numMaterials; ++i)
+    {
+        Material* m = &scene->materials[i];
+        float* t = res + (size_t)i * MaterialTexels * 4;
+        t[0] = (float)m->matType;
+        t[1] = (float)m->emission;
+        t[2] = (float)m->color;
+        t[3] = (float)m->roughness;
+        t[4] = m->emissionScale.x; t[5] = m->emissionScale.y; t[6] = m->emissionScale.z;
+        t[7] = m->roughnessScale;
+        t[8] = m->colorScale.x; t[9] = m->colorScale.y; t[10] = m->colorScale.z;
+    }
+    
+    return res;
+}
+
+// Creates a buffer + buffer texture pair. Empty buffers still get one texel.
+void CreateTextureBuffer(uint32_t* buffer, uint32_t* texture, GLenum format, void* data, size_t size)
+{
+    float empty[4] = {0};
+    glGenBuffers(1, buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, *buffer);
+    if(size > 0)
+        glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+    else
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(empty), empty, GL_STATIC_DRAW);
+    
+    glGenTextures(1, texture);
+    glBindTexture(GL_TEXTURE_BUFFER, *texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, *buffer);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+void UploadScene(SceneBuffers* res, Scene* scene)
+{
+    int maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    if(scene->numQuads * QuadTexels > maxTexels || scene->numSpheres * SphereTexels > maxTexels ||
+       scene->bvh.numNodes * BvhNodeTexels > maxTexels)
+        fprintf(stderr, "Scene is too big for this driver (GL_MAX_TEXTURE_BUFFER_SIZE is %d)\n", maxTexels);
+    
+    float* spheres = PackSpheres(scene);
+    float* quads = PackQuads(scene);
+    float* materials = PackMaterials(scene);
+    float* bvhNodes = PackBvhNodes(&scene->bvh);
+    
+    size_t texelSize = 4 * sizeof(float);
+    CreateTextureBuffer(&res->sphereBuffer, &res->sphereTex, GL_RGBA32F, spheres, scene->numSpheres * SphereTexels * texelSize);
+    CreateTextureBuffer(&res->quadBuffer, &res->quadTex, GL_RGBA32F, quads, scene->numQuads * QuadTexels * texelSize);
+    CreateTextureBuffer(&res->materialBuffer, &res->materialTex, GL_RGBA32F, materials, scene->numMaterials * MaterialTexels * texelSize);
+    CreateTextureBuffer(&res->bvhNodeBuffer, &res->bvhNodeTex, GL_RGBA32F, bvhNodes, scene->bvh.numNodes * BvhNodeTexels * texelSize);
+    CreateTextureBuffer(&res->bvhPrimBuffer, &res->bvhPrimTex, GL_R32UI, scene->bvh.prims, scene->bvh.numPrims * sizeof(uint32_t));
+    CreateTextureBuffer(&res->lightBuffer, &res->lightTex, GL_R32UI, scene->lights, scene->numLights * sizeof(uint32_t));
+    
+    free(spheres);
+    free(quads);
+    free(materials);
+    free(bvhNodes);
+}
+
+void DeleteSceneBuffers(SceneBuffers* buffers)
+{
+    uint32_t bufs[6] = {buffers->sphereBuffer, buffers->quadBuffer, buffers->materialBuffer,
+                        buffers->bvhNodeBuffer, buffers->bvhPrimBuffer, buffers->lightBuffer};
+    uint32_t texs[6] = {buffers->sphereTex, buffers->quadTex, buffers->materialTex,
+                        buffers->bvhNodeTex, buffers->bvhPrimTex, buffers->lightTex};
+    glDeleteBuffers(6, bufs);
+    glDeleteTextures(6, texs);
+    memset(buffers, 0, sizeof(SceneBuffers));
+}
@@ -0,0 +1,738 @@
+// GPU formats of the env maps and textures, with CPU encoders and decoders.
+// BC6H and BC7 (BPTC) are block compressed: every 4x4 block takes 16 bytes, a
+// sixth of RGB32F and a quarter of RGBA8. The encoders are simple rather than
+// optimal: they only write BC6H mode 11 and BC7 mode 6 (a single subset with
+// 4 bit indices), with endpoints along the principal axis of the block, refined
+// by least squares. The decoders only handle those modes, which is all they ever
+// see, so that the CPU renderer samples the same texels as the GPU.
+// Images are stored with their full mip chain: the levels follow each other,
+// from the largest to 1x1, each one box filtered from the previous one before
+// being encoded.
+
+struct
+{
+    const char* name;  // On the command line and in the asset cache
+    GLenum internalFormat;
+    GLenum format, type;  // Upload format of uncompressed data
+    int texelSize;  // 0 for block compressed formats
+    bool hdr;  // Encoded from and decoded to RGB floats, otherwise RGBA8
+} typedef ImageFormatInfo;
+
+static const ImageFormatInfo imageFormats[ImageFormat_Count] =
+{
+    {"rgb32f", GL_RGB32F, GL_RGB, GL_FLOAT, 12, true},
+    {"rgb16f", GL_RGB16F, GL_RGB, GL_HALF_FLOAT, 6, true},
+    {"rgb9e5", GL_RGB9_E5, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, 4, true},
+    {"bc6h", GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, 0, 0, 0, true},
+    {"rgba8", GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, 4, false},
+    {"bc7", GL_COMPRESSED_RGBA_BPTC_UNORM, 0, 0, 0, false},
+    {"r32f", GL_R32F, GL_RED, GL_FLOAT, 4, true},
+};
+
+#define BptcBlockSize 16  // Bytes per 4x4 block
+#define MaxMipLevels 16
+
+bool IsBlockCompressed(ImageFormat format)
+{
+    return imageFormats[format].texelSize == 0;
+}
+
+// Size of a single level. Blocks cover 4x4 texels even if the level is smaller
+size_t ImageFormatSize(ImageFormat format, int width, int height)
+{
+    if(IsBlockCompressed(format))
+        return (size_t)((width + 3) / 4) * ((height + 3) / 4) * BptcBlockSize;
+    return (size_t)width * height * imageFormats[format].texelSize;
+}
+
+int ImageMipLevels(int width, int height)
+{
+    int levels = 1;
+    while(width > 1 || height > 1)
+    {
+        width  = width  > 1 ? width  / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        ++levels;
+    }
+    
+    return levels;
+}
+
+static inline int MipSize(int size, int level)
+{
+    return size >> level > 0 ? size >> level : 1;
+}
+
+// Offset of a level in a mip chain. ImageLevelOffset(..., ImageMipLevels(width, height))
+// is the size of the whole chain
+size_t ImageLevelOffset(ImageFormat format, int width, int height, int level)
+{
+    size_t offset = 0;
+    for(int i = 0; i < level; ++i)
+        offset += ImageFormatSize(format, MipSize(width, i), MipSize(height, i));
+    return offset;
+}
+
+size_t ImageMipChainSize(ImageFormat format, int width, int height)
+{
+    return ImageLevelOffset(format, width, height, ImageMipLevels(width, height));
+}
+
+/////////////////////////////////
+// Half floats and shared exponents
+
+// Round to nearest even. From Fabian Giesen's float_to_half_fast3_rtne
+uint16_t FloatToHalf(float value)
+{
+    union { uint32_t u; float f; } f, f32Infinity, f16Max, denormMagic;
+    f32Infinity.u = 255u << 23;
+    f16Max.u = (127u + 16u) << 23;
+    denormMagic.u = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+    
+    f.f = value;
+    uint32_t sign = f.u & 0x80000000u;
+    f.u ^= sign;
+    
+    uint16_t res;
+    if(f.u >= f16Max.u)
+        res = f.u > f32Infinity.u ? 0x7e00 : 0x7c00;  // NaN or infinity
+    else if(f.u < (113u << 23))
+    {
+        // Subnormal, let the FPU do the rounding
+        f.f += denormMagic.f;
+        res = (uint16_t)(f.u - denormMagic.u);
+    }
+    else
+    {
+        uint32_t mantissaOdd = (f.u >> 13) & 1;
+        f.u += ((uint32_t)(15 - 127) << 23) + 0xfff;
+        f.u += mantissaOdd;
+        res = (uint16_t)(f.u >> 13);
+    }
+    
+    return res | (uint16_t)(sign >> 16);
+}
+
+float HalfToFloat(uint16_t value)
+{
+    union { uint32_t u; float f; } res, magic;
+    magic.u = 113u << 23;
+    const uint32_t shiftedExp = 0x7c00u << 13;
+    
+    res.u = (uint32_t)(value & 0x7fff) << 13;
+    uint32_t exp = shiftedExp & res.u;
+    res.u += (127u - 15u) << 23;
+    if(exp == shiftedExp)
+        res.u += (128u - 16u) << 23;  // Infinity or NaN
+    else if(exp == 0)
+    {
+        // Subnormal
+        res.u += 1u << 23;
+        res.f -= magic.f;
+    }
+    
+    res.u |= (uint32_t)(value & 0x8000) << 16;
+    return res.f;
+}
+
+// As in the EXT_texture_shared_exponent spec: 9 bit mantissas and a 5 bit exponent
+uint32_t EncodeRgb9e5(const float* rgb)
+{
+    const float maxValue = 65408.0f;  // 511/512 * 2^16
+    float c[3];
+    float maxC = 0.0f;
+    for(int i = 0; i < 3; ++i)
+    {
+        c[i] = rgb[i] > 0.0f ? (rgb[i] < maxValue ? rgb[i] : maxValue) : 0.0f;
+        maxC = c[i] > maxC ? c[i] : maxC;
+    }
+    
+    int exp = 0;  // floor(log2(maxC)) + 16, at least 0
+    if(maxC > 0.0f)
+    {
+        int e;
+        frexpf(maxC, &e);
+        exp = e - 1 > -16 ? e - 1 + 16 : 0;
+    }
+    
+    if(floorf(maxC / ldexpf(1.0f, exp - 24) + 0.5f) >= 512.0f) ++exp;
+    
+    float scale = 1.0f / ldexpf(1.0f, exp - 24);
+    uint32_t res = (uint32_t)exp << 27;
+    for(int i = 0; i < 3; ++i)
+    {
+        uint32_t m = (uint32_t)floorf(c[i] * scale + 0.5f);
+        res |= (m < 511 ? m : 511) << (9 * i);
+    }
+    
+    return res;
+}
+
+void DecodeRgb9e5(uint32_t value, float* rgb)
+{
+    float scale = ldexpf(1.0f, (int)(value >> 27) - 24);
+    for(int i = 0; i < 3; ++i)
+        rgb[i] = (float)((value >> (9 * i)) & 511) * scale;
+}
+
+/////////////////////////////////
+// BC6H and BC7
+
+static const int bptcWeights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+// Blocks are little endian bit streams
+static void WriteBits(uint8_t* block, int* pos, uint32_t value, int count)
+{
+    for(int i = 0; i < count; ++i, ++*pos)
+    {
+        if((value >> i) & 1)
+            block[*pos >> 3] |= (uint8_t)(1 << (*pos & 7));
+    }
+}
+
+static uint32_t ReadBits(const uint8_t* block, int* pos, int count)
+{
+    uint32_t res = 0;
+    for(int i = 0; i < count; ++i, ++*pos)
+        res |= (uint32_t)((block[*pos >> 3] >> (*pos & 7)) & 1) << i;
+    return res;
+}
+
+// Endpoints of the segment covering the texels along their principal axis
+static void FitBlockEndpoints(const float texels[16][4], int numChannels, float* e0, float* e1)
+{
+    float mean[4] = {0};
+    for(int i = 0; i < 16; ++i)
+        for(int c = 0; c < numChannels; ++c)
+            mean[c] += texels[i][c] / 16.0f;
+    
+    float cov[4][4] = {0};
+    for(int i = 0; i < 16; ++i)
+    {
+        for(int a = 0; a < numChannels; ++a)
+            for(int b = 0; b < numChannels; ++b)
+                cov[a][b] += (texels[i][a] - mean[a]) * (texels[i][b] - mean[b]);
+    }
+    
+    // Power iteration
+    float axis[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+    for(int iter = 0; iter < 8; ++iter)
+    {
+        float next[4] = {0};
+        float len = 0.0f;
+        for(int a = 0; a < numChannels; ++a)
+        {
+            for(int b = 0; b < numChannels; ++b)
+                next[a] += cov[a][b] * axis[b];
+            len += next[a] * next[a];
+        }
+        
+        if(len < 1e-12f) break;  // Flat block, any axis works
+        for(int a = 0; a < numChannels; ++a)
+            axis[a] = next[a] / sqrtf(len);
+    }
+    
+    float minT = FLT_MAX, maxT = -FLT_MAX;
+    for(int i = 0; i < 16; ++i)
+    {
+        float t = 0.0f;
+        for(int c = 0; c < numChannels; ++c)
+            t += (texels[i][c] - mean[c]) * axis[c];
+        minT = t < minT ? t : minT;
+        maxT = t > maxT ? t : maxT;
+    }
+    
+    for(int c = 0; c < numChannels; ++c)
+    {
+        e0[c] = mean[c] + axis[c] * minT;
+        e1[c] = mean[c] + axis[c] * maxT;
+    }
+}
+
+// Least squares endpoints for the chosen indices. Returns false if they're degenerate
+static bool RefineBlockEndpoints(const float texels[16][4], int numChannels, const int* indices, float* e0, float* e1)
+{
+    float a = 0.0f, b = 0.0f, c = 0.0f;
+    float x[4] = {0}, y[4] = {0};
+    for(int i = 0; i < 16; ++i)
+    {
+        float t = bptcWeights[indices[i]] / 64.0f;
+        float s = 1.0f - t;
+        a += s * s;
+        b += s * t;
+        c += t * t;
+        for(int ch = 0; ch < numChannels; ++ch)
+        {
+            x[ch] += s * texels[i][ch];
+            y[ch] += t * texels[i][ch];
+        }
+    }
+    
+    float det = a * c - b * b;
+    if(fabsf(det) < 1e-6f) return false;
+    
+    for(int ch = 0; ch < numChannels; ++ch)
+    {
+        e0[ch] = (c * x[ch] - b * y[ch]) / det;
+        e1[ch] = (a * y[ch] - b * x[ch]) / det;
+    }
+    
+    return true;
+}
+
+// Picks the closest palette entry for every texel. The palette is interpolated
+// like the hardware does it. Returns the squared error
+static float FindBlockIndices(const float texels[16][4], int numChannels, const int* v0, const int* v1, int* indices)
+{
+    float palette[16][4];
+    for(int w = 0; w < 16; ++w)
+        for(int c = 0; c < numChannels; ++c)
+            palette[w][c] = (float)(((64 - bptcWeights[w]) * v0[c] + bptcWeights[w] * v1[c] + 32) >> 6);
+    
+    float err = 0.0f;
+    for(int i = 0; i < 16; ++i)
+    {
+        float bestErr = FLT_MAX;
+        for(int w = 0; w < 16; ++w)
+        {
+            float e = 0.0f;
+            for(int c = 0; c < numChannels; ++c)
+            {
+                float d = palette[w][c] - texels[i][c];
+                e += d * d;
+            }
+            
+            if(e < bestErr)
+            {
+                bestErr = e;
+                indices[i] = w;
+            }
+        }
+        
+        err += bestErr;
+    }
+    
+    return err;
+}
+
+// BC6H endpoints are interpolated as 16 bit integers, and the result is scaled by
+// 31/64 to get the bits of a half float, so the encoder works in that space
+static float HalfToBc6h(float value)
+{
+    uint16_t h = FloatToHalf(value > 0.0f ? value : 0.0f);
+    if(h > 0x7bff) h = 0x7bff;  // Largest finite half
+    return h * 64.0f / 31.0f;
+}
+
+static int UnquantizeBc6h(int q)
+{
+    return q == 0 ? 0 : (q == 1023 ? 0xffff : (q << 6) + 32);
+}
+
+static int QuantizeBc6h(float value)
+{
+    int q = (int)floorf((value - 32.0f) / 64.0f + 0.5f);
+    q = q < 0 ? 0 : (q > 1023 ? 1023 : q);
+    
+    // The ends of the range unquantize differently
+    int best = q;
+    for(int n = q - 1; n <= q + 1; n += 2)
+    {
+        if(n >= 0 && n <= 1023 && fabsf(UnquantizeBc6h(n) - value) < fabsf(UnquantizeBc6h(best) - value))
+            best = n;
+    }
+    
+    return best;
+}
+
+// Mode 11: 10 bit endpoints, stored as is
+static void EncodeBc6hBlock(const float texels[16][4], uint8_t* block)
+{
+    float e0[4], e1[4];
+    FitBlockEndpoints(texels, 3, e0, e1);
+    
+    int q[2][3], indices[16];
+    float bestErr = FLT_MAX;
+    for(int iter = 0; iter < 2; ++iter)
+    {
+        int cur[2][3], v0[3], v1[3], curIndices[16];
+        for(int c = 0; c < 3; ++c)
+        {
+            cur[0][c] = QuantizeBc6h(e0[c]);
+            cur[1][c] = QuantizeBc6h(e1[c]);
+            v0[c] = UnquantizeBc6h(cur[0][c]);
+            v1[c] = UnquantizeBc6h(cur[1][c]);
+        }
+        
+        float err = FindBlockIndices(texels, 3, v0, v1, curIndices);
+        if(err < bestErr)
+        {
+            bestErr = err;
+            memcpy(q, cur, sizeof(q));
+            memcpy(indices, curIndices, sizeof(indices));
+        }
+        
+        if(!RefineBlockEndpoints(texels, 3, indices, e0, e1)) break;
+    }
+    
+    // The first index is stored without its top bit, which has to be 0
+    if(indices[0] >= 8)
+    {
+        for(int c = 0; c < 3; ++c)
+        {
+            int tmp = q[0][c];
+            q[0][c] = q[1][c];
+            q[1][c] = tmp;
+        }
+        for(int i = 0; i < 16; ++i)
+            indices[i] = 15 - indices[i];
+    }
+    
+    memset(block, 0, BptcBlockSize);
+    int pos = 0;
+    WriteBits(block, &pos, 0x03, 5);
+    for(int e = 0; e < 2; ++e)
+        for(int c = 0; c < 3; ++c)
+            WriteBits(block, &pos, q[e][c], 10);
+    for(int i = 0; i < 16; ++i)
+        WriteBits(block, &pos, indices[i], i == 0 ? 3 : 4);
+}
+
+static void DecodeBc6hBlock(const uint8_t* block, float texels[16][4])
+{
+    int pos = 0;
+    if(ReadBits(block, &pos, 5) != 0x03)
+    {
+        memset(texels, 0, sizeof(float) * 16 * 4);
+        return;
+    }
+    
+    int v[2][3];
+    for(int e = 0; e < 2; ++e)
+        for(int c = 0; c < 3; ++c)
+            v[e][c] = UnquantizeBc6h(ReadBits(block, &pos, 10));
+    
+    for(int i = 0; i < 16; ++i)
+    {
+        int w = bptcWeights[ReadBits(block, &pos, i == 0 ? 3 : 4)];
+        for(int c = 0; c < 3; ++c)
+        {
+            int value = ((64 - w) * v[0][c] + w * v[1][c] + 32) >> 6;
+            texels[i][c] = HalfToFloat((uint16_t)((value * 31) >> 6));
+        }
+    }
+}
+
+static int QuantizeBc7(float value, int pBit)
+{
+    int q = (int)floorf((value - pBit) * 0.5f + 0.5f);
+    return q < 0 ? 0 : (q > 127 ? 127 : q);
+}
+
+// Mode 6: RGBA endpoints with 7 bits and a p-bit (the shared lowest bit) each
+static void EncodeBc7Block(const float texels[16][4], uint8_t* block)
+{
+    float e0[4], e1[4];
+    FitBlockEndpoints(texels, 4, e0, e1);
+    
+    int q[2][4], pBits[2], indices[16];
+    float bestErr = FLT_MAX;
+    for(int iter = 0; iter < 2; ++iter)
+    {
+        for(int p = 0; p < 4; ++p)
+        {
+            int curP[2] = {p & 1, p >> 1};
+            int cur[2][4], v0[4], v1[4], curIndices[16];
+            for(int c = 0; c < 4; ++c)
+            {
+                cur[0][c] = QuantizeBc7(e0[c], curP[0]);
+                cur[1][c] = QuantizeBc7(e1[c], curP[1]);
+                v0[c] = (cur[0][c] << 1) | curP[0];
+                v1[c] = (cur[1][c] << 1) | curP[1];
+            }
+            
+            float err = FindBlockIndices(texels, 4, v0, v1, curIndices);
+            if(err < bestErr)
+            {
+                bestErr = err;
+                memcpy(q, cur, sizeof(q));
+                memcpy(pBits, curP, sizeof(pBits));
+                memcpy(indices, curIndices, sizeof(indices));
+            }
+        }
+        
+        if(bestErr == 0.0f || !RefineBlockEndpoints(texels, 4, indices, e0, e1)) break;
+    }
+    
+    // The first index is stored without its top bit, which has to be 0
+    if(indices[0] >= 8)
+    {
+        for(int c = 0; c < 4; ++c)
+        {
+            int tmp = q[0][c];
+            q[0][c] = q[1][c];
+            q[1][c] = tmp;
+        }
+        int tmp = pBits[0];
+        pBits[0] = pBits[1];
+        pBits[1] = tmp;
+        for(int i = 0; i < 16; ++i)
+            indices[i] = 15 - indices[i];
+    }
+    
+    memset(block, 0, BptcBlockSize);
+    int pos = 0;
+    WriteBits(block, &pos, 1 << 6, 7);
+    for(int c = 0; c < 4; ++c)
+        for(int e = 0; e < 2; ++e)
+            WriteBits(block, &pos, q[e][c], 7);
+    WriteBits(block, &pos, pBits[0], 1);
+    WriteBits(block, &pos, pBits[1], 1);
+    for(int i = 0; i < 16; ++i)
+        WriteBits(block, &pos, indices[i], i == 0 ? 3 : 4);
+}
+
+static void DecodeBc7Block(const uint8_t* block, uint8_t texels[16][4])
+{
+    int pos = 0;
+    if(ReadBits(block, &pos, 7) != 1 << 6)
+    {
+        memset(texels, 0, 16 * 4);
+        return;
+    }
+    
+    int q[2][4];
+    for(int c = 0; c < 4; ++c)
+        for(int e = 0; e < 2; ++e)
+            q[e][c] = ReadBits(block, &pos, 7);
+    
+    int p0 = ReadBits(block, &pos, 1);
+    int p1 = ReadBits(block, &pos, 1);
+    for(int i = 0; i < 16; ++i)
+    {
+        int w = bptcWeights[ReadBits(block, &pos, i == 0 ? 3 : 4)];
+        for(int c = 0; c < 4; ++c)
+        {
+            int v0 = (q[0][c] << 1) | p0;
+            int v1 = (q[1][c] << 1) | p1;
+            texels[i][c] = (uint8_t)(((64 - w) * v0 + w * v1 + 32) >> 6);
+        }
+    }
+}
+
+/////////////////////////////////
+// Images
+
+// Format of the pixels that are encoded, and that the CPU renderer samples
+static inline ImageFormat SourceImageFormat(ImageFormat format)
+{
+    return imageFormats[format].hdr ? ImageFormat_Rgb32f : ImageFormat_Rgba8;
+}
+
+// Builds the mip chain of RGB floats (if hdr) or RGBA8 pixels, by averaging 2x2
+// texels of the previous level, as glGenerateMipmap would. Sizes are powers of 2
+void* BuildMipChain(bool hdr, const void* src, int width, int height)
+{
+    ImageFormat format = hdr ? ImageFormat_Rgb32f : ImageFormat_Rgba8;
+    int numChannels = hdr ? 3 : 4;
+    uint8_t* res = (uint8_t*)malloc(ImageMipChainSize(format, width, height));
+    memcpy(res, src, ImageFormatSize(format, width, height));
+    
+    int levels = ImageMipLevels(width, height);
+    for(int level = 1; level < levels; ++level)
+    {
+        int srcW = MipSize(width, level - 1), srcH = MipSize(height, level - 1);
+        int dstW = MipSize(width, level),     dstH = MipSize(height, level);
+        uint8_t* srcLevel = res + ImageLevelOffset(format, width, height, level - 1);
+        uint8_t* dstLevel = res + ImageLevelOffset(format, width, height, level);
+        for(int y = 0; y < dstH; ++y)
+        {
+            for(int x = 0; x < dstW; ++x)
+            {
+                // One of the sizes can already be 1
+                int x0 = (x * 2) % srcW, x1 = (x * 2 + 1) % srcW;
+                int y0 = (y * 2) % srcH, y1 = (y * 2 + 1) % srcH;
+                size_t texels[4] = {(size_t)y0 * srcW + x0, (size_t)y0 * srcW + x1,
+                                    (size_t)y1 * srcW + x0, (size_t)y1 * srcW + x1};
+                size_t dst = (size_t)y * dstW + x;
+                for(int c = 0; c < numChannels; ++c)
+                {
+                    if(hdr)
+                    {
+                        float* p = (float*)srcLevel;
+                        float sum = p[texels[0] * 3 + c] + p[texels[1] * 3 + c] + p[texels[2] * 3 + c] + p[texels[3] * 3 + c];
+                        ((float*)dstLevel)[dst * 3 + c] = sum * 0.25f;
+                    }
+                    else
+                    {
+                        uint8_t* p = srcLevel;
+                        int sum = p[texels[0] * 4 + c] + p[texels[1] * 4 + c] + p[texels[2] * 4 + c] + p[texels[3] * 4 + c];
+                        dstLevel[dst * 4 + c] = (uint8_t)((sum + 2) / 4);
+                    }
+                }
+            }
+        }
+    }
+    
+    return res;
+}
+
+static void EncodeImageLevel(ImageFormat format, const void* src, int width, int height, void* res)
+{
+    const float* hdr = (const float*)src;
+    const uint8_t* ldr = (const uint8_t*)src;
+    size_t numPixels = (size_t)width * height;
+    if(format == ImageFormat_Rgb16f)
+    {
+        uint16_t* dst = (uint16_t*)res;
+        for(size_t i = 0; i < numPixels * 3; ++i)
+            dst[i] = FloatToHalf(hdr[i]);
+    }
+    else if(format == ImageFormat_Rgb9e5)
+    {
+        uint32_t* dst = (uint32_t*)res;
+        for(size_t i = 0; i < numPixels; ++i)
+            dst[i] = EncodeRgb9e5(&hdr[i * 3]);
+    }
+    else
+    {
+        uint8_t* dst = (uint8_t*)res;
+        for(int by = 0; by < (height + 3) / 4; ++by)
+        {
+            for(int bx = 0; bx < (width + 3) / 4; ++bx)
+            {
+                // Blocks of levels smaller than 4x4 repeat the edge texels
+                float texels[16][4] = {0};
+                for(int i = 0; i < 16; ++i)
+                {
+                    int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+                    size_t idx = (size_t)(y < height ? y : height - 1) * width + (x < width ? x : width - 1);
+                    for(int c = 0; c < 3; ++c)
+                        texels[i][c] = format == ImageFormat_Bc6h ? HalfToBc6h(hdr[idx * 3 + c]) : ldr[idx * 4 + c];
+                    if(format == ImageFormat_Bc7) texels[i][3] = ldr[idx * 4 + 3];
+                }
+                
+                if(format == ImageFormat_Bc6h)
+                    EncodeBc6hBlock(texels, dst);
+                else
+                    EncodeBc7Block(texels, dst);
+                dst += BptcBlockSize;
+            }
+        }
+    }
+}
+
+static void DecodeImageLevel(ImageFormat format, const void* data, int width, int height, void* res)
+{
+    float* hdr = (float*)res;
+    uint8_t* ldr = (uint8_t*)res;
+    size_t numPixels = (size_t)width * height;
+    if(format == ImageFormat_Rgb16f)
+    {
+        const uint16_t* src = (const uint16_t*)data;
+        for(size_t i = 0; i < numPixels * 3; ++i)
+            hdr[i] = HalfToFloat(src[i]);
+    }
+    else if(format == ImageFormat_Rgb9e5)
+    {
+        const uint32_t* src = (const uint32_t*)data;
+        for(size_t i = 0; i < numPixels; ++i)
+            DecodeRgb9e5(src[i], &hdr[i * 3]);
+    }
+    else
+    {
+        const uint8_t* src = (const uint8_t*)data;
+        for(int by = 0; by < (height + 3) / 4; ++by)
+        {
+            for(int bx = 0; bx < (width + 3) / 4; ++bx)
+            {
+                float hdrTexels[16][4];
+                uint8_t ldrTexels[16][4];
+                if(format == ImageFormat_Bc6h)
+                    DecodeBc6hBlock(src, hdrTexels);
+                else
+                    DecodeBc7Block(src, ldrTexels);
+                src += BptcBlockSize;
+                
+                for(int i = 0; i < 16; ++i)
+                {
+                    int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+                    if(x >= width || y >= height) continue;
+                    
+                    size_t idx = (size_t)y * width + x;
+                    if(format == ImageFormat_Bc6h)
+                        memcpy(&hdr[idx * 3], hdrTexels[i], 3 * sizeof(float));
+                    else
+                        memcpy(&ldr[idx * 4], ldrTexels[i], 4);
+                }
+            }
+        }
+    }
+}
+
+// Encodes a mip chain of RGB floats (for HDR formats) or RGBA8 pixels, see
+// BuildMipChain. Returns NULL if the source already is in the format
+void* EncodeImageFormat(ImageFormat format, const void* src, int width, int height)
+{
+    ImageFormat srcFormat = SourceImageFormat(format);
+    if(format == srcFormat) return NULL;
+    
+    uint8_t* res = (uint8_t*)malloc(ImageMipChainSize(format, width, height));
+    int levels = ImageMipLevels(width, height);
+    for(int level = 0; level < levels; ++level)
+    {
+        EncodeImageLevel(format, (const uint8_t*)src + ImageLevelOffset(srcFormat, width, height, level),
+                         MipSize(width, level), MipSize(height, level),
+                         res + ImageLevelOffset(format, width, height, level));
+    }
+    
+    return res;
+}
+
+// Decodes a mip chain to RGB floats (for HDR formats) or RGBA8 pixels, for the
+// CPU renderer. Returns NULL if the data already is in that format
+void* DecodeImageFormat(ImageFormat format, const void* data, int width, int height)
+{
+    ImageFormat dstFormat = SourceImageFormat(format);
+    if(format == dstFormat) return NULL;
+    
+    uint8_t* res = (uint8_t*)malloc(ImageMipChainSize(dstFormat, width, height));
+    int levels = ImageMipLevels(width, height);
+    for(int level = 0; level < levels; ++level)
+    {
+        DecodeImageLevel(format, (const uint8_t*)data + ImageLevelOffset(format, width, height, level),
+                         MipSize(width, level), MipSize(height, level),
+                         res + ImageLevelOffset(dstFormat, width, height, level));
+    }
+    
+    return res;
+}
+
+// Quality of the first level of an encoded image against its source, in dB.
+// HDR images are compared after tonemapping, like TonemappedRmse
+float ImageFormatPsnr(ImageFormat format, const void* src, const void* encoded, int width, int height)
+{
+    void* decoded = DecodeImageFormat(format, encoded, width, height);
+    if(!decoded) return INFINITY;
+    
+    double mse = 0.0;
+    size_t numPixels = (size_t)width * height;
+    if(imageFormats[format].hdr)
+    {
+        double rmse = TonemappedRmse((float*)src, (float*)decoded, (int)numPixels);
+        mse = rmse * rmse;
+    }
+    else
+    {
+        const uint8_t* a = (const uint8_t*)src;
+        const uint8_t* b = (const uint8_t*)decoded;
+        for(size_t i = 0; i < numPixels * 4; ++i)
+        {
+            double d = ((double)a[i] - b[i]) / 255.0;
+            mse += d * d / (numPixels * 4);
+        }
+    }
+    
+    free(decoded);
+    return mse > 0.0 ? (float)(10.0 * log10(1.0 / mse)) : INFINITY;
+}